@@ -0,0 +1,145 @@
+/*
+ * bandpool.c Worker threads rendering the bands of a frame for libdjvu
+ *
+ * bandpool_run() hands out the jobs 0..n-1 (horizontal strips of a frame)
+ * to the threads of the pool and takes some itself, so that on a machine
+ * with several cores a frame is rendered by all of them at once. Each job
+ * writes its own rows of the frame and nothing else is shared. A job is
+ * also told which thread (slot) runs it, 0 being the caller, for the
+ * scratch space it needs.
+ *
+ * There is one set of jobs at a time: a second caller, the pre-render
+ * thread while the viewer's thread renders for example, does its jobs
+ * alone as if there were no pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bandpool.h"
+#include "debug.h"
+
+static struct {
+    pthread_t threads[BANDPOOL_MAX_THREADS - 1];
+    pthread_mutex_t lock;
+    pthread_cond_t cond, done;
+    int nthreads, quit, busy;
+    int (*job)(void *, int, int);
+    void *arg;
+    int njobs, next, finished, ok;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static void *worker(void *arg)
+{
+    int slot = (int)(long)arg, i, ok;
+    int (*job)(void *, int, int);
+    void *job_arg;
+
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.quit) {
+        if (pool.next >= pool.njobs) {
+            pthread_cond_wait(&pool.cond, &pool.lock);
+            continue;
+        }
+        i = pool.next++;
+        job = pool.job;
+        job_arg = pool.arg;
+        pthread_mutex_unlock(&pool.lock);
+        ok = job(job_arg, i, slot);
+        pthread_mutex_lock(&pool.lock);
+        pool.ok &= ok;
+        if (++pool.finished == pool.njobs)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/*
+   Start the pool with n threads in all (the callers of bandpool_run()
+   count as one), one per processor if n is 0. Returns how many there are.
+ */
+int bandpool_open(int n)
+{
+    long cpus;
+
+    bandpool_close();
+    if (n <= 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = cpus > 0 ? cpus : 1;
+    }
+    if (n > BANDPOOL_MAX_THREADS)
+        n = BANDPOOL_MAX_THREADS;
+    pool.quit = 0;
+    for (pool.nthreads = 0; pool.nthreads < n - 1; pool.nthreads++) {
+        if (pthread_create(&pool.threads[pool.nthreads], NULL, worker, (void *)(long)(pool.nthreads + 1))) {
+            DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+            break;
+        }
+    }
+    DPRINTF("%s: %d threads\n", __FUNCTION__, pool.nthreads + 1);
+    return pool.nthreads + 1;
+}
+
+void bandpool_close(void)
+{
+    int i;
+
+    if (!pool.nthreads)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    for (i = 0; i < pool.nthreads; i++)
+        pthread_join(pool.threads[i], NULL);
+    pool.nthreads = 0;
+}
+
+// the threads that may render at once, 1 without a pool
+int bandpool_threads(void)
+{
+    return pool.nthreads + 1;
+}
+
+/*
+   Run job(arg, i, slot) for each i from 0 to n - 1, slot being the number
+   of the thread that does it (from 0 to bandpool_threads() - 1). Returns 1
+   if all of them returned 1.
+ */
+int bandpool_run(int n, int (*job)(void *, int, int), void *arg)
+{
+    int i, ok = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.nthreads || pool.busy || n < 2) {
+        pthread_mutex_unlock(&pool.lock);
+        for (i = 0; i < n; i++)
+            ok &= job(arg, i, 0);
+        return ok;
+    }
+    pool.busy = 1;
+    pool.job = job;
+    pool.arg = arg;
+    pool.njobs = n;
+    pool.next = pool.finished = 0;
+    pool.ok = 1;
+    pthread_cond_broadcast(&pool.cond);
+    while (pool.next < pool.njobs) {
+        i = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+        ok = job(arg, i, 0);
+        pthread_mutex_lock(&pool.lock);
+        pool.ok &= ok;
+        pool.finished++;
+    }
+    while (pool.finished < pool.njobs)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    ok = pool.ok;
+    pool.njobs = pool.next = 0;
+    pool.busy = 0;
+    pthread_mutex_unlock(&pool.lock);
+    return ok;
+}
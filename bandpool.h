@@ -0,0 +1,11 @@
+#ifndef _BANDPOOL_H
+#define _BANDPOOL_H
+
+#define BANDPOOL_MAX_THREADS 8  // the calling thread included
+
+extern int bandpool_open(int);
+extern void bandpool_close(void);
+extern int bandpool_threads(void);
+extern int bandpool_run(int, int (*)(void *, int, int), void *);
+
+#endif
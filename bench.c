@@ -0,0 +1,418 @@
+/*
+ * bench.c End to end benchmark of libdjvu on the host ("make bench")
+ *
+ * Stands in for the viewer: opens each file of the corpus through the
+ * plugin's own entry points (InitDoc(), iInitDocF(), OnKeyPressed(),
+ * GetPageData(), vEndDoc()) with callbacks which draw nothing, runs a
+ * key script on it and prints the latency of each kind of step as JSON.
+ *
+ * Usage: djvubench [-s keys]... [-d ms] [-n times] [-o name=value]...
+ *                  [-f frames] [-b baseline] [-t percent] [-W] [-T trace] file.djvu...
+ *
+ *   -s  the keys to press, as defined in keyvalue.h for the host
+ *       ('0'/'9' Next/Prev, '6' next page, 'u'/'d' zoom, ','/'.' left/right,
+ *       'Y' rotate...); each script is run on a fresh opening of each file
+ *   -d  pause between two keys, the background threads work meanwhile
+ *   -n  open each file this many times
+ *   -o  a line of the .ini file; async_navigation=0 is always there so
+ *       that each step ends with its frame on the screen. The flipbook of
+ *       a file, if there is one, is used: -o flipbook=0 to leave it out
+ *   -f  check the hash of every frame against this file ("make check-perf")
+ *   -b  report each kind of step whose p50 or p95 is slower than in this
+ *       file, which holds only on the machine which wrote it
+ *   -t  by how much they may be slower than in it, 20% by default; when
+ *       it is given, being slower fails the run
+ *   -W  write the -f and -b files instead of checking against them
+ *   -T  save the trace of the steps (see trace.c) there, each opening
+ *       overwrites it. There is none by default
+ *
+ * Each step is counted as open (InitDoc() to the first frame), zoom
+ * ('u'/'d'), turn (another page shown) or scroll. Next to the whole of
+ * it, the time the calling thread spent decoding, rendering and packing
+ * is given (see bench.h); what remains was spent waiting for the
+ * background threads or elsewhere.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "libdjvu.h"
+#include "keyvalue.h"
+#include "host.h"
+#ifndef BENCH
+#define BENCH 1 // for bench.h
+#endif
+#include "bench.h"
+
+#define BENCH_SCRIPT "6666666666uu00000000000000000000....,,,,dd9999999999"
+#define BENCH_SCRIPTS 16
+#define BENCH_SLACK_MS 1.0 // timings closer than this to the baseline are never a regression
+
+// as in libdjvu.c
+#define HANLIN_V3 0
+#define HANLIN_V5 1
+#if EREADER_MODEL == HANLIN_V5
+#define MODEL_NAME  "HANLIN_V5"
+#define FRAME_BYTES (600*800)
+#else
+#define MODEL_NAME  "HANLIN_V3"
+#define FRAME_BYTES (150*800)
+#endif
+
+__thread unsigned long long bench_us[BENCH_PHASES];
+
+enum { STEP_OPEN, STEP_TURN, STEP_SCROLL, STEP_ZOOM, STEPS };
+static const char *step_names[STEPS] = { "open", "turn", "scroll", "zoom" };
+static const char *phase_names[1 + BENCH_PHASES] = { "total_ms", "decode_ms", "render_ms", "pack_ms" };
+
+// the microseconds of one step, the whole of it then each phase
+struct sample {
+    unsigned long long us[1 + BENCH_PHASES];
+};
+
+static struct {
+    struct sample *samples;
+    int count, size;
+} steps[STEPS];
+
+static unsigned long long step_start;
+
+/*
+   The frames seen, one line each (see check_frame()), and those of the
+   golden file. A run of each file and script is checked against it the
+   same way each time it is repeated.
+ */
+static struct {
+    FILE *out;
+    char **golden;
+    int ngolden, next, mismatches;
+    const char *name;
+    int script, step;
+} frames;
+
+static inline void start_step(void)
+{
+    memset(bench_us, 0, sizeof(bench_us));
+    step_start = bench_now_us();
+}
+
+static void stop_step(int step)
+{
+    struct sample *s;
+    void *p;
+
+    if (steps[step].count == steps[step].size) {
+        steps[step].size = steps[step].size ? 2*steps[step].size : 64;
+        if (!(p = realloc(steps[step].samples, steps[step].size*sizeof(*s)))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        steps[step].samples = p;
+    }
+    s = &steps[step].samples[steps[step].count++];
+    s->us[0] = bench_now_us() - step_start;
+    memcpy(s->us + 1, bench_us, sizeof(bench_us));
+}
+
+static inline unsigned long long hash_frame(const unsigned char *p)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    int n;
+
+    for (n = FRAME_BYTES; n > 0; n--)
+        h = (h ^ *p++)*1099511628211ULL;
+    return h;
+}
+
+// write the frame data after key to the frames file or check it against the golden one
+static void check_frame(int key, const void *data)
+{
+    char line[PATH_MAX + 64];
+
+    if (!frames.out && !frames.golden)
+        return;
+    snprintf(line, sizeof(line), "%s %d %d %c p%d %016llx", frames.name, frames.script, frames.step++,
+             key > ' ' && key < 0x7f ? key : '?', GetPageIndex() + 1, hash_frame(data));
+    if (frames.out) {
+        fprintf(frames.out, "%s\n", line);
+        return;
+    }
+    if (frames.next >= frames.ngolden || strcmp(line, frames.golden[frames.next])) {
+        if (frames.mismatches++ < 10)
+            fprintf(stderr, "frame %s, expected %s\n", line,
+                    frames.next < frames.ngolden ? frames.golden[frames.next] : "none");
+    }
+    frames.next++;
+}
+
+// the document opened as the viewer does it, 0 if it can't be
+static int open_file(char *path)
+{
+    void *data;
+
+    start_step();
+    if (!InitDoc(path))
+        return 0;
+    iInitDocF(path, 0, 0);
+    GetPageData(&data);
+    stop_step(STEP_OPEN);
+    check_frame('@', data);
+    return 1;
+}
+
+static void press(int key, int delay_ms)
+{
+    void *data;
+    int page = GetPageIndex();
+
+    start_step();
+    // the keys left to the viewer which move through the document
+    if (!OnKeyPressed(key, NORMALSTATE)) {
+        if (key == KEY_NEXT)
+            Next();
+        else if (key == KEY_PREV)
+            Prev();
+    }
+    GetPageData(&data);
+    if (key == KEY_SHORTCUT_VOLUME_UP || key == KEY_SHORTCUT_VOLUME_DOWN)
+        stop_step(STEP_ZOOM);
+    else
+        stop_step(GetPageIndex() != page ? STEP_TURN : STEP_SCROLL);
+    check_frame(key, data);
+    if (delay_ms)
+        usleep(delay_ms*1000);
+}
+
+static int compare_us(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// nearest rank percentile of the sorted v[n], in milliseconds
+static inline double percentile(const unsigned long long *v, int n, int p)
+{
+    int i = (p*n + 99)/100 - 1;
+
+    return v[i < 0 ? 0 : i]/1000.0;
+}
+
+// the p50, p95 and p99 of phase of the steps of a kind, 0 if there were none
+static int step_percentiles(int step, int phase, double *p)
+{
+    unsigned long long *v;
+    int i, n = steps[step].count;
+
+    if (!n || !(v = malloc(n*sizeof(*v))))
+        return 0;
+    for (i = 0; i < n; i++)
+        v[i] = steps[step].samples[i].us[phase];
+    qsort(v, n, sizeof(*v), compare_us);
+    p[0] = percentile(v, n, 50);
+    p[1] = percentile(v, n, 95);
+    p[2] = percentile(v, n, 99);
+    free(v);
+    return 1;
+}
+
+static void print_step(int step, int last)
+{
+    double p[3];
+    int ph;
+
+    printf("    \"%s\": {\"count\": %d", step_names[step], steps[step].count);
+    for (ph = 0; ph < 1 + BENCH_PHASES && step_percentiles(step, ph, p); ph++)
+        printf(", \"%s\": {\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f}", phase_names[ph], p[0], p[1], p[2]);
+    printf("}%s\n", last ? "" : ",");
+}
+
+// the lines of a file without their '\n', NULL if it can't be read
+static char **read_lines(const char *path, int *n)
+{
+    char line[PATH_MAX + 64], **lines = NULL;
+    int size = 0;
+    FILE *fp;
+    void *p;
+
+    *n = 0;
+    if (!(fp = fopen(path, "r")))
+        return NULL;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = 0;
+        if (*n == size) {
+            size = size ? 2*size : 256;
+            if (!(p = realloc(lines, size*sizeof(*lines))))
+                break;
+            lines = p;
+        }
+        lines[(*n)++] = strdup(line);
+    }
+    fclose(fp);
+    return lines ? lines : calloc(1, sizeof(*lines));
+}
+
+/*
+   Write the total p50 and p95 of each kind of step to path, or check them
+   against it, one "<step> <p50> <p95>" line (ms) each. Returns the number
+   of those more than percent slower than in the file, -1 if it can't be
+   read or written.
+ */
+static int check_baseline(const char *path, int write, int percent)
+{
+    char name[32], **lines;
+    double p[3], base50, base95;
+    int i, step, n, slower = 0;
+    FILE *fp;
+
+    if (write) {
+        if (!(fp = fopen(path, "w"))) {
+            perror(path);
+            return -1;
+        }
+        for (step = 0; step < STEPS; step++)
+            if (step_percentiles(step, 0, p))
+                fprintf(fp, "%s %.3f %.3f\n", step_names[step], p[0], p[1]);
+        return fclose(fp) ? -1 : 0;
+    }
+    if (!(lines = read_lines(path, &n))) {
+        perror(path);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (sscanf(lines[i], "%31s %lf %lf", name, &base50, &base95) != 3)
+            continue;
+        for (step = 0; step < STEPS && strcmp(name, step_names[step]); step++)
+            ;
+        if (step == STEPS || !step_percentiles(step, 0, p))
+            continue;
+        if (p[0] > base50*(100 + percent)/100 + BENCH_SLACK_MS || p[1] > base95*(100 + percent)/100 + BENCH_SLACK_MS) {
+            fprintf(stderr, "%s: p50/p95 %.3f/%.3fms, baseline %.3f/%.3fms\n", name, p[0], p[1], base50, base95);
+            slower++;
+        }
+    }
+    return slower;
+}
+
+static void print_string(const char *s)
+{
+    putchar('"');
+    for (; *s; s++)
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    putchar('"');
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: djvubench [-s keys]... [-d ms] [-n times] [-o name=value]...\n"
+                    "                 [-f frames] [-b baseline] [-t percent] [-W] [-T trace] file.djvu...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *scripts[BENCH_SCRIPTS] = { BENCH_SCRIPT }, *k, *frames_file = NULL, *baseline_file = NULL, *trace = NULL;
+    char **options = calloc(argc, sizeof(*options)), dir[] = "/tmp/djvubench.XXXXXX", path[PATH_MAX];
+    int c, i, j, n, delay_ms = 0, times = 1, noptions = 0, failed = 0, opened = 0;
+    int nscripts = 0, percent = 20, strict = 0, write = 0, slower = 0;
+
+    while ((c = getopt(argc, argv, "s:d:n:o:f:b:t:WT:")) != -1) {
+        switch (c) {
+            case 's':
+                if (nscripts == BENCH_SCRIPTS)
+                    usage();
+                scripts[nscripts++] = optarg;
+                break;
+            case 'd': delay_ms = atoi(optarg); break;
+            case 'n': times = atoi(optarg); break;
+            case 'o': options[noptions++] = optarg; break;
+            case 'f': frames_file = optarg; break;
+            case 'b': baseline_file = optarg; break;
+            case 't': percent = atoi(optarg); strict = 1; break;
+            case 'W': write = 1; break;
+            case 'T': trace = optarg; break;
+            default: usage();
+        }
+    }
+    if (optind >= argc || times < 1)
+        usage();
+    if (!nscripts)
+        nscripts = 1;
+    if (frames_file && write && !(frames.out = fopen(frames_file, "w"))) {
+        perror(frames_file);
+        return 1;
+    }
+    if (frames_file && !write && !(frames.golden = read_lines(frames_file, &frames.ngolden))) {
+        perror(frames_file);
+        return 1;
+    }
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+    SetCallbackFunction(&host_callbacks);
+    trace_file = trace;
+    for (n = 0; n < times; n++) {
+        frames.next = 0;
+        for (i = optind; i < argc; i++) {
+            for (j = 0; j < nscripts; j++) {
+                if (!host_link_file(dir, argv[i], opened++, path) || !host_write_ini(path, options, noptions)) {
+                    perror(argv[i]);
+                    failed++;
+                    continue;
+                }
+                frames.name = strrchr(argv[i], '/') ? strrchr(argv[i], '/') + 1 : argv[i];
+                frames.script = j;
+                frames.step = 0;
+                if (!open_file(path)) {
+                    fprintf(stderr, "%s: can't be opened\n", argv[i]);
+                    failed++;
+                    continue;
+                }
+                for (k = scripts[j]; *k; k++)
+                    press(*k, delay_ms);
+                vEndDoc();
+            }
+        }
+        // the next run is checked against the same frames, only written once
+        if (frames.out) {
+            fclose(frames.out);
+            frames.out = NULL;
+        }
+        if (frames.golden && frames.next != frames.ngolden && frames.mismatches++ < 10)
+            fprintf(stderr, "%d frames, expected %d\n", frames.next, frames.ngolden);
+    }
+    if (baseline_file && (slower = check_baseline(baseline_file, write, percent)) < 0) {
+        failed++;
+        slower = 0;
+    }
+    printf("{\n  \"model\": \"%s\",\n  \"scripts\": [", MODEL_NAME);
+    for (j = 0; j < nscripts; j++) {
+        print_string(scripts[j]);
+        printf("%s", j + 1 < nscripts ? ", " : "");
+    }
+    printf("],\n  \"delay_ms\": %d,\n  \"files\": [", delay_ms);
+    for (i = optind; i < argc; i++) {
+        print_string(argv[i]);
+        printf("%s", i + 1 < argc ? ", " : "");
+    }
+    printf("],\n  \"failed\": %d,\n  \"frame_mismatches\": %d,\n  \"slower\": %d,\n  \"steps\": {\n",
+           failed, frames.mismatches, slower);
+    for (i = 0; i < STEPS; i++)
+        print_step(i, i == STEPS - 1);
+    printf("  }\n}\n");
+    // the links and the files the plugin left next to them
+    snprintf(path, sizeof(path), "rm -rf %s", dir);
+    return system(path) || failed || frames.mismatches || (strict && slower);
+}
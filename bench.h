@@ -0,0 +1,31 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+/*
+   Time spent decoding, rendering and packing pages, counted per thread
+   so that "make bench" can tell the work done while the viewer waits
+   from the work done in the background. Nothing unless built with -DBENCH.
+ */
+enum { BENCH_DECODE, BENCH_RENDER, BENCH_PACK, BENCH_PHASES };
+
+#ifdef BENCH
+#include <sys/time.h>
+
+extern __thread unsigned long long bench_us[BENCH_PHASES];
+
+static inline unsigned long long bench_now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000ULL + tv.tv_usec;
+}
+
+#define BENCH_START(t)        unsigned long long t = bench_now_us()
+#define BENCH_STOP(t, phase)  (bench_us[phase] += bench_now_us() - (t))
+#else
+#define BENCH_START(t)        /* nothing */
+#define BENCH_STOP(t, phase)  /* nothing */
+#endif
+
+#endif
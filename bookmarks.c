@@ -1,9 +1,18 @@
 /*
  * bookmarks.c Outline (aka "bookmarks") manipulation for libdjvu
+ *
+ * The outline is read by a thread started when the document is opened
+ * and flattened into toc.entries[] once: titles converted to UTF-16,
+ * destinations resolved to page numbers. Entries are added level by
+ * level, so the children of each one are toc.entries[first..first+count)
+ * and the catalog callbacks below are just lookups.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
 
 #include <libdjvu/miniexp.h>
 #include <libdjvu/ddjvuapi.h>
@@ -11,128 +20,309 @@
 #include "bookmarks.h"
 #include "debug.h"
 
-miniexp_t outline;
-miniexp_t g_outline_path[100];
-int curLevel = -1;
-unsigned short dirName[1024];
-static char url[200];
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#endif
+
+struct outline_entry {
+    unsigned int title;  // offset of its title in toc.titles
+    int title_len, page;
+    int parent;          // -1 at the top
+    int first, count;    // its children
+};
+
+// a name a page can be pointed to by
+struct page_name {
+    const char *name;
+    int page;
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running, quit, done;
+    struct outline_entry top, *entries;
+    int nentries, entries_size;
+    unsigned short *titles;
+    unsigned int titles_len, titles_size;
+    struct page_name *names;
+    int nnames;
+    int cur; // the entry whose children are listed, -1 for the top
+} toc = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .cur = -1 };
 
 static int str_utf82uni(unsigned char *utf8, int utf8len, unsigned short *org, int boundlen);
 
-static inline void handle_ddjvu_messages(ddjvu_context_t *ctx)
+// sleep for ms milliseconds or until woken up, called with the lock held
+static inline void nap(int ms)
 {
-    ddjvu_message_wait(ctx);
-    while (ddjvu_message_peek(ctx))
-        ddjvu_message_pop(ctx);
+    struct timeval now;
+    struct timespec ts;
+
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec + ms/1000;
+    ts.tv_nsec = now.tv_usec*1000 + (ms%1000)*1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&toc.cond, &toc.lock, &ts);
 }
 
-int iCreateDirList(void)
+static int compare_names(const void *a, const void *b)
 {
-    DPRINTF("%s\n", __FUNCTION__);
-    while ((outline = ddjvu_document_get_outline(djvu_document)) == miniexp_dummy)
-        handle_ddjvu_messages(djvu_context);
-
-    if (miniexp_listp(outline) &&
-        (miniexp_length(outline) > 0) &&
-        miniexp_symbolp( miniexp_nth(0, outline)) &&
-        strcmp(miniexp_to_name(miniexp_nth(0, outline)), "bookmarks") == 0)
-    {
-        DPRINTF("iCreateDirList success.\n");
-        g_outline_path[0] = outline;
-        curLevel = 0;
-        return 1;
+    return strcmp(((const struct page_name *)a)->name, ((const struct page_name *)b)->name);
+}
+
+static inline void add_name(const char *name, int page)
+{
+    if (name && *name) {
+        toc.names[toc.nnames].name = name;
+        toc.names[toc.nnames++].page = page;
     }
-    return 0;
 }
 
-int iGetCurDirPage(int level, int idx)
+// the ids, names and titles of the pages, sorted; 0 if they can't be had
+static int get_page_names(void)
 {
-    DPRINTF("%s(%d,%d)\n", __FUNCTION__, level, idx);
+    ddjvu_fileinfo_t fi;
+    ddjvu_status_t r = DDJVU_JOB_NOTSTARTED;
+    int i, n = ddjvu_document_get_filenum(djvu_document);
 
-    if (curLevel < 0) return 0;
-    int pos = level;
-    if (curLevel == 0) pos++;
-    else pos += 2;
-
-    miniexp_t cur = miniexp_nth(pos, g_outline_path[curLevel]);
-
-    if (miniexp_consp(cur) && (miniexp_length(cur) > 0) &&
-        miniexp_stringp(miniexp_nth(0, cur)) &&
-        miniexp_stringp(miniexp_nth(1, cur)))
-    {
-        strcpy(url, miniexp_to_str(miniexp_nth(1, cur)));
-        DPRINTF("url: %s\n", url);
-        if(url[0] == '#')
-            return atoi(url + 1) - 1;
+    if (n <= 0 || !(toc.names = malloc(3*n*sizeof(*toc.names))))
+        return 0;
+    for (i = 0; i < n; i++) {
+        pthread_mutex_lock(&toc.lock);
+        while (!toc.quit && (r = ddjvu_document_get_fileinfo(djvu_document, i, &fi)) < DDJVU_JOB_OK)
+            nap(OUTLINE_POLL_MS);
+        pthread_mutex_unlock(&toc.lock);
+        if (toc.quit)
+            return 0;
+        if (r != DDJVU_JOB_OK || fi.type != 'P')
+            continue;
+        add_name(fi.id, fi.pageno);
+        add_name(fi.name, fi.pageno);
+        add_name(fi.title, fi.pageno);
     }
-    return 0;
+    qsort(toc.names, toc.nnames, sizeof(*toc.names), compare_names);
+    return 1;
 }
 
-int iGetDirNumber(void)
+// the page of an outline destination, "#12" or "#name of a page"
+static int resolve(const char *url)
 {
-    int l = miniexp_length(g_outline_path[curLevel]);
+    struct page_name key, *found;
 
-    DPRINTF("%s(%d)\n", __FUNCTION__, l);
-
-    if(curLevel == 0) l--;
-    else l -= 2;
-    return l;   
+    if (*url++ != '#')
+        return 0;
+    if (*url && strspn(url, "0123456789") == strlen(url))
+        return atoi(url) - 1;
+    if (!toc.names && !get_page_names())
+        return 0;
+    key.name = url;
+    found = bsearch(&key, toc.names, toc.nnames, sizeof(*toc.names), compare_names);
+    DPRINTF("%s(%s): %d\n", __FUNCTION__, url, found ? found->page : -1);
+    return found ? found->page : 0;
 }
 
-unsigned short *usGetCurDirNameAndLen(int pos, int *len)
+/*
+   Add the items of the outline list e after the skip first elements to
+   toc.entries[], children of parent; their own children are added later.
+   items[] are kept along with the entries. Returns 0 out of memory.
+ */
+static int add_items(miniexp_t e, int skip, int parent, miniexp_t **items)
 {
-    char utf8Buf[2048];
-
-    if (curLevel < 0) return 0;
-    if (curLevel == 0) pos++;
-    else pos += 2;
-
-    miniexp_t cur = miniexp_nth(pos, g_outline_path[curLevel]);
-    if (miniexp_consp(cur) && (miniexp_length(cur) > 0) &&
-        miniexp_stringp(miniexp_nth(0, cur)) &&
-        miniexp_stringp(miniexp_nth(1, cur)))
-    {
-        strcpy(utf8Buf, miniexp_to_str(miniexp_nth(0, cur)));
-        *len = str_utf82uni((unsigned char *)utf8Buf, strlen(utf8Buf), dirName, 1024);
-        DPRINTF("%s(%d,*%d)\n", __FUNCTION__, pos, *len);
-        return dirName;
+    struct outline_entry *o;
+    int first = toc.nentries, len;
+    const char *title;
+    void *p;
+
+    while (skip-- > 0)
+        e = miniexp_cdr(e);
+    for (; miniexp_consp(e); e = miniexp_cdr(e)) {
+        miniexp_t item = miniexp_car(e);
+
+        if (!miniexp_consp(item) || !miniexp_stringp(miniexp_nth(0, item)) ||
+            !miniexp_stringp(miniexp_nth(1, item)))
+            continue;
+        if (toc.nentries == toc.entries_size) {
+            toc.entries_size = toc.entries_size ? 2*toc.entries_size : 64;
+            if (!(p = realloc(toc.entries, toc.entries_size*sizeof(*toc.entries))))
+                return 0;
+            toc.entries = p;
+            if (!(p = realloc(*items, toc.entries_size*sizeof(**items))))
+                return 0;
+            *items = p;
+        }
+        title = miniexp_to_str(miniexp_nth(0, item));
+        len = min((int)strlen(title), OUTLINE_MAX_TITLE - 1);
+        if (toc.titles_len + len + 1 > toc.titles_size) {
+            toc.titles_size = 2*toc.titles_size + len + 1;
+            if (!(p = realloc(toc.titles, toc.titles_size*sizeof(*toc.titles))))
+                return 0;
+            toc.titles = p;
+        }
+        (*items)[toc.nentries] = item;
+        o = &toc.entries[toc.nentries++];
+        o->title = toc.titles_len;
+        o->title_len = str_utf82uni((unsigned char *)title, len, toc.titles + toc.titles_len, len);
+        toc.titles[toc.titles_len + o->title_len] = 0;
+        toc.titles_len += o->title_len + 1;
+        o->page = resolve(miniexp_to_str(miniexp_nth(1, item)));
+        o->parent = parent;
+        o->first = o->count = 0;
     }
+    o = parent < 0 ? &toc.top : &toc.entries[parent];
+    o->first = first;
+    o->count = toc.nentries - first;
+    return 1;
+}
+
+static void flatten(miniexp_t outline)
+{
+    miniexp_t *items = NULL;
+    int i;
+
+    if (add_items(outline, 1, -1, &items))
+        for (i = 0; i < toc.nentries && !toc.quit; i++)
+            if (!add_items(items[i], 2, i, &items))
+                break;
+    free(items);
+    free(toc.names);
+    toc.names = NULL;
+    toc.nnames = 0;
+    DPRINTF("%s: %d entries, %d at the top\n", __FUNCTION__, toc.nentries, toc.top.count);
+}
+
+static void *outline_thread(void *arg)
+{
+    miniexp_t outline;
+
+    pthread_mutex_lock(&toc.lock);
+    while (!toc.quit && (outline = ddjvu_document_get_outline(djvu_document)) == miniexp_dummy)
+        nap(OUTLINE_POLL_MS);
+    pthread_mutex_unlock(&toc.lock);
+    if (!toc.quit && miniexp_consp(outline) && miniexp_symbolp(miniexp_car(outline)) &&
+        !strcmp(miniexp_to_name(miniexp_car(outline)), "bookmarks"))
+        flatten(outline);
+    if (!toc.quit && outline != miniexp_dummy)
+        ddjvu_miniexp_release(djvu_document, outline);
+    pthread_mutex_lock(&toc.lock);
+    toc.done = 1;
+    pthread_cond_broadcast(&toc.cond);
+    pthread_mutex_unlock(&toc.lock);
     return NULL;
 }
 
-int bCurItemIsLeaf(int pos)
+// start reading the outline of djvu_document
+int outline_open(void)
+{
+    outline_close();
+    toc.quit = 0;
+    if (pthread_create(&toc.thread, NULL, outline_thread, NULL)) {
+        DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+        return 0;
+    }
+    toc.running = 1;
+    return 1;
+}
+
+void outline_close(void)
+{
+    if (toc.running) {
+        pthread_mutex_lock(&toc.lock);
+        toc.quit = 1;
+        pthread_cond_broadcast(&toc.cond);
+        pthread_mutex_unlock(&toc.lock);
+        pthread_join(toc.thread, NULL);
+        toc.running = 0;
+    }
+    free(toc.entries);
+    free(toc.titles);
+    free(toc.names);
+    memset(&toc.top, 0, sizeof(toc.top));
+    toc.entries = NULL;
+    toc.titles = NULL;
+    toc.names = NULL;
+    toc.nentries = toc.entries_size = toc.nnames = 0;
+    toc.titles_len = toc.titles_size = 0;
+    toc.done = 0;
+    toc.cur = -1;
+}
+
+// the entries listed in the catalog
+static inline const struct outline_entry *cur_dir(void)
+{
+    return toc.cur < 0 ? &toc.top : &toc.entries[toc.cur];
+}
+
+// the entry at pos in the catalog, NULL if there is none
+static inline const struct outline_entry *cur_item(int pos)
+{
+    const struct outline_entry *d = cur_dir();
+
+    return pos >= 0 && pos < d->count ? &toc.entries[d->first + pos] : NULL;
+}
+
+int iCreateDirList(void)
 {
     DPRINTF("%s\n", __FUNCTION__);
+    // the outline is usually there long before the catalog is opened
+    pthread_mutex_lock(&toc.lock);
+    while (toc.running && !toc.done)
+        pthread_cond_wait(&toc.cond, &toc.lock);
+    pthread_mutex_unlock(&toc.lock);
+    toc.cur = -1;
+    return toc.top.count > 0;
+}
 
-    if (curLevel < 0) return 0;
-    if (curLevel == 0) pos++;
-    else pos += 2;
-    miniexp_t cur = miniexp_nth(pos, g_outline_path[curLevel]);
+int iGetCurDirPage(int level, int idx)
+{
+    const struct outline_entry *o = cur_item(level);
 
-    //>2 is skip title and destination
-    if (miniexp_consp(cur) && (miniexp_length(cur) > 2))
-        return 0;
+    DPRINTF("%s(%d,%d)\n", __FUNCTION__, level, idx);
+    return o ? o->page : 0;
+}
 
-    return 1;
+int iGetDirNumber(void)
+{
+    DPRINTF("%s(%d)\n", __FUNCTION__, cur_dir()->count);
+    return cur_dir()->count;
 }
 
-void vEnterChildDir(int pos)
+unsigned short *usGetCurDirNameAndLen(int pos, int *len)
 {
+    const struct outline_entry *o = cur_item(pos);
+
+    if (!o)
+        return NULL;
+    *len = o->title_len;
+    DPRINTF("%s(%d,*%d)\n", __FUNCTION__, pos, *len);
+    return toc.titles + o->title;
+}
+
+int bCurItemIsLeaf(int pos)
+{
+    const struct outline_entry *o = cur_item(pos);
+
     DPRINTF("%s\n", __FUNCTION__);
+    return !o || !o->count;
+}
 
-    if (curLevel == 0) pos++; //skip bookmarks
-    else pos += 2; //skip title and destination
+void vEnterChildDir(int pos)
+{
+    const struct outline_entry *o = cur_item(pos);
 
-    miniexp_t cur = miniexp_nth(pos, g_outline_path[curLevel]);
-    if (cur)
-        g_outline_path[++curLevel] = cur;
+    DPRINTF("%s\n", __FUNCTION__);
+    if (o)
+        toc.cur = o - toc.entries;
 }
 
 void vReturnParentDir(void)
 {
     DPRINTF("%s\n", __FUNCTION__);
-    if(curLevel > 0)
-        curLevel--;
+    if (toc.cur >= 0)
+        toc.cur = toc.entries[toc.cur].parent;
 }
 
 struct utf8_table {
@@ -1,6 +1,12 @@
 #ifndef _BOOKMARKS_H
 #define _BOOKMARKS_H
 
+#define OUTLINE_MAX_TITLE 1024  // UTF-16 characters of a title, with the 0
+#define OUTLINE_POLL_MS   20
+
+extern int outline_open(void);
+extern void outline_close(void);
+
 //extern void vGetCurDir(int, int);
 extern int iGetCurDirPage(int, int);
 extern int iCreateDirList(void);
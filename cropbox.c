@@ -0,0 +1,320 @@
+/*
+ * cropbox.c Content boxes and columns of the pages for automatic margin
+ * cropping and the multicolumn reading path of libdjvu
+ *
+ * The first time a page is shown with autocrop on, it is rendered at
+ * CROPBOX_SIZE pixels (the longer side) and the darkness of each row and
+ * each column is added up in one pass over the image. Rows and columns
+ * no darker than the paper are margin, the box is what is left between
+ * them. Within the box, runs of columns as light as the paper split the
+ * text into columns. That takes a few milliseconds and is done only once
+ * for each page: the boxes are kept in a sidecar file next to the
+ * document ("<document>.box"), tied to its size and mtime like the
+ * thumbnails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "cropbox.h"
+#include "debug.h"
+
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
+#endif
+
+#define CROPBOX_MAGIC "DJVUBOX2"
+
+struct cropbox_header {
+    char magic[8];
+    unsigned int size, mtime, npages;
+};
+
+#define RECORD_OFFSET(n) (sizeof(struct cropbox_header) + (off_t)(n)*sizeof(struct cropbox))
+
+static struct {
+    int fd, npages, ndone;
+    struct cropbox *boxes;
+} crop = { .fd = -1 };
+
+/*
+   Add up the darkness (255 - pixel) of each row and each column of the
+   w x h image, rowsize bytes per row (a multiple of 16, white beyond w).
+   With w, h <= CROPBOX_SIZE the sums fit in 16 bits, so the column sums
+   are kept several to a register: eight to an SSE2 one, otherwise two to
+   a word, one word for the even and one for the odd pixels of four.
+ */
+static void project(const unsigned char *img, int w, int h, int rowsize, unsigned int *rows, unsigned int *cols)
+{
+    int x, y;
+#ifdef __SSE2__
+    static __m128i acc[CROPBOX_SIZE/8];
+    static unsigned short sums[CROPBOX_SIZE] __attribute__((aligned(16)));
+    const __m128i white = _mm_set1_epi8(0xff), zero = _mm_setzero_si128();
+    __m128i v, r;
+
+    memset(acc, 0, rowsize*2);
+    for (y = 0; y < h; y++, img += rowsize) {
+        r = zero;
+        for (x = 0; x < rowsize; x += 16) {
+            v = _mm_xor_si128(_mm_load_si128((const __m128i *)(img + x)), white);
+            r = _mm_add_epi64(r, _mm_sad_epu8(v, zero));
+            acc[x/8] = _mm_add_epi16(acc[x/8], _mm_unpacklo_epi8(v, zero));
+            acc[x/8 + 1] = _mm_add_epi16(acc[x/8 + 1], _mm_unpackhi_epi8(v, zero));
+        }
+        rows[y] = _mm_cvtsi128_si32(r) + _mm_cvtsi128_si32(_mm_srli_si128(r, 8));
+    }
+    for (x = 0; x < rowsize/8; x++)
+        _mm_store_si128((__m128i *)sums + x, acc[x]);
+    for (x = 0; x < w; x++)
+        cols[x] = sums[x];
+#else
+    static unsigned int even[CROPBOX_SIZE/4], odd[CROPBOX_SIZE/4];
+    unsigned int t, e, o, r;
+    const unsigned char *s;
+
+    memset(even, 0, rowsize);
+    memset(odd, 0, rowsize);
+    for (y = 0; y < h; y++, img += rowsize) {
+        for (r = 0, s = img, x = 0; x < rowsize/4; x++, s += 4) {
+            t = ~(s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24));
+            e = t & 0x00ff00ff;
+            o = (t >> 8) & 0x00ff00ff;
+            even[x] += e;
+            odd[x] += o;
+            r += e + o;
+        }
+        rows[y] = (r & 0xffff) + (r >> 16);
+    }
+    for (x = 0; x < w; x++)
+        cols[x] = (((x & 1) ? odd[x>>2] : even[x>>2]) >> ((x & 2) << 3)) & 0xffff;
+#endif
+}
+
+/*
+   Find the content among n sums of len pixels each: *first is the first
+   one which is darker than the paper (the lightest) by CROPBOX_INK a
+   pixel, *last is one past the last. Returns 0 if there is none.
+ */
+static int content(const unsigned int *sums, int n, int len, int *first, int *last)
+{
+    unsigned int level = sums[0];
+    int i, limit = n*CROPBOX_MAX/100;
+
+    for (i = 1; i < n; i++)
+        level = min(level, sums[i]);
+    level += len*CROPBOX_INK;
+    for (i = 0; i < n && sums[i] <= level; i++)
+        ;
+    if (i == n)
+        return 0; // blank
+    *first = max(min(i, limit) - CROPBOX_PAD, 0);
+    for (i = n - 1; sums[i] <= level; i--)
+        ;
+    *last = min(max(i + 1, n - limit) + CROPBOX_PAD, n);
+    return 1;
+}
+
+/*
+   Split sums first ... last-1 (scale of them across the page width) into
+   the columns of box: runs separated by gutters at
+   least CROPBOX_GUTTER wide where the sums stay within 1/CROPBOX_GUTTER_INK
+   of the way from the paper to the darkest. Columns narrower than
+   CROPBOX_MIN_COLUMN percent of the box are joined to their neighbour.
+ */
+static void find_columns(const unsigned int *sums, int first, int last, int scale, struct cropbox *box)
+{
+    unsigned int lo = sums[first], hi = sums[first], level;
+    int edges[2*CROPBOX_MAX_COLUMNS], n = 0, i, x, run, minw = (last - first)*CROPBOX_MIN_COLUMN/100;
+
+    for (x = first; x < last; x++) {
+        lo = min(lo, sums[x]);
+        hi = max(hi, sums[x]);
+    }
+    level = lo + (hi - lo)/CROPBOX_GUTTER_INK;
+    edges[n++] = first;
+    for (x = first, run = 0; x < last; x++) {
+        if (sums[x] <= level) {
+            run++;
+            continue;
+        }
+        if (run >= CROPBOX_GUTTER && x - run > first) {
+            if (n == 2*CROPBOX_MAX_COLUMNS - 1) {
+                n = 1; // more than we can read as columns, a table or a picture
+                break;
+            }
+            edges[n++] = x - run;
+            edges[n++] = x;
+        }
+        run = 0;
+    }
+    edges[n++] = last;
+    // join the narrow ones, e.g. line numbers or a drop cap
+    for (i = 0; i + 2 < n; ) {
+        if (edges[i + 1] - edges[i] < minw || edges[i + 3] - edges[i + 2] < minw) {
+            memmove(edges + i + 1, edges + i + 3, (n - i - 3)*sizeof(int));
+            n -= 2;
+        } else
+            i += 2;
+    }
+    box->ncolumns = n/2;
+    for (i = 0; i < n/2; i++) {
+        box->columns[i][0] = edges[2*i]*CROPBOX_UNIT/scale;
+        box->columns[i][1] = edges[2*i + 1]*CROPBOX_UNIT/scale;
+    }
+}
+
+// work out the box of a decoded page, rendering it on its side in landscape like the rest of the plugin does
+static int find_box(ddjvu_page_t *page, int landscape, struct cropbox *box)
+{
+    static unsigned char image[CROPBOX_SIZE*CROPBOX_SIZE] __attribute__((aligned(16)));
+    static unsigned int rows[CROPBOX_SIZE], cols[CROPBOX_SIZE];
+    int pw = ddjvu_page_get_width(page), ph = ddjvu_page_get_height(page), t, rowsize, x0, x1, y0, y1;
+    ddjvu_rect_t r = {0, 0, CROPBOX_SIZE, CROPBOX_SIZE};
+#if DEBUG
+    struct timeval tv1, tv2;
+    gettimeofday(&tv1, NULL);
+#endif
+
+    if (pw <= 0 || ph <= 0)
+        return 0;
+    memset(box, 0, sizeof(*box));
+    box->x1 = box->y1 = CROPBOX_UNIT;
+    box->ncolumns = 1;
+    box->columns[0][1] = CROPBOX_UNIT;
+    // a photo goes right up to the edges
+    if (ddjvu_page_get_type(page) == DDJVU_PAGETYPE_PHOTO)
+        return 1;
+    if (landscape) {
+        t = pw;
+        pw = ph;
+        ph = t;
+    }
+    if (pw > ph)
+        r.h = max(1, CROPBOX_SIZE*ph/pw);
+    else
+        r.w = max(1, CROPBOX_SIZE*pw/ph);
+    rowsize = (r.w + 15) & ~15;
+    memset(image, 0xff, rowsize*r.h);
+    ddjvu_page_set_rotation(page, landscape ? DDJVU_ROTATE_270 : DDJVU_ROTATE_0);
+    if (!ddjvu_page_render(page, DDJVU_RENDER_COLOR, &r, &r, djvu_format, rowsize, (char *)image))
+        return 0;
+    project(image, r.w, r.h, rowsize, rows, cols);
+    if (!content(cols, r.w, r.h, &x0, &x1) || !content(rows, r.h, r.w, &y0, &y1))
+        return 1;
+    if (landscape) {
+        // the top of the page is on the right
+        box->x0 = y0*CROPBOX_UNIT/r.h;
+        box->x1 = y1*CROPBOX_UNIT/r.h;
+        box->y0 = (r.w - x1)*CROPBOX_UNIT/r.w;
+        box->y1 = (r.w - x0)*CROPBOX_UNIT/r.w;
+        find_columns(rows, y0, y1, r.h, box);
+    } else {
+        box->x0 = x0*CROPBOX_UNIT/r.w;
+        box->x1 = x1*CROPBOX_UNIT/r.w;
+        box->y0 = y0*CROPBOX_UNIT/r.h;
+        box->y1 = y1*CROPBOX_UNIT/r.h;
+        find_columns(cols, x0, x1, r.w, box);
+    }
+#if DEBUG
+    gettimeofday(&tv2, NULL);
+    DPRINTF("%s: %d,%d-%d,%d, %d columns at %dx%d in %ldus\n", __FUNCTION__, box->x0, box->y0, box->x1, box->y1, box->ncolumns, r.w, r.h,
+            1000000*(tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec));
+#endif
+    return 1;
+}
+
+/*
+   Open (or create) the box index of the document "filename", unless it
+   is open already. Returns 1 on success.
+ */
+int cropbox_open(const char *filename, const struct stat *st, int npages)
+{
+    char name[512];
+    struct cropbox_header hdr, want;
+    int p;
+
+    if (crop.fd != -1)
+        return 1;
+    snprintf(name, sizeof(name), "%s.box", filename);
+    if ((crop.fd = open(name, O_RDWR | O_CREAT, 0644)) == -1) {
+        DPRINTF("%s: can't open %s\n", __FUNCTION__, name);
+        return 0;
+    }
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, CROPBOX_MAGIC, sizeof(want.magic));
+    want.size = st->st_size;
+    want.mtime = st->st_mtime;
+    want.npages = npages;
+    if (pread(crop.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(&hdr, &want, sizeof(hdr))) {
+        // not ours or made for another version of the document, start afresh
+        DPRINTF("%s: new index %s\n", __FUNCTION__, name);
+        if (ftruncate(crop.fd, 0) == -1 ||
+            pwrite(crop.fd, &want, sizeof(want), 0) != sizeof(want) ||
+            ftruncate(crop.fd, RECORD_OFFSET(npages)) == -1) {
+            (void)close(crop.fd);
+            crop.fd = -1;
+            return 0;
+        }
+    }
+    crop.boxes = calloc(npages, sizeof(struct cropbox));
+    if (!crop.boxes || pread(crop.fd, crop.boxes, npages*sizeof(struct cropbox), RECORD_OFFSET(0)) != npages*sizeof(struct cropbox)) {
+        cropbox_close();
+        return 0;
+    }
+    crop.npages = npages;
+    for (p = crop.ndone = 0; p < npages; p++)
+        crop.ndone += crop.boxes[p].x1 != 0;
+    DPRINTF("%s: %d of %d boxes in %s\n", __FUNCTION__, crop.ndone, npages, name);
+    return 1;
+}
+
+void cropbox_close(void)
+{
+    if (crop.fd != -1) {
+        (void)close(crop.fd);
+        crop.fd = -1;
+    }
+    free(crop.boxes);
+    crop.boxes = NULL;
+    crop.npages = crop.ndone = 0;
+}
+
+/*
+   Copy the content box of page p to *box, working it out first if the
+   index doesn't have it and page (p's handle, NULL if there is none) has
+   been decoded. Returns 0 if the box isn't known.
+ */
+int cropbox_get(int p, ddjvu_page_t *page, int landscape, struct cropbox *box)
+{
+    if (p < 0 || p >= crop.npages)
+        return 0;
+    if (!crop.boxes[p].x1) {
+        if (!page || !ddjvu_page_decoding_done(page) || ddjvu_page_decoding_error(page) ||
+            !find_box(page, landscape, &crop.boxes[p]))
+            return 0;
+        crop.ndone++;
+        if (pwrite(crop.fd, &crop.boxes[p], sizeof(struct cropbox), RECORD_OFFSET(p)) != sizeof(struct cropbox))
+            DPRINTF("%s: can't write the box of page %d\n", __FUNCTION__, p);
+    }
+    *box = crop.boxes[p];
+    return 1;
+}
+
+int cropbox_count(void)
+{
+    return crop.ndone;
+}
@@ -0,0 +1,28 @@
+#ifndef _CROPBOX_H
+#define _CROPBOX_H
+
+#define CROPBOX_UNIT    10000  // box edges are in 1/CROPBOX_UNIT of the page width/height
+#define CROPBOX_SIZE    256    // pages are scanned at this size (the longer side) for their content
+#define CROPBOX_INK     3      // a row/column is content if it is this much darker (per pixel) than the paper
+#define CROPBOX_MAX     25     // at most this percentage of the page is cut off each side
+#define CROPBOX_PAD     2      // pixels (at CROPBOX_SIZE) left around the content
+#define CROPBOX_GUTTER  3      // pixels (at CROPBOX_SIZE) of paper between two columns, at least
+#define CROPBOX_GUTTER_INK  8  // a gutter may have 1/8 of the ink of the darkest column (titles across it)
+#define CROPBOX_MIN_COLUMN 15  // narrower columns (percent of the box) go with the next one
+#define CROPBOX_MAX_COLUMNS 4
+
+/* the content of a page, top down, x1 == 0 if not known yet */
+struct cropbox {
+    unsigned short x0, y0, x1, y1;
+    unsigned short ncolumns, columns[CROPBOX_MAX_COLUMNS][2]; // left to right, left and right edge of each
+};
+
+extern int cropbox_open(const char *, const struct stat *, int);
+extern void cropbox_close(void);
+extern int cropbox_get(int, ddjvu_page_t *, int, struct cropbox *);
+extern int cropbox_count(void);
+
+// in libdjvu.c
+extern ddjvu_format_t *djvu_format;
+
+#endif
@@ -0,0 +1,1022 @@
+/*
+ * djvuopt.cpp Optimises DjVu documents for the reader (djvuopt)
+ *
+ * Does what scripts/djvu-convert.sh did with ddjvu, cjb2 and djvm, in a
+ * single process: each page is rendered bitonal, cut into its connected
+ * components with the flyspecks left out (cjb2 -clean) and encoded again
+ * in JB2, and the pages are bundled with the outline of the document.
+ * The shapes found on more than one page of a run of -p pages go into a
+ * dictionary which those pages share (a Djbz chunk they INCLude); the
+ * others are coded as refinements of a similar shape when there is one.
+ * Only the flyspecks are lost: but for them, the pages are those ddjvu
+ * rendered, bit for bit.
+ *
+ * The pages are decoded and encoded by a pool of threads, each with a
+ * queue of its own which the others steal from when theirs is empty. A
+ * run of pages is taken on only while few enough are being worked on,
+ * so that the memory used doesn't grow with the document.
+ *
+ * This is C++ because the JB2 encoder and DjVmDoc of djvulibre are C++
+ * classes, ddjvuapi.h can only decode; it builds against the djvulibre
+ * tree the plugin is built with (make djvuopt).
+ *
+ * Usage: djvuopt [-j threads] [-p pages] [-o dir] file.djvu...
+ *
+ *   -j  threads, one per processor by default
+ *   -p  pages sharing a dictionary, 10 by default (1: no dictionaries)
+ *   -o  where the optimised documents go, "out" by default
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <libdjvu/ddjvuapi.h>
+#include <libdjvu/GException.h>
+#include <libdjvu/GString.h>
+#include <libdjvu/GBitmap.h>
+#include <libdjvu/JB2Image.h>
+#include <libdjvu/DjVuInfo.h>
+#include <libdjvu/ByteStream.h>
+#include <libdjvu/IFFByteStream.h>
+#include <libdjvu/DjVmDir.h>
+#include <libdjvu/DjVmDoc.h>
+#include <libdjvu/DjVmNav.h>
+
+#define OPT_DICT_PAGES 10  // pages sharing a dictionary
+#define OPT_MATCH      8   // percent of its ink by which a shape may differ from a similar one
+#define OPT_CANDIDATES 16  // shapes of the same size compared with, at most
+
+#ifndef max
+#define max(a,b) (((a)>(b))?(a):(b))
+#endif
+
+// a connected component of a page
+struct shape {
+    int x, y, w, h;          // on the page, from the top left
+    int ink;                 // black pixels
+    unsigned int hash;
+    unsigned char *bits;     // (w + 7)/8 bytes a row from the top one, 1 is black
+    int proto, exact;        // the shape of its run it is (exact) or looks like
+};
+
+struct page {
+    int width, height, dpi;
+    struct shape *shapes;
+    int nshapes;
+    char *id, *title;
+    unsigned char *data;     // FORM:DJVU
+    size_t size;
+};
+
+/*
+   Shapes by their hash, and by their size for those that aren't the same
+   but may look alike.
+ */
+struct shape_index {
+    struct shape **items;
+    int *exact, *sized, *next_exact, *next_sized;
+    int n, mask;
+};
+
+// a run of pages sharing a dictionary
+struct run {
+    int first, npages, decoded, encoded;
+    char id[32];
+    int *dictno;             // of each shape of the run found, -1 if not in the dictionary
+    int ndict;
+    unsigned char *dict;     // the Djbz chunk
+    size_t dict_size;
+    unsigned char *data;     // FORM:DJVI
+    size_t size;
+};
+
+struct task {
+    int encode, page;
+};
+
+struct job;
+
+struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct task *tasks;      // the worker takes from the tail, the others steal from the head
+    int head, tail;
+    struct job *job;
+    ddjvu_context_t *ctx;
+    ddjvu_document_t *doc;
+    unsigned char *buf;
+    size_t bufsize;
+};
+
+// a document being optimised
+struct job {
+    const char *file;
+    int numpages, dict_pages, nruns, max_runs;
+    struct page *pages;
+    struct run *runs;
+    struct worker *workers;
+    int nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int gen, next_run, open_runs, done, failed;
+};
+
+static void handle_messages(ddjvu_context_t *ctx, const char *file, int wait)
+{
+    const ddjvu_message_t *msg;
+
+    if (wait)
+        ddjvu_message_wait(ctx);
+    while ((msg = ddjvu_message_peek(ctx))) {
+        if (msg->m_any.tag == DDJVU_ERROR)
+            fprintf(stderr, "%s: %s\n", file, msg->m_error.message);
+        ddjvu_message_pop(ctx);
+    }
+}
+
+static ddjvu_document_t *open_document(ddjvu_context_t *ctx, const char *file)
+{
+    ddjvu_document_t *doc = ddjvu_document_create_by_filename(ctx, file, 0);
+
+    if (!doc)
+        return NULL;
+    while (!ddjvu_document_decoding_done(doc))
+        handle_messages(ctx, file, 1);
+    if (ddjvu_document_decoding_error(doc)) {
+        ddjvu_document_release(doc);
+        return NULL;
+    }
+    return doc;
+}
+
+static unsigned int hash_shape(const struct shape *s)
+{
+    unsigned int h = 2166136261u ^ (s->w*65599 + s->h);
+    int i, size = (s->w + 7)/8*s->h;
+
+    for (i = 0; i < size; i++)
+        h = (h ^ s->bits[i])*16777619u;
+    return h;
+}
+
+static inline int same_size(const struct shape *a, const struct shape *b)
+{
+    return a->w == b->w && a->h == b->h;
+}
+
+// the pixels by which a and b, of the same size, differ; more than limit once they are beyond it
+static int difference(const struct shape *a, const struct shape *b, int limit)
+{
+    int i, n = 0, size = (a->w + 7)/8*a->h;
+
+    for (i = 0; i < size && n <= limit; i++)
+        n += __builtin_popcount(a->bits[i] ^ b->bits[i]);
+    return n;
+}
+
+static int index_init(struct shape_index *ix, int capacity)
+{
+    int heads = 64;
+
+    while (heads < 2*capacity)
+        heads <<= 1;
+    ix->n = 0;
+    ix->mask = heads - 1;
+    ix->items = (struct shape **)malloc(max(capacity, 1)*sizeof(*ix->items));
+    ix->next_exact = (int *)malloc(max(capacity, 1)*sizeof(int));
+    ix->next_sized = (int *)malloc(max(capacity, 1)*sizeof(int));
+    ix->exact = (int *)malloc(heads*sizeof(int));
+    ix->sized = (int *)malloc(heads*sizeof(int));
+    if (!ix->items || !ix->next_exact || !ix->next_sized || !ix->exact || !ix->sized)
+        return 0;
+    memset(ix->exact, 0xff, heads*sizeof(int));
+    memset(ix->sized, 0xff, heads*sizeof(int));
+    return 1;
+}
+
+static void index_free(struct shape_index *ix)
+{
+    free(ix->items);
+    free(ix->next_exact);
+    free(ix->next_sized);
+    free(ix->exact);
+    free(ix->sized);
+    memset(ix, 0, sizeof(*ix));
+}
+
+static inline int size_key(const struct shape_index *ix, const struct shape *s)
+{
+    return (s->w*31 + s->h) & ix->mask;
+}
+
+static int index_add(struct shape_index *ix, struct shape *s)
+{
+    int i = ix->n++, e = s->hash & ix->mask, z = size_key(ix, s);
+
+    ix->items[i] = s;
+    ix->next_exact[i] = ix->exact[e];
+    ix->exact[e] = i;
+    ix->next_sized[i] = ix->sized[z];
+    ix->sized[z] = i;
+    return i;
+}
+
+/*
+   The shape of the index s is (*exact set), else the one most like it of
+   the last OPT_CANDIDATES of its size if one is close enough, else -1.
+ */
+static int index_find(const struct shape_index *ix, const struct shape *s, int *exact)
+{
+    const struct shape *t;
+    int i, d, n, best = -1, limit = max(1, s->ink*OPT_MATCH/100);
+
+    *exact = 0;
+    for (i = ix->exact[s->hash & ix->mask]; i >= 0; i = ix->next_exact[i]) {
+        t = ix->items[i];
+        if (t->hash == s->hash && same_size(t, s) && !memcmp(t->bits, s->bits, (s->w + 7)/8*s->h)) {
+            *exact = 1;
+            return i;
+        }
+    }
+    for (i = ix->sized[size_key(ix, s)], n = 0; i >= 0 && n < OPT_CANDIDATES; i = ix->next_sized[i]) {
+        t = ix->items[i];
+        if (!same_size(t, s) || abs(t->ink - s->ink) > limit)
+            continue;
+        n++;
+        if ((d = difference(t, s, limit)) <= limit) {
+            best = i;
+            limit = d - 1;
+        }
+    }
+    return best;
+}
+
+static int find_root(int *parent, int i)
+{
+    while (parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+/*
+   Cut the page in buf (rowsize bytes a row, 1 is black) into its 8-connected
+   components, in the order their top rows come, leaving out those of no more
+   than tiny pixels. Returns 0 if out of memory.
+ */
+static int find_shapes(struct page *pg, const unsigned char *buf, int rowsize, int tiny)
+{
+    int *rx0 = NULL, *rx1 = NULL, *ry = NULL, *parent = NULL, *comp = NULL;
+    int nruns = 0, maxruns = 0, x, y, x0, i, j, k, a, b, cur = 0, above, n, stride;
+    int w = pg->width, h = pg->height, ok = 0;
+    struct shape *s;
+    const unsigned char *row;
+    unsigned char *bits;
+    void *p;
+
+    for (y = 0; y < h; y++) {
+        row = buf + (size_t)y*rowsize;
+        above = cur; // the runs of the row above start there
+        cur = nruns;
+        for (x = 0; x < w; ) {
+            while (x < w && !(row[x >> 3] & (0x80 >> (x & 7))))
+                x += !(x & 7) && !row[x >> 3] ? 8 : 1;
+            if (x >= w)
+                break;
+            x0 = x;
+            while (x < w && (row[x >> 3] & (0x80 >> (x & 7))))
+                x += !(x & 7) && row[x >> 3] == 0xff ? 8 : 1;
+            if (x > w)
+                x = w;
+            if (nruns == maxruns) {
+                maxruns = maxruns ? 2*maxruns : 4096;
+                if (!(p = realloc(rx0, maxruns*sizeof(int))))
+                    goto out;
+                rx0 = (int *)p;
+                if (!(p = realloc(rx1, maxruns*sizeof(int))))
+                    goto out;
+                rx1 = (int *)p;
+                if (!(p = realloc(ry, maxruns*sizeof(int))))
+                    goto out;
+                ry = (int *)p;
+                if (!(p = realloc(parent, maxruns*sizeof(int))))
+                    goto out;
+                parent = (int *)p;
+            }
+            rx0[nruns] = x0;
+            rx1[nruns] = x;
+            ry[nruns] = y;
+            parent[nruns] = nruns;
+            // join the runs of the row above touching it, diagonally too
+            for (j = above; j < cur && rx1[j] < x0; j++)
+                ;
+            for (above = j; j < cur && rx0[j] <= x; j++) {
+                a = find_root(parent, j);
+                b = find_root(parent, nruns);
+                if (a != b)
+                    parent[max(a, b)] = a < b ? a : b;
+            }
+            nruns++;
+        }
+    }
+
+    // a component for each root, numbered as they first come
+    if (!(comp = (int *)malloc(max(nruns, 1)*sizeof(int))))
+        goto out;
+    for (i = n = 0; i < nruns; i++)
+        comp[i] = (k = find_root(parent, i)) == i ? n++ : comp[k];
+    if (!(pg->shapes = (struct shape *)calloc(max(n, 1), sizeof(struct shape))))
+        goto out;
+    for (i = 0; i < n; i++)
+        pg->shapes[i].x = w;
+    for (i = 0; i < nruns; i++) {
+        s = &pg->shapes[comp[i]];
+        if (!s->ink)
+            s->y = ry[i]; // its top row comes first
+        if (rx0[i] < s->x)
+            s->x = rx0[i];
+        if (rx1[i] > s->w)
+            s->w = rx1[i]; // the right edge for now
+        s->h = ry[i] - s->y + 1;
+        s->ink += rx1[i] - rx0[i];
+    }
+    for (i = 0; i < n; i++) {
+        s = &pg->shapes[i];
+        s->w -= s->x;
+        if (s->ink > tiny && !(s->bits = (unsigned char *)calloc((s->w + 7)/8*s->h, 1)))
+            goto out;
+    }
+    for (i = 0; i < nruns; i++) {
+        s = &pg->shapes[comp[i]];
+        if (!s->bits)
+            continue;
+        stride = (s->w + 7)/8;
+        bits = s->bits + (ry[i] - s->y)*stride;
+        for (x = rx0[i] - s->x; x < rx1[i] - s->x; x++)
+            bits[x >> 3] |= 0x80 >> (x & 7);
+    }
+    for (i = j = 0; i < n; i++) {
+        if (!pg->shapes[i].bits)
+            continue;
+        pg->shapes[j] = pg->shapes[i];
+        pg->shapes[j].hash = hash_shape(&pg->shapes[j]);
+        pg->shapes[j].proto = -1;
+        j++;
+    }
+    pg->nshapes = j;
+    ok = 1;
+out:
+    free(rx0);
+    free(rx1);
+    free(ry);
+    free(parent);
+    free(comp);
+    return ok;
+}
+
+static void free_shapes(struct page *pg)
+{
+    int i;
+
+    for (i = 0; i < pg->nshapes; i++)
+        free(pg->shapes[i].bits);
+    free(pg->shapes);
+    pg->shapes = NULL;
+    pg->nshapes = 0;
+}
+
+// render page n bitonal, as ddjvu -format=pbm -mode=color does, and find its shapes. Returns 1 on success
+static int decode_page(struct worker *wk, int n)
+{
+    struct job *job = wk->job;
+    struct page *pg = &job->pages[n];
+    ddjvu_page_t *page = ddjvu_page_create_by_pageno(wk->doc, n);
+    ddjvu_format_t *fmt;
+    ddjvu_rect_t rect;
+    size_t size;
+    int rowsize, ok = 0;
+
+    if (!page)
+        return 0;
+    while (!ddjvu_page_decoding_done(page))
+        handle_messages(wk->ctx, job->file, 1);
+    if (ddjvu_page_decoding_error(page)) {
+        fprintf(stderr, "%s: can't decode page %d\n", job->file, n + 1);
+        ddjvu_page_release(page);
+        return 0;
+    }
+    pg->width = ddjvu_page_get_width(page);
+    pg->height = ddjvu_page_get_height(page);
+    pg->dpi = ddjvu_page_get_resolution(page);
+    rowsize = (pg->width + 7)/8;
+    size = (size_t)rowsize*pg->height;
+    if (size > wk->bufsize) {
+        free(wk->buf);
+        wk->bufsize = 0;
+        if (!(wk->buf = (unsigned char *)malloc(size)))
+            goto out;
+        wk->bufsize = size;
+    }
+    rect.x = rect.y = 0;
+    rect.w = pg->width;
+    rect.h = pg->height;
+    fmt = ddjvu_format_create(DDJVU_FORMAT_MSBTOLSB, 0, NULL);
+    ddjvu_format_set_row_order(fmt, 1);
+    ddjvu_format_set_y_direction(fmt, 1);
+    if (!ddjvu_page_render(page, DDJVU_RENDER_COLOR, &rect, &rect, fmt, rowsize, (char *)wk->buf))
+        memset(wk->buf, 0, size); // nothing on it
+    ddjvu_format_release(fmt);
+    // cjb2's flyspecks
+    ok = find_shapes(pg, wk->buf, rowsize, max(0, pg->dpi*pg->dpi/20000 - 1));
+out:
+    ddjvu_page_release(page);
+    return ok;
+}
+
+static GP<GBitmap> shape_bitmap(const struct shape *s)
+{
+    GP<GBitmap> bm = GBitmap::create(s->h, s->w);
+    int x, y, stride = (s->w + 7)/8;
+
+    // GBitmap rows go from the bottom up
+    for (y = 0; y < s->h; y++) {
+        unsigned char *row = (*bm)[s->h - 1 - y];
+        const unsigned char *bits = s->bits + y*stride;
+        for (x = 0; x < s->w; x++)
+            row[x] = (bits[x >> 3] >> (7 - (x & 7))) & 1;
+    }
+    return bm;
+}
+
+// the bytes written to bs, malloc()ed
+static unsigned char *take_bytes(const GP<ByteStream> &bs, size_t *size)
+{
+    unsigned char *data;
+
+    *size = bs->tell();
+    if (!(data = (unsigned char *)malloc(max(*size, (size_t)1))))
+        G_THROW("out of memory");
+    bs->seek(0);
+    bs->readall(data, *size);
+    return data;
+}
+
+/*
+   Find which shapes of run r come on more than one of its pages, exactly
+   or nearly, and make them its dictionary.
+ */
+static int build_dictionary(struct job *job, struct run *r)
+{
+    struct shape_index protos;
+    struct shape *s;
+    int *last_page = NULL, *npages = NULL, i, k, p, exact, total = 0, ok = 0;
+
+    for (p = r->first; p < r->first + r->npages; p++)
+        total += job->pages[p].nshapes;
+    if (!index_init(&protos, total) || !(last_page = (int *)malloc(max(total, 1)*sizeof(int))) ||
+        !(npages = (int *)calloc(max(total, 1), sizeof(int))) || !(r->dictno = (int *)malloc(max(total, 1)*sizeof(int))))
+        goto out;
+    for (p = r->first; p < r->first + r->npages; p++) {
+        for (i = 0; i < job->pages[p].nshapes; i++) {
+            s = &job->pages[p].shapes[i];
+            if ((k = index_find(&protos, s, &exact)) < 0) {
+                k = index_add(&protos, s);
+                exact = 1;
+                last_page[k] = -1;
+            }
+            s->proto = k;
+            s->exact = exact;
+            if (last_page[k] != p) {
+                last_page[k] = p;
+                npages[k]++;
+            }
+        }
+    }
+    G_TRY {
+        GP<JB2Dict> dict = JB2Dict::create();
+        for (k = 0; k < protos.n; k++) {
+            r->dictno[k] = -1;
+            if (npages[k] < 2)
+                continue;
+            JB2Shape shape;
+            shape.parent = -1;
+            shape.bits = shape_bitmap(protos.items[k]);
+            shape.userdata = 0;
+            r->dictno[k] = dict->add_shape(shape);
+            r->ndict++;
+        }
+        if (r->ndict) {
+            GP<ByteStream> bs = ByteStream::create();
+            dict->encode(bs);
+            r->dict = take_bytes(bs, &r->dict_size);
+
+            GP<ByteStream> file = ByteStream::create();
+            GP<IFFByteStream> iff = IFFByteStream::create(file);
+            iff->put_chunk("FORM:DJVI");
+            iff->put_chunk("Djbz");
+            iff->get_bytestream()->writall(r->dict, r->dict_size);
+            iff->close_chunk();
+            iff->close_chunk();
+            r->data = take_bytes(file, &r->size);
+        }
+        ok = 1;
+    } G_CATCH(ex) {
+        ex.perror();
+    } G_ENDCATCH;
+out:
+    index_free(&protos);
+    free(last_page);
+    free(npages);
+    return ok;
+}
+
+// page n in JB2 on the dictionary of its run, as a FORM:DJVU. Returns 1 on success
+static int encode_page(struct job *job, int n)
+{
+    struct page *pg = &job->pages[n];
+    struct run *r = &job->runs[n/job->dict_pages];
+    struct shape_index seen;
+    struct shape *s;
+    int *shapeno = NULL, i, k, no, dictno, exact, ok = 0;
+
+    if (!index_init(&seen, pg->nshapes) || !(shapeno = (int *)malloc(max(pg->nshapes, 1)*sizeof(int))))
+        goto out;
+    G_TRY {
+        GP<JB2Image> image = JB2Image::create();
+        image->set_dimension(pg->width, pg->height);
+        if (r->ndict) {
+            // a copy of its own, the encoder isn't to share one with other threads
+            GP<JB2Dict> dict = JB2Dict::create();
+            dict->decode(ByteStream::create_static(r->dict, r->dict_size));
+            image->set_inherited_dict(dict);
+        }
+        for (i = 0; i < pg->nshapes; i++) {
+            s = &pg->shapes[i];
+            dictno = s->proto >= 0 ? r->dictno[s->proto] : -1;
+            k = index_find(&seen, s, &exact);
+            if (dictno >= 0 && s->exact)
+                no = dictno;
+            else if (k >= 0 && exact)
+                no = shapeno[k];
+            else {
+                // a refinement of the shape it looks like, if any
+                JB2Shape shape;
+                shape.parent = dictno >= 0 ? dictno : k >= 0 ? shapeno[k] : -1;
+                shape.bits = shape_bitmap(s);
+                shape.userdata = 0;
+                no = image->add_shape(shape);
+                shapeno[index_add(&seen, s)] = no;
+            }
+            JB2Blit blit;
+            blit.left = s->x;
+            blit.bottom = pg->height - s->y - s->h;
+            blit.shapeno = no;
+            image->add_blit(blit);
+        }
+
+        GP<ByteStream> file = ByteStream::create();
+        GP<IFFByteStream> iff = IFFByteStream::create(file);
+        GP<DjVuInfo> info = DjVuInfo::create();
+        info->width = pg->width;
+        info->height = pg->height;
+        info->dpi = pg->dpi;
+        iff->put_chunk("FORM:DJVU");
+        iff->put_chunk("INFO");
+        info->encode(*iff->get_bytestream());
+        iff->close_chunk();
+        if (r->ndict) {
+            iff->put_chunk("INCL");
+            iff->get_bytestream()->writestring(GUTF8String(r->id));
+            iff->close_chunk();
+        }
+        iff->put_chunk("Sjbz");
+        image->encode(iff->get_bytestream());
+        iff->close_chunk();
+        iff->close_chunk();
+        pg->data = take_bytes(file, &pg->size);
+        ok = 1;
+    } G_CATCH(ex) {
+        ex.perror();
+    } G_ENDCATCH;
+out:
+    index_free(&seen);
+    free(shapeno);
+    free_shapes(pg);
+    return ok;
+}
+
+// wake the workers up to something new: tasks to take, a run done or a failure
+static void wake(struct job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->gen++;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void fail(struct job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    job->gen++;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+// the tasks of the pages of run r, the first one on top
+static void push_run(struct worker *wk, const struct run *r, int encode)
+{
+    int p;
+
+    pthread_mutex_lock(&wk->lock);
+    for (p = r->first + r->npages - 1; p >= r->first; p--) {
+        wk->tasks[wk->tail].encode = encode;
+        wk->tasks[wk->tail].page = p;
+        wk->tail++;
+    }
+    pthread_mutex_unlock(&wk->lock);
+    wake(wk->job);
+}
+
+static int pop(struct worker *wk, struct task *t)
+{
+    int ok = 0;
+
+    pthread_mutex_lock(&wk->lock);
+    if (wk->head < wk->tail) {
+        *t = wk->tasks[--wk->tail];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&wk->lock);
+    return ok;
+}
+
+static int steal(struct worker *wk, struct task *t)
+{
+    struct job *job = wk->job;
+    struct worker *victim;
+    int i, ok = 0;
+
+    for (i = 1; i < job->nworkers && !ok; i++) {
+        victim = &job->workers[(wk - job->workers + i) % job->nworkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            *t = victim->tasks[victim->head++];
+            ok = 1;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return ok;
+}
+
+static void run_task(struct worker *wk, const struct task *t)
+{
+    struct job *job = wk->job;
+    struct run *r = &job->runs[t->page/job->dict_pages];
+    int last;
+
+    if (!t->encode) {
+        if (!decode_page(wk, t->page)) {
+            fail(job);
+            return;
+        }
+        pthread_mutex_lock(&job->lock);
+        last = ++r->decoded == r->npages;
+        pthread_mutex_unlock(&job->lock);
+        // the last page of the run in: its dictionary, then its pages can be encoded
+        if (last) {
+            if (!build_dictionary(job, r))
+                fail(job);
+            else
+                push_run(wk, r, 1);
+        }
+    } else {
+        if (!encode_page(job, t->page)) {
+            fail(job);
+            return;
+        }
+        pthread_mutex_lock(&job->lock);
+        if (++r->encoded == r->npages) {
+            free(r->dictno);
+            r->dictno = NULL;
+            job->open_runs--;
+            job->done += r->npages;
+            job->gen++;
+            pthread_cond_broadcast(&job->cond);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *wk = (struct worker *)arg;
+    struct job *job = wk->job;
+    struct task t;
+    int gen, r;
+
+    if (!(wk->ctx = ddjvu_context_create("djvuopt")) || !(wk->doc = open_document(wk->ctx, job->file))) {
+        fail(job);
+        return NULL;
+    }
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        gen = job->gen;
+        if (job->failed || job->done == job->numpages) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+        pthread_mutex_unlock(&job->lock);
+        if (pop(wk, &t) || steal(wk, &t)) {
+            run_task(wk, &t);
+            continue;
+        }
+        pthread_mutex_lock(&job->lock);
+        if (job->next_run < job->nruns && job->open_runs < job->max_runs) {
+            r = job->next_run++;
+            job->open_runs++;
+            pthread_mutex_unlock(&job->lock);
+            push_run(wk, &job->runs[r], 0);
+            continue;
+        }
+        // nothing to do until someone pushes tasks or finishes a run
+        if (job->gen == gen)
+            pthread_cond_wait(&job->cond, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// the outline of the document (NAVM chunk), if it has one
+static GP<DjVmNav> read_outline(const char *file)
+{
+    GP<DjVmNav> nav;
+    GUTF8String chkid;
+    FILE *fp = fopen(file, "rb");
+
+    if (!fp)
+        return nav;
+    G_TRY {
+        GP<IFFByteStream> iff = IFFByteStream::create(ByteStream::create(fp, "rb", true));
+        if (iff->get_chunk(chkid) && chkid == "FORM:DJVM") {
+            while (!nav && iff->get_chunk(chkid)) {
+                if (chkid == "NAVM") {
+                    nav = DjVmNav::create();
+                    nav->decode(iff->get_bytestream());
+                }
+                iff->close_chunk();
+            }
+        }
+    } G_CATCH(ex) {
+        ex.perror();
+        nav = 0;
+    } G_ENDCATCH;
+    return nav;
+}
+
+// the ids and titles of the pages, kept so that the links of the outline still lead to them
+static int read_page_ids(ddjvu_context_t *ctx, ddjvu_document_t *doc, struct job *job)
+{
+    ddjvu_fileinfo_t info;
+    ddjvu_status_t status;
+    char id[32];
+    int i, n = ddjvu_document_get_filenum(doc);
+
+    for (i = 0; i < n; i++) {
+        while ((status = ddjvu_document_get_fileinfo(doc, i, &info)) < DDJVU_JOB_OK)
+            handle_messages(ctx, job->file, 1);
+        if (status != DDJVU_JOB_OK || info.type != 'P' || info.pageno < 0 || info.pageno >= job->numpages || !info.id)
+            continue;
+        job->pages[info.pageno].id = strdup(info.id);
+        if (info.title && strcmp(info.title, info.id))
+            job->pages[info.pageno].title = strdup(info.title);
+    }
+    for (i = 0; i < job->numpages; i++) {
+        if (!job->pages[i].id) {
+            snprintf(id, sizeof(id), "p%04d.djvu", i + 1);
+            job->pages[i].id = strdup(id);
+        }
+        if (!job->pages[i].id)
+            return 0;
+    }
+    return 1;
+}
+
+static int write_document(const char *path, struct job *job, const GP<DjVmNav> &nav)
+{
+    char tmp[PATH_MAX + 8];
+    FILE *fp;
+    int i, p, ok = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(fp = fopen(tmp, "wb"))) {
+        perror(tmp);
+        return 0;
+    }
+    G_TRY {
+        GP<DjVmDoc> doc = DjVmDoc::create();
+        for (i = 0; i < job->nruns; i++) {
+            struct run *r = &job->runs[i];
+            if (r->ndict)
+                doc->insert_file(*ByteStream::create_static(r->data, r->size), DjVmDir::File::INCLUDE,
+                                 GUTF8String(r->id), GUTF8String(r->id));
+            for (p = r->first; p < r->first + r->npages; p++) {
+                struct page *pg = &job->pages[p];
+                doc->insert_file(*ByteStream::create_static(pg->data, pg->size), DjVmDir::File::PAGE,
+                                 GUTF8String(pg->id), GUTF8String(pg->id),
+                                 pg->title ? GUTF8String(pg->title) : GUTF8String());
+            }
+        }
+        if (nav)
+            doc->set_djvm_nav(nav);
+        doc->write(ByteStream::create(fp, "wb", true));
+        ok = 1;
+    } G_CATCH(ex) {
+        ex.perror();
+    } G_ENDCATCH;
+    if (ok && rename(tmp, path)) {
+        perror(path);
+        ok = 0;
+    }
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
+
+static void free_job(struct job *job)
+{
+    int i;
+
+    for (i = 0; job->pages && i < job->numpages; i++) {
+        free_shapes(&job->pages[i]);
+        free(job->pages[i].id);
+        free(job->pages[i].title);
+        free(job->pages[i].data);
+    }
+    for (i = 0; job->runs && i < job->nruns; i++) {
+        free(job->runs[i].dictno);
+        free(job->runs[i].dict);
+        free(job->runs[i].data);
+    }
+    for (i = 0; job->workers && i < job->nworkers; i++) {
+        pthread_mutex_destroy(&job->workers[i].lock);
+        free(job->workers[i].tasks);
+        free(job->workers[i].buf);
+        if (job->workers[i].doc)
+            ddjvu_document_release(job->workers[i].doc);
+        if (job->workers[i].ctx)
+            ddjvu_context_release(job->workers[i].ctx);
+    }
+    free(job->pages);
+    free(job->runs);
+    free(job->workers);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+// optimise file into dir with the threads given. Returns its pages, 0 on failure
+static int optimise(const char *file, const char *dir, int threads, int dict_pages, long *before, long *after)
+{
+    struct job job;
+    struct stat in, out;
+    char path[PATH_MAX];
+    const char *base = strrchr(file, '/');
+    ddjvu_context_t *ctx;
+    ddjvu_document_t *doc;
+    GP<DjVmNav> nav;
+    double start = now();
+    int i, started = 0, ok = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, base ? base + 1 : file);
+    if (stat(file, &in)) {
+        perror(file);
+        return 0;
+    }
+    if (!stat(path, &out) && out.st_dev == in.st_dev && out.st_ino == in.st_ino) {
+        fprintf(stderr, "%s: would be written over\n", file);
+        return 0;
+    }
+    if (!(ctx = ddjvu_context_create("djvuopt")))
+        return 0;
+    if (!(doc = open_document(ctx, file))) {
+        fprintf(stderr, "%s: not a DjVu document\n", file);
+        ddjvu_context_release(ctx);
+        return 0;
+    }
+    memset(&job, 0, sizeof(job));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+    job.file = file;
+    job.numpages = ddjvu_document_get_pagenum(doc);
+    job.dict_pages = dict_pages;
+    job.nruns = (job.numpages + dict_pages - 1)/dict_pages;
+    // enough runs for all the threads to be busy while one builds its dictionary, and no more
+    job.max_runs = (threads + dict_pages - 1)/dict_pages + 1;
+    job.nworkers = threads;
+    job.pages = (struct page *)calloc(max(job.numpages, 1), sizeof(struct page));
+    job.runs = (struct run *)calloc(max(job.nruns, 1), sizeof(struct run));
+    job.workers = (struct worker *)calloc(threads, sizeof(struct worker));
+    if (!job.pages || !job.runs || !job.workers || !read_page_ids(ctx, doc, &job))
+        goto out;
+    nav = read_outline(file);
+    for (i = 0; i < job.nruns; i++) {
+        job.runs[i].first = i*dict_pages;
+        job.runs[i].npages = i == job.nruns - 1 ? job.numpages - job.runs[i].first : dict_pages;
+        snprintf(job.runs[i].id, sizeof(job.runs[i].id), "shared%04d.djbz", i + 1);
+    }
+    for (i = 0; i < threads; i++) {
+        job.workers[i].job = &job;
+        pthread_mutex_init(&job.workers[i].lock, NULL);
+        // each page is pushed once to be decoded and once to be encoded, by whoever
+        if (!(job.workers[i].tasks = (struct task *)malloc(2*max(job.numpages, 1)*sizeof(struct task))))
+            goto out;
+    }
+    for (started = 0; started < threads; started++) {
+        if (pthread_create(&job.workers[started].thread, NULL, worker_thread, &job.workers[started])) {
+            perror("pthread_create");
+            fail(&job);
+            break;
+        }
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(job.workers[i].thread, NULL);
+    if (started == threads && !job.failed && write_document(path, &job, nav) && !stat(path, &out)) {
+        *before += in.st_size;
+        *after += out.st_size;
+        printf("%s: %d pages, %ld KB -> %ld KB (%ld%%), %.1f pages/s\n", path, job.numpages,
+               (long)(in.st_size/1024), (long)(out.st_size/1024), (long)(100.0*out.st_size/max(in.st_size, 1)),
+               job.numpages/max(now() - start, 1e-6));
+        ok = 1;
+    } else
+        fprintf(stderr, "%s: can't optimise\n", file);
+out:
+    free_job(&job);
+    ddjvu_document_release(doc);
+    ddjvu_context_release(ctx);
+    return ok ? job.numpages : 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: djvuopt [-j threads] [-p pages] [-o dir] file.djvu...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "out";
+    long before = 0, after = 0, pages = 0;
+    int c, i, n, threads = sysconf(_SC_NPROCESSORS_ONLN), dict_pages = OPT_DICT_PAGES, failed = 0;
+    double start = now();
+
+    while ((c = getopt(argc, argv, "j:p:o:")) != -1) {
+        switch (c) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'p':
+                dict_pages = atoi(optarg);
+                break;
+            case 'o':
+                dir = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+    if (threads < 1)
+        threads = 1;
+    if (dict_pages < 1)
+        dict_pages = 1;
+    if (mkdir(dir, 0777) && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+    for (i = optind; i < argc; i++) {
+        if ((n = optimise(argv[i], dir, threads, dict_pages, &before, &after)))
+            pages += n;
+        else
+            failed++;
+    }
+    if (argc - optind > 1)
+        printf("%d files, %ld pages, %ld KB -> %ld KB (%ld%%), %.1f pages/s\n", argc - optind - failed, pages,
+               before/1024, after/1024, (long)(100.0*after/max(before, 1)), pages/max(now() - start, 1e-6));
+    return failed != 0;
+}
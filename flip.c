@@ -0,0 +1,189 @@
+/*
+ * flip.c Makes the flipbooks of documents on the host (djvuflip)
+ *
+ * Reads each document as the reader would with the settings of an .ini
+ * file, Next() after Next() from the first window to the last, and keeps
+ * every frame handed to the viewer in "<file>.flip" next to it (see
+ * flipbook.c). The plugin can have a single document open, so the pages
+ * are dealt out in chunks of FLIP_CHUNK to one process per processor.
+ * Each comes into a chunk from the page before it, as a reading from the
+ * start would, and records a flipbook of its own; those are then put
+ * together.
+ *
+ * Usage: djvuflip [-j jobs] [-i file.ini] [-o name=value]... file.djvu...
+ *
+ *   -i  the settings: the .ini file of the document on the reader, or
+ *       any other. The page it was on is left out
+ *   -o  a line of the .ini file, after those of -i
+ *   -j  processes, one per processor by default
+ *
+ * Frames are those of the model the plugin is built for, so this has to
+ * be built for the one the flipbook is meant for (make djvuflip MODEL=v3).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "libdjvu.h"
+#include "flipbook.h"
+#include "host.h"
+
+#define FLIP_CHUNK     8     // pages
+#define FLIP_MAX_STEPS 1000  // Next() per page, at most
+#define FLIP_MAX_LINES 256   // of the .ini file
+
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#endif
+
+/*
+   Read the pages lo to hi - 1: Next() goes forwards (dir 1), or
+   backwards in landscape mode (-1), until it leaves them.
+ */
+static void walk(int lo, int hi, int dir, int numpages)
+{
+    void *data;
+    int p, steps, lead = dir > 0 ? lo - 1 : hi;
+
+    GotoPage(lead >= 0 && lead < numpages ? lead : (dir > 0 ? lo : hi - 1));
+    GetPageData(&data);
+    for (steps = 0; steps < FLIP_MAX_STEPS*(hi - lo + 1) && Next(); steps++) {
+        GetPageData(&data);
+        p = GetPageIndex();
+        if (dir > 0 ? p >= hi : p < lo)
+            break;
+    }
+}
+
+// the chunks of process job out of jobs, recorded as the flipbook part. Returns 1 on success
+static int make_part(const char *file, const char *dir, int job, int jobs, char **lines, int nlines, int landscape,
+                     const char *part)
+{
+    char path[PATH_MAX];
+    void *data;
+    int lo, numpages;
+
+    if (!host_link_file(dir, file, job, path) || !host_write_ini(path, lines, nlines) || !flipbook_record(part))
+        return 0;
+    SetCallbackFunction(&host_callbacks);
+    trace_file = NULL;
+    if (!InitDoc(path))
+        return 0;
+    iInitDocF(path, 0, 0);
+    GetPageData(&data);
+    numpages = GetPageNum();
+    for (lo = job*FLIP_CHUNK; lo < numpages; lo += jobs*FLIP_CHUNK)
+        walk(lo, min(lo + FLIP_CHUNK, numpages), landscape ? -1 : 1, numpages);
+    vEndDoc();
+    return flipbook_finish(path, numpages);
+}
+
+// the flipbook of file, from jobs processes
+static int make_flipbook(const char *file, int jobs, char **lines, int nlines, int landscape)
+{
+    char dir[] = "/tmp/djvuflip.XXXXXX", out[PATH_MAX], cmd[64];
+    char **parts = calloc(jobs, sizeof(*parts));
+    struct stat st;
+    int j, n, status, ok = 1;
+    pid_t pid;
+
+    if (!parts || !mkdtemp(dir)) {
+        perror(file);
+        free(parts);
+        return 0;
+    }
+    fflush(stdout);
+    for (j = 0; j < jobs; j++) {
+        if (!(parts[j] = malloc(PATH_MAX)))
+            break;
+        snprintf(parts[j], PATH_MAX, "%s/part-%d.flip", dir, j);
+        if ((pid = fork()) == 0)
+            _exit(!make_part(file, dir, j, jobs, lines, nlines, landscape, parts[j]));
+        if (pid == -1) {
+            perror("fork");
+            ok = 0;
+            break;
+        }
+    }
+    while (wait(&status) != -1)
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            ok = 0;
+    snprintf(out, sizeof(out), "%s.flip", file);
+    n = j;
+    if (!ok || !flipbook_merge(out, parts, n) || stat(out, &st)) {
+        fprintf(stderr, "%s: can't make the flipbook\n", file);
+        ok = 0;
+    } else
+        printf("%s: %ld KB\n", out, (long)(st.st_size/1024));
+    for (j = 0; j < n; j++)
+        free(parts[j]);
+    free(parts);
+    // the links and the files the plugin left next to them
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    return system(cmd) == 0 && ok;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: djvuflip [-j jobs] [-i file.ini] [-o name=value]... file.djvu...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    // a reading from the top of the first page, of the pages as they are
+    static char *forced[] = {
+        "page_number=0", "rrect.y=0", "reflow=0", "thumbnails=0", "search_index=0", "resume_snapshot=0",
+        "flipbook=0", "render_threads=1", "async_navigation=0"
+    };
+    char *lines[FLIP_MAX_LINES + sizeof(forced)/sizeof(*forced)], buf[256];
+    int c, i, jobs = sysconf(_SC_NPROCESSORS_ONLN), nlines = 0, landscape = 0, failed = 0;
+    FILE *fp;
+
+    while ((c = getopt(argc, argv, "j:i:o:")) != -1) {
+        switch (c) {
+            case 'j':
+                jobs = atoi(optarg);
+                break;
+            case 'i':
+                if (!(fp = fopen(optarg, "r"))) {
+                    perror(optarg);
+                    return 1;
+                }
+                while (fgets(buf, sizeof(buf), fp) && nlines < FLIP_MAX_LINES) {
+                    buf[strcspn(buf, "\r\n")] = 0;
+                    if (*buf && strncmp(buf, "page_number=", 12))
+                        lines[nlines++] = strdup(buf);
+                }
+                fclose(fp);
+                break;
+            case 'o':
+                if (nlines < FLIP_MAX_LINES)
+                    lines[nlines++] = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind >= argc)
+        usage();
+    if (jobs < 1)
+        jobs = 1;
+    for (i = 0; i < nlines; i++)
+        if (!strncmp(lines[i], "landscape=", 10))
+            landscape = atoi(lines[i] + 10);
+    for (i = 0; i < (int)(sizeof(forced)/sizeof(*forced)); i++)
+        lines[nlines++] = forced[i];
+    for (i = optind; i < argc; i++)
+        if (!make_flipbook(argv[i], jobs, lines, nlines, landscape))
+            failed++;
+    return failed != 0;
+}
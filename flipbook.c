@@ -0,0 +1,520 @@
+/*
+ * flipbook.c Frames rendered in advance for libdjvu
+ *
+ * A flipbook, "<file>.flip" next to the document, holds the frames of a
+ * whole reading of it (every window Next() goes through) as they were
+ * handed to the viewer, made on a bigger machine by djvuflip (flip.c).
+ * The plugin maps it and looks each frame up by its key before rendering
+ * anything, and takes the size and crop box of a page from it so that
+ * turning to a page whose frames are all there needs no decoding.
+ *
+ * The file is a header, a table of the pages (a present flag for each,
+ * then their records), the index of the frames sorted by key (key, offset
+ * and length of each) and the frames, compressed with PackBits: pages are
+ * mostly runs of paper and a frame comes out of it in a single pass. Keys
+ * and page records are opaque here, libdjvu.c knows what is in them.
+ *
+ * A flipbook is made in parts, one per process: each records the frames
+ * it renders in "<part>.data" and writes them out as a flipbook of its
+ * own with flipbook_finish(), and flipbook_merge() puts the parts
+ * together. Copies of a frame in several parts are kept once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "flipbook.h"
+#include "debug.h"
+
+#define PAD4(n) (((n) + 3) & ~3)
+
+struct flipbook_header {
+    char magic[8];
+    unsigned int doc_size, doc_hash; // of the document, see doc_id()
+    unsigned int bufsize, keysize, pagesize;
+    unsigned int npages, nframes;
+};
+
+// a flipbook mapped, the one of the document open or a part being merged
+struct book {
+    unsigned char *map;
+    size_t size;
+    const struct flipbook_header *h;
+    const unsigned char *present, *pages, *index;
+    int entry; // bytes of each index entry: the key, then offset and length
+};
+
+static struct book book;
+
+// a frame to write out
+struct item {
+    const unsigned char *key, *data;
+    unsigned int length;
+};
+
+int flipbook_recording;
+
+static struct {
+    char path[512];
+    FILE *data;
+    unsigned int offset; // bytes in data so far
+    int bufsize, keysize, pagesize, nframes, size, npages;
+    unsigned char *keys, *present, *pages;
+    unsigned int *offsets, *lengths;
+    unsigned char *packed; // a compressed frame
+} rec;
+
+static int sort_keysize; // for compare_items()
+
+// the size of a document and a hash of its beginning and end, which tell a copy of it from another document
+static int doc_id(const char *filename, unsigned int *size, unsigned int *hash)
+{
+    unsigned char buf[FLIPBOOK_SAMPLE];
+    unsigned int h = 2166136261U;
+    struct stat st;
+    int fd, n, i, pass;
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return 0;
+    if (fstat(fd, &st)) {
+        (void)close(fd);
+        return 0;
+    }
+    for (pass = 0; pass < 2; pass++) {
+        if (pass && lseek(fd, st.st_size > FLIPBOOK_SAMPLE ? st.st_size - FLIPBOOK_SAMPLE : 0, SEEK_SET) == -1)
+            break;
+        n = read(fd, buf, sizeof(buf));
+        for (i = 0; i < n; i++)
+            h = (h ^ buf[i])*16777619U;
+    }
+    (void)close(fd);
+    *size = st.st_size;
+    *hash = h;
+    return 1;
+}
+
+// PackBits: n + 1 bytes as they are (0 <= n < 128), or the next byte 1 - n times (-128 < n < 0)
+static int pack(const unsigned char *src, int n, unsigned char *dst)
+{
+    int i = 0, o = 0, run, lit;
+
+    while (i < n) {
+        for (run = 1; i + run < n && run < 128 && src[i + run] == src[i]; run++)
+            ;
+        if (run >= 3) {
+            dst[o++] = 257 - run;
+            dst[o++] = src[i];
+            i += run;
+            continue;
+        }
+        // up to the next run of 3
+        for (lit = 0; i + lit < n && lit < 128; lit++)
+            if (i + lit + 2 < n && src[i + lit] == src[i + lit + 1] && src[i + lit] == src[i + lit + 2])
+                break;
+        dst[o++] = lit - 1;
+        memcpy(dst + o, src + i, lit);
+        o += lit;
+        i += lit;
+    }
+    return o;
+}
+
+// 1 if src unpacks to exactly n bytes
+static int unpack(const unsigned char *src, unsigned int len, unsigned char *dst, int n)
+{
+    const unsigned char *end = src + len;
+    int c, o = 0;
+
+    while (src < end) {
+        c = (signed char)*src++;
+        if (c >= 0) {
+            if (o + c + 1 > n || c + 1 > end - src)
+                return 0;
+            memcpy(dst + o, src, c + 1);
+            src += c + 1;
+            o += c + 1;
+        } else if (c != -128) {
+            if (o + 1 - c > n || src == end)
+                return 0;
+            memset(dst + o, *src++, 1 - c);
+            o += 1 - c;
+        }
+    }
+    return o == n;
+}
+
+static void unmap_book(struct book *b)
+{
+    if (b->map)
+        munmap(b->map, b->size);
+    memset(b, 0, sizeof(*b));
+}
+
+// map the flipbook path into b, 0 if it isn't one
+static int map_book(const char *path, struct book *b)
+{
+    const struct flipbook_header *h;
+    struct stat st;
+    size_t need;
+    int fd;
+
+    memset(b, 0, sizeof(*b));
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return 0;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*h)) {
+        (void)close(fd);
+        return 0;
+    }
+    b->size = st.st_size;
+    b->map = mmap(NULL, b->size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd);
+    if (b->map == MAP_FAILED) {
+        b->map = NULL;
+        return 0;
+    }
+    h = b->h = (const struct flipbook_header *)b->map;
+    b->entry = h->keysize + 2*sizeof(unsigned int);
+    need = sizeof(*h) + PAD4(h->npages) + (size_t)h->npages*h->pagesize + (size_t)h->nframes*b->entry;
+    if (memcmp(h->magic, FLIPBOOK_MAGIC, sizeof(h->magic)) || !h->keysize || h->keysize % 4 ||
+        h->pagesize % 4 || need > b->size) {
+        DPRINTF("%s: %s is not a flipbook\n", __FUNCTION__, path);
+        unmap_book(b);
+        return 0;
+    }
+    b->present = b->map + sizeof(*h);
+    b->pages = b->present + PAD4(h->npages);
+    b->index = b->pages + h->npages*h->pagesize;
+    return 1;
+}
+
+/*
+   Map the flipbook of the document filename, if it has one made for
+   frames of bufsize bytes with keys and page records of the sizes given.
+   Returns the number of frames in it.
+ */
+int flipbook_open(const char *filename, int bufsize, int keysize, int pagesize)
+{
+    char name[512];
+    unsigned int size, hash;
+
+    flipbook_close();
+    if (flipbook_recording)
+        return 0;
+    snprintf(name, sizeof(name), "%s.flip", filename);
+    if (!map_book(name, &book))
+        return 0;
+    if (book.h->bufsize != (unsigned int)bufsize || book.h->keysize != (unsigned int)keysize ||
+        book.h->pagesize != (unsigned int)pagesize ||
+        !doc_id(filename, &size, &hash) || book.h->doc_size != size || book.h->doc_hash != hash) {
+        DPRINTF("%s: %s is for another document or model\n", __FUNCTION__, name);
+        unmap_book(&book);
+        return 0;
+    }
+    DPRINTF("%s: %d frames of %d pages\n", __FUNCTION__, book.h->nframes, book.h->npages);
+    return book.h->nframes;
+}
+
+void flipbook_close(void)
+{
+    unmap_book(&book);
+}
+
+int flipbook_frames(void)
+{
+    return book.map ? book.h->nframes : 0;
+}
+
+// put the frame of key into frame (if not NULL), 0 if the flipbook doesn't have it
+int flipbook_frame(const void *key, unsigned char *frame)
+{
+    const unsigned char *e;
+    unsigned int offset, length;
+    int lo = 0, hi, mid, c;
+
+    if (!book.map)
+        return 0;
+    for (hi = book.h->nframes; lo < hi; ) {
+        mid = (lo + hi)/2;
+        e = book.index + (size_t)mid*book.entry;
+        if (!(c = memcmp(key, e, book.h->keysize))) {
+            memcpy(&offset, e + book.h->keysize, sizeof(offset));
+            memcpy(&length, e + book.h->keysize + sizeof(offset), sizeof(length));
+            if (offset > book.size || length > book.size - offset ||
+                (frame && !unpack(book.map + offset, length, frame, book.h->bufsize))) {
+                DPRINTF("%s: frame %d is broken\n", __FUNCTION__, mid);
+                return 0;
+            }
+            return 1;
+        }
+        if (c < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return 0;
+}
+
+// the record of page n, 0 if the flipbook doesn't have it
+int flipbook_page(int n, void *info)
+{
+    if (!book.map || n < 0 || n >= book.h->npages || !book.present[n])
+        return 0;
+    memcpy(info, book.pages + (size_t)n*book.h->pagesize, book.h->pagesize);
+    return 1;
+}
+
+/*
+   Start recording the frames handed to the viewer, and the pages they are
+   of, for the flipbook path. Returns 1 on success.
+ */
+int flipbook_record(const char *path)
+{
+    char name[520];
+
+    flipbook_close();
+    memset(&rec, 0, sizeof(rec));
+    snprintf(rec.path, sizeof(rec.path), "%s", path);
+    snprintf(name, sizeof(name), "%s.data", path);
+    if (!(rec.data = fopen(name, "w+")))
+        return 0;
+    flipbook_recording = 1;
+    return 1;
+}
+
+// one more frame of keysize bytes of key and bufsize bytes
+void flipbook_add(const void *key, int keysize, const unsigned char *frame, int bufsize)
+{
+    void *p;
+    int n;
+
+    if (!rec.data)
+        return;
+    if (!rec.bufsize) {
+        if (!(rec.packed = malloc(bufsize + bufsize/128 + 1)))
+            return;
+        rec.bufsize = bufsize;
+        rec.keysize = keysize;
+    }
+    if (bufsize != rec.bufsize || keysize != rec.keysize)
+        return;
+    if (rec.nframes == rec.size) {
+        n = rec.size ? 2*rec.size : 1024;
+        if (!(p = realloc(rec.keys, (size_t)n*keysize)))
+            return;
+        rec.keys = p;
+        if (!(p = realloc(rec.offsets, n*sizeof(*rec.offsets))))
+            return;
+        rec.offsets = p;
+        if (!(p = realloc(rec.lengths, n*sizeof(*rec.lengths))))
+            return;
+        rec.lengths = p;
+        rec.size = n;
+    }
+    n = pack(frame, bufsize, rec.packed);
+    if (fwrite(rec.packed, 1, n, rec.data) != n)
+        return;
+    memcpy(rec.keys + (size_t)rec.nframes*keysize, key, keysize);
+    rec.offsets[rec.nframes] = rec.offset;
+    rec.lengths[rec.nframes++] = n;
+    rec.offset += n;
+}
+
+// the record of page n, size bytes of info
+void flipbook_add_page(int n, const void *info, int size)
+{
+    void *p;
+
+    if (!rec.data || n < 0 || (rec.pagesize && size != rec.pagesize) || size % 4)
+        return;
+    rec.pagesize = size;
+    if (n >= rec.npages) {
+        if (!(p = realloc(rec.present, n + 1)))
+            return;
+        rec.present = p;
+        if (!(p = realloc(rec.pages, (size_t)(n + 1)*size)))
+            return;
+        rec.pages = p;
+        memset(rec.present + rec.npages, 0, n + 1 - rec.npages);
+        rec.npages = n + 1;
+    }
+    if (!rec.present[n]) {
+        memcpy(rec.pages + (size_t)n*size, info, size);
+        rec.present[n] = 1;
+    }
+}
+
+static int compare_items(const void *a, const void *b)
+{
+    return memcmp(((const struct item *)a)->key, ((const struct item *)b)->key, sort_keysize);
+}
+
+/*
+   Write the flipbook path from h, the page table and the frames, sorted
+   here and kept once each. Returns 1 on success.
+ */
+static int write_book(const char *path, struct flipbook_header *h, const unsigned char *present,
+                      const unsigned char *pages, struct item *items, int n)
+{
+    char tmp[520];
+    static const unsigned char zero[4];
+    unsigned int offset;
+    FILE *fp;
+    int i, m;
+
+    sort_keysize = h->keysize;
+    qsort(items, n, sizeof(*items), compare_items);
+    for (i = m = 0; i < n; i++)
+        if (!m || memcmp(items[i].key, items[m - 1].key, h->keysize))
+            items[m++] = items[i];
+    memcpy(h->magic, FLIPBOOK_MAGIC, sizeof(h->magic));
+    h->nframes = m;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(fp = fopen(tmp, "w")))
+        return 0;
+    fwrite(h, sizeof(*h), 1, fp);
+    fwrite(present, 1, h->npages, fp);
+    fwrite(zero, 1, PAD4(h->npages) - h->npages, fp);
+    fwrite(pages, h->pagesize, h->npages, fp);
+    offset = sizeof(*h) + PAD4(h->npages) + h->npages*h->pagesize + m*(h->keysize + 2*sizeof(unsigned int));
+    for (i = 0; i < m; i++) {
+        fwrite(items[i].key, 1, h->keysize, fp);
+        fwrite(&offset, sizeof(offset), 1, fp);
+        fwrite(&items[i].length, sizeof(items[i].length), 1, fp);
+        offset += items[i].length;
+    }
+    for (i = 0; i < m; i++)
+        fwrite(items[i].data, 1, items[i].length, fp);
+    i = ferror(fp);
+    if (fclose(fp) || i || rename(tmp, path)) {
+        (void)unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+   Stop recording and write out what was recorded as the flipbook of the
+   document filename of npages pages. Returns 1 on success.
+ */
+int flipbook_finish(const char *filename, int npages)
+{
+    struct flipbook_header h;
+    struct item *items = NULL;
+    unsigned char *data = NULL, *present = NULL, *pages = NULL;
+    char name[520];
+    int i, ok = 0;
+
+    flipbook_recording = 0;
+    if (!rec.data)
+        return 0;
+    memset(&h, 0, sizeof(h));
+    if (!doc_id(filename, &h.doc_size, &h.doc_hash) || fflush(rec.data))
+        goto out;
+    h.bufsize = rec.bufsize;
+    h.keysize = rec.keysize;
+    h.pagesize = rec.pagesize;
+    h.npages = npages;
+    if (!(present = calloc(npages + 1, 1)) || !(pages = calloc(npages + 1, rec.pagesize + 1)) ||
+        !(items = malloc((rec.nframes + 1)*sizeof(*items))))
+        goto out;
+    for (i = 0; i < rec.npages && i < npages; i++) {
+        present[i] = rec.present[i];
+        memcpy(pages + (size_t)i*rec.pagesize, rec.pages + (size_t)i*rec.pagesize, rec.pagesize);
+    }
+    if (rec.offset) {
+        data = mmap(NULL, rec.offset, PROT_READ, MAP_SHARED, fileno(rec.data), 0);
+        if (data == MAP_FAILED) {
+            data = NULL;
+            goto out;
+        }
+    }
+    for (i = 0; i < rec.nframes; i++) {
+        items[i].key = rec.keys + (size_t)i*rec.keysize;
+        items[i].data = data + rec.offsets[i];
+        items[i].length = rec.lengths[i];
+    }
+    ok = rec.keysize ? write_book(rec.path, &h, present, pages, items, rec.nframes) : 0;
+out:
+    if (data)
+        munmap(data, rec.offset);
+    fclose(rec.data);
+    snprintf(name, sizeof(name), "%s.data", rec.path);
+    (void)unlink(name);
+    free(items);
+    free(present);
+    free(pages);
+    free(rec.keys);
+    free(rec.offsets);
+    free(rec.lengths);
+    free(rec.present);
+    free(rec.pages);
+    free(rec.packed);
+    memset(&rec, 0, sizeof(rec));
+    return ok;
+}
+
+// put the flipbooks parts[n] of a document together as path, returns 1 on success
+int flipbook_merge(const char *path, char **parts, int n)
+{
+    struct flipbook_header h;
+    struct book *b = calloc(n + 1, sizeof(*b));
+    struct item *items = NULL;
+    unsigned char *present = NULL, *pages = NULL;
+    const unsigned char *e;
+    unsigned int offset;
+    int i, j, p, m = 0, nframes = 0, ok = 0;
+
+    if (!b)
+        return 0;
+    for (i = 0; i < n; i++) {
+        if (!map_book(parts[i], &b[i]))
+            goto out;
+        if (i && (b[i].h->doc_size != b[0].h->doc_size || b[i].h->doc_hash != b[0].h->doc_hash ||
+                  b[i].h->bufsize != b[0].h->bufsize || b[i].h->keysize != b[0].h->keysize ||
+                  b[i].h->npages != b[0].h->npages ||
+                  (b[i].h->pagesize != b[0].h->pagesize && b[i].h->pagesize && b[0].h->pagesize)))
+            goto out;
+        nframes += b[i].h->nframes;
+    }
+    if (!n)
+        goto out;
+    h = *b[0].h;
+    for (i = 0; i < n; i++)
+        if (b[i].h->pagesize)
+            h.pagesize = b[i].h->pagesize;
+    if (!(present = calloc(h.npages + 1, 1)) || !(pages = calloc(h.npages + 1, h.pagesize + 1)) ||
+        !(items = malloc((nframes + 1)*sizeof(*items))))
+        goto out;
+    for (i = 0; i < n; i++) {
+        for (p = 0; b[i].h->pagesize && p < h.npages; p++) {
+            if (b[i].present[p] && !present[p]) {
+                memcpy(pages + (size_t)p*h.pagesize, b[i].pages + (size_t)p*h.pagesize, h.pagesize);
+                present[p] = 1;
+            }
+        }
+        for (j = 0; j < b[i].h->nframes; j++, m++) {
+            e = b[i].index + (size_t)j*b[i].entry;
+            items[m].key = e;
+            memcpy(&items[m].length, e + h.keysize + sizeof(unsigned int), sizeof(items[m].length));
+            memcpy(&offset, e + h.keysize, sizeof(offset));
+            if (offset > b[i].size || items[m].length > b[i].size - offset)
+                goto out;
+            items[m].data = b[i].map + offset;
+        }
+    }
+    ok = write_book(path, &h, present, pages, items, m);
+out:
+    for (i = 0; i < n; i++)
+        unmap_book(&b[i]);
+    free(b);
+    free(items);
+    free(present);
+    free(pages);
+    return ok;
+}
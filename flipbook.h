@@ -0,0 +1,22 @@
+#ifndef _FLIPBOOK_H
+#define _FLIPBOOK_H
+
+#define FLIPBOOK_MAGIC  "DJVUFLP1"
+#define FLIPBOOK_SAMPLE 4096  // bytes at each end of the document which identify it
+
+extern int flipbook_recording;
+
+extern int flipbook_open(const char *, int, int, int);
+extern void flipbook_close(void);
+extern int flipbook_frame(const void *, unsigned char *);
+extern int flipbook_page(int, void *);
+extern int flipbook_frames(void);
+
+// making one, see flip.c
+extern int flipbook_record(const char *);
+extern void flipbook_add(const void *, int, const unsigned char *, int);
+extern void flipbook_add_page(int, const void *, int);
+extern int flipbook_finish(const char *, int);
+extern int flipbook_merge(const char *, char **, int);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * host.c The viewer, as far as the host tools need one (bench.c, flip.c)
+ *
+ * Callbacks which draw nothing, and the copies of the documents they
+ * open the plugin on, each with an .ini file of its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include "libdjvu.h"
+#include "host.h"
+
+static void host_nop(void) {}
+static void host_set_int(int n) {}
+static void host_text_out(int x, int y, char *text, int length, int flags) {}
+static void host_blit(int x, int y, int w, int h, int src_x, int src_y, int src_width, int src_height, unsigned char *buf) {}
+static void host_line(int x1, int y1, int x2, int y2) {}
+static void host_point(int x, int y) {}
+static void host_rect(int x, int y, int width, int height) {}
+static void host_read_area(int x, int y, int width, int height, unsigned char *save) { memset(save, 0xFF, width*height); }
+static void host_clear(unsigned char color) {}
+static int host_battery(void) { return 16; }
+static int host_language(void) { return 0; }
+static char *host_string(char *name) { return NULL; }
+
+struct CallbackFunction host_callbacks = {
+    .BeginDialog = host_nop,
+    .EndDialog = host_nop,
+    .SetFontSize = host_set_int,
+    .SetFontAttr = host_set_int,
+    .TextOut = host_text_out,
+    .BlitBitmap = host_blit,
+    .Line = host_line,
+    .Point = host_point,
+    .Rect = host_rect,
+    .ReadArea = host_read_area,
+    .ClearScreen = host_clear,
+    .GetBatteryState = host_battery,
+    .GetLanguage = host_language,
+    .GetString = host_string,
+    .Print = host_nop,
+    .PartialPrint = host_nop,
+};
+
+/*
+   A copy of the document to work on: a link to it in a directory of
+   our own, so that its .ini file and the others are ours too and each
+   opening starts from nothing. Its flipbook, made beforehand, goes with
+   it.
+ */
+int host_link_file(const char *dir, const char *file, int n, char *path)
+{
+    char abspath[PATH_MAX], flip[PATH_MAX + 8], link[PATH_MAX + 8];
+    const char *base = strrchr(file, '/');
+
+    if (!realpath(file, abspath))
+        return 0;
+    snprintf(path, PATH_MAX, "%s/%d-%s", dir, n, base ? base + 1 : file);
+    if (symlink(abspath, path))
+        return 0;
+    snprintf(flip, sizeof(flip), "%s.flip", abspath);
+    snprintf(link, sizeof(link), "%s.flip", path);
+    if (!access(flip, R_OK) && symlink(flip, link))
+        return 0;
+    return 1;
+}
+
+// the .ini file of the copy path: the lines given, after async_navigation=0 so that they can change it
+int host_write_ini(const char *path, char **lines, int nlines)
+{
+    char ini[PATH_MAX + 8];
+    FILE *fp;
+    int i;
+
+    snprintf(ini, sizeof(ini), "%s.ini", path);
+    if (!(fp = fopen(ini, "w")))
+        return 0;
+    fprintf(fp, "async_navigation=0\n");
+    for (i = 0; i < nlines; i++)
+        fprintf(fp, "%s\n", lines[i]);
+    fclose(fp);
+    return 1;
+}
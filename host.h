@@ -0,0 +1,10 @@
+#ifndef _HOST_H
+#define _HOST_H
+
+// the viewer, stood in for on the host by bench.c and flip.c
+extern struct CallbackFunction host_callbacks;
+
+extern int host_link_file(const char *, const char *, int, char *);
+extern int host_write_ini(const char *, char **, int);
+
+#endif
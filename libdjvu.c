@@ -23,10 +23,29 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <libdjvu/ddjvuapi.h>
 #include "libdjvu.h"
 #include "debug.h"
 #include "keyvalue.h"
+#include "pagecache.h"
+#include "tilecache.h"
+#include "thumbs.h"
+#include "readahead.h"
+#include "memory.h"
+#include "cropbox.h"
+#include "reflow.h"
+#include "search.h"
+#include "bookmarks.h"
+#include "bench.h"
+#include "trace.h"
+#include "bandpool.h"
+#include "flipbook.h"
+
+static inline int move_window_up(void);
+static inline int move_window_down(void);
+static inline int move_window_right(void);
+static inline int move_window_left(void);
 
 #define LIBDJVU_VERSION  "1.97"
 
@@ -49,38 +68,36 @@
 
 #if EREADER_MODEL == HANLIN_V5
 #define PIXELS_PER_BYTE  1
+#define SCREEN_STRIDE SCREEN_WIDTH
 #define SCREEN_BUFFER_SIZE (SCREEN_WIDTH*SCREEN_HEIGHT+1)
 #define WHITE_BLOCK_SIZE (INPUT_BLOCK_WIDTH*INPUT_BLOCK_HEIGHT+1)
+#define MEMORY_BUDGET_KB 24576 /* for the caches, see memory.c */
 #endif
 
 #if EREADER_MODEL == HANLIN_V3
 #define PIXELS_PER_BYTE  4
+#define SCREEN_STRIDE ((SCREEN_WIDTH+3)/4)
 #define SCREEN_BUFFER_SIZE ((SCREEN_WIDTH+3)*SCREEN_HEIGHT/4)
 #define WHITE_BLOCK_SIZE ((INPUT_BLOCK_WIDTH+3)*INPUT_BLOCK_HEIGHT/4)
+#define MEMORY_BUDGET_KB 8192
 #endif
 
 #if DEBUG
 #define PAGE_BACKGROUND 0
 #include <errno.h>
-#include <sys/times.h>
 FILE *logfp;
-#define PROFILE_START DPRINTF("%s: ", __FUNCTION__); struct tms tms1, tms2; times(&tms1);
-#define PROFILE_STOP  times(&tms2); DPRINTF("%ld/%ld ticks\n", tms2.tms_utime - tms1.tms_utime, tms2.tms_stime - tms1.tms_stime);
 #else
 #define PAGE_BACKGROUND 0xFF
-#define PROFILE_START /* nothing */
-#define PROFILE_STOP  /* nothing */
 #endif
 
 #ifndef min
 #define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
 #endif
 
 static int page_number, old_page_number, page_width, page_height, numpages;
 ddjvu_page_type_t page_type;
 static float page_aspect;
-static struct timeval tvstart, tvstop;
-static unsigned int page_render_time_ms, page_decode_time_ms;
 static int landscape, old_landscape, buffer_valid, next_page_bottom, next_page_top;
 static float zoom_factor, old_zoom_factor;
 static int zoom_factor_inc, old_zoom_factor_inc; /* in percent */
@@ -89,7 +106,7 @@ static int *input_buffer, min_input_value, max_input_value, waiting_for_a_key;
 int old_window_pos, show_wmark, old_show_wmark, user_djvu_render_mode, multicol, old_multicol;
 
 /* some details of the djvu file being read */
-static char *base_file_name, *dir_name;
+static char *file_name, *base_file_name, *dir_name;
 static struct stat file_stat;
 
 /* for file.djvu the config file is called file.djvu.ini */
@@ -106,25 +123,232 @@ static char inifname[512];
 #define MAXHSHIFT       800 // could be anything but 800% max is reasonable
 #define MAXVSHIFT       800 // could be anything but 800% max is reasonable
 
+/*
+   Screen buffers come in pairs: the front one is handed to the viewer,
+   the back one is filled by the pre-render thread with the frame we expect
+   to be asked for next. On a hit the two are simply swapped.
+ */
 #if PIXELS_PER_BYTE == 4
-/* GREYSCALE 8-bit bitmap */
-static unsigned char imagebuf[SCREEN_WIDTH*SCREEN_HEIGHT+1];
+/*
+   GREYSCALE 8-bit bitmap, BAND_HEIGHT rows of it at a time. Frames are
+   rendered band by band and each band is packed into screenbuf while it
+   is still in the cache. One band buffer per rendering thread.
+ */
+#define BAND_HEIGHT 24
+static unsigned char bandbuf[BAND_HEIGHT*SCREEN_WIDTH], back_bandbuf[BAND_HEIGHT*SCREEN_WIDTH];
+static unsigned char pool_bandbufs[BANDPOOL_MAX_THREADS - 1][BAND_HEIGHT*SCREEN_WIDTH];
 #endif
 
-static unsigned char screenbuf[SCREEN_BUFFER_SIZE];
+/*
+   With render_threads other than 1 the rectangles to render are cut into
+   horizontal strips which the threads of bandpool.c render (and pack on
+   V3) at the same time, 0 being one thread per processor. Strips are at
+   least RENDER_STRIP_ROWS high, two per thread to even out pages denser
+   in some places than in others.
+ */
+#define RENDER_STRIP_ROWS 64
+static int render_threads = 1;
+
+static unsigned char screenbufs[2][SCREEN_BUFFER_SIZE];
+static unsigned char *screenbuf = screenbufs[0], *back_screenbuf = screenbufs[1];
 static unsigned char whiteblock[] = {[0 ... WHITE_BLOCK_SIZE] = 0xFF};
 
 /* various handles for interacting with djvulibre */
 ddjvu_context_t *djvu_context;
 ddjvu_document_t *djvu_document;
-ddjvu_page_t *djvu_page, *djvu_page_next;
+ddjvu_page_t *djvu_page;
 ddjvu_format_t *djvu_format;
 ddjvu_render_mode_t djvu_render_mode;
 ddjvu_rect_t prect, rrect, old_prect, old_rrect;
 
+/* describes the content of a rendered frame */
+struct frame_key {
+    int page;
+    ddjvu_rect_t prect, rrect;
+    ddjvu_render_mode_t mode;
+    int landscape;
+    int wmark_pos; /* -1 if no window mark is drawn */
+    int preview; /* rendered from a page which is still decoding */
+};
+
+/* background pre-rendering of the frame expected after the current one */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running, quit, busy, ready;
+    ddjvu_page_t *page;
+    struct frame_key key;
+    unsigned int hits, misses;
+} prerender = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/*
+   The viewer calls us from its key thread, the navigation thread below
+   finishes page turns in the background. Everything either of them
+   touches is protected by ui_lock, taken by all the entry points which
+   change the view. It is recursive as they call each other.
+ */
+static pthread_mutex_t ui_lock;
+static pthread_once_t ui_lock_once = PTHREAD_ONCE_INIT;
+
+/*
+   A page turn whose page is still decoding. GotoPage() returns right away
+   and nav_thread() shows the page once it has been decoded. Page turns
+   in the meantime only change the target.
+ */
+#define NAV_POLL_MS 20
+static struct {
+    pthread_t thread;
+    pthread_cond_t cond;
+    int running, quit, pending, target;
+    int can_draw; /* the page is on the screen, not a menu or a dialog */
+    int chunks, tried_chunks, preview_shown; /* see nav_preview() */
+    unsigned long long start; /* trace_now() when the page was asked for */
+} nav = { .cond = PTHREAD_COND_INITIALIZER };
+static int async_navigation = 1;
+
+/* show compound and photo pages before their background has been decoded */
+#define NAV_CHUNK_MASK 1
+#define NAV_CHUNK_BG   2
+static int progressive_display = 1;
+
+/*
+   Thumbnail navigator: a GRID_COLS x GRID_ROWS grid of page thumbnails
+   with a cursor on one of them. OK goes to that page.
+ */
+#define GRID_COLS    4
+#define GRID_ROWS    4
+#define GRID_PAGES   (GRID_COLS*GRID_ROWS)
+#define GRID_LEFT    4   /* keeps the cells on 4 pixel (byte) boundaries on V3 */
+#define GRID_CELL_W  148
+#define GRID_CELL_H  200
+#define GRID_LABEL_H 28  /* below the thumbnail, for the page number */
+static int grid_active, grid_first, grid_cursor;
+static int thumbnails = 1;
+
+/* what the front buffer holds at the moment */
+static struct frame_key shown_key;
+static int shown_valid;
+
+/*
+   The last frame of the document, saved by vEndDoc() in "<file>.snap" and
+   shown by iInitDocF() at once if the window it was rendered for is the
+   one we open in. The document and page then decode in the background.
+ */
+#define SNAPSHOT_MAGIC "DJVUSNP1"
+static struct snapshot_header {
+    char magic[8];
+    unsigned int size, mtime, bufsize;
+    int numpages, page_width, page_height, page_type;
+    struct frame_key key;
+} snapshot; /* numpages is 0 unless the one of this document is good */
+static char snapfname[512];
+static int resume_snapshot = 1;
+static int resuming; /* the snapshot is in screenbuf, the viewer hasn't asked for it yet */
+
+/* +1 if the last move was Next(), -1 if Prev() */
+static int last_direction = 1;
+
+/*
+   Automatic margin cropping: prect is then the content box of the page
+   (see cropbox.c), scaled to fit the screen width at zoom 100%, and
+   page_rect is where that puts the whole page, i.e. what we render.
+   Without it the two are the same.
+ */
+static int autocrop;
+static struct cropbox crop_box = {0, 0, CROPBOX_UNIT, CROPBOX_UNIT}; /* of the page shown */
+static ddjvu_rect_t page_rect, old_page_rect;
+
+/*
+   Reading path of the page in multicolumn mode: the windows, in reading
+   order, which go down each of its columns (see cropbox.c) in turn, in
+   strips if a column is wider than the screen. It is worked out for the
+   zoom, orientation and step we are at and kept for the last few pages,
+   so Next()/Prev() and predict_next_frame() just look it up.
+ */
+#define PATH_PAGES     4
+#define PATH_MAX_STEPS 256
+static struct reading_path {
+    int page, landscape, vert_shift_factor;
+    ddjvu_rect_t page_rect, prect, rrect; /* only the size of rrect counts */
+    int nsteps;
+    struct { int x, y, strip; } step[PATH_MAX_STEPS];
+} paths[PATH_PAGES];
+
+/*
+   Reflow mode: the words of pages with a text layer are set again into
+   screen wide lines at the zoom (see reflow.c) and Next()/Prev() go
+   through the reflow_screens screens of a page before turning it.
+   reflow_screens is 0 while the page is shown as it is.
+ */
+static int reflow, reflow_screen, reflow_screens;
+
+/*
+   Search dialog: a word is typed on the keypad and picked among the
+   words of the document which fit (see search.c), then one of the pages
+   it is on. It stays inverted on the pages it is on until the dialog is
+   closed with nothing typed. search_boxes[] are where it is on the page
+   of search_boxes_page.
+ */
+#define SEARCH_ROWS      16
+#define SEARCH_MAX_HITS  1024
+#define SEARCH_MAX_BOXES 64
+static int search_index = 1;
+static int search_active; /* 1 while picking the word, 2 the page */
+static char search_code[SEARCH_MAX_WORD], search_term[SEARCH_MAX_WORD];
+static char search_words[SEARCH_ROWS][SEARCH_MAX_WORD];
+static int search_nwords, search_cursor;
+static unsigned short search_hits[SEARCH_MAX_HITS];
+static int search_nhits, search_boxes_page = -1, search_nboxes;
+static int search_boxes_of_page[SEARCH_MAX_BOXES][4];
+static int next_path;
+
+/* pages read ahead from the card in the direction of reading, see readahead.c */
+static int readahead_ahead = 4;
+
+/*
+   Flipbook: the frames of the document made in advance by djvuflip (see
+   flipbook.c), looked up by their frame_key. A page is turned to with the
+   flip_page of it, djvu_page stays NULL and the page is only decoded by
+   need_page() if a frame of it isn't in the flipbook.
+ */
+struct flip_page {
+    int width, height, type;
+    int landscape, autocrop, multicol; /* the crop box is for these */
+    int box[4], ncolumns, columns[CROPBOX_MAX_COLUMNS][2]; /* crop_box, as ints to be the same on the host */
+};
+static int flipbook = 1;
+
+/* set while we compute (but not show) the window that Next()/Prev() would move to */
+static int predicting;
+static ddjvu_page_t *predicted_page;
+
+/*
+   What is on the panel, a copy of the last frame (a hash of its tiles could
+   miss a change, which would then stay on the panel until a full refresh),
+   and the rectangles where the current frame differs, in rows of
+   DIRTY_COLS column tiles.
+ */
+#define DIRTY_COLS      10
+#define DIRTY_COL_WIDTH (SCREEN_WIDTH/DIRTY_COLS) /* a multiple of 4 pixels */
+#define DIRTY_MAX_RECTS 16
+static unsigned char panel_frame[SCREEN_HEIGHT*SCREEN_STRIDE];
+static int panel_valid;
+static struct { int x, y, w, h; } dirty_rects[DIRTY_MAX_RECTS];
+static int ndirty_rects, dirty_area;
+static int refreshing; /* set while refresh_screen() calls GetPageData() */
+
+/* partial refresh if at most this part of the screen changed, 0 disables it */
+static int partial_refresh_percent = 40;
+/* full refresh after this many partial ones to clear the ghosting */
+static int full_refresh_every = 10;
+static int partial_refreshes;
+
 static struct CallbackFunction *v3_callbacks;
 #define DJVULOGDIR  "/home/logs"
 #define DJVULOGFILE "/home/logs/libdjvulog.txt"
+#define DJVUTRACEFILE "/home/logs/libdjvu-trace.json" /* see trace.c */
+const char *trace_file = DJVUTRACEFILE; /* the host tools save it elsewhere or not at all */
 
 void SetCallbackFunction(struct CallbackFunction *cb)
 {
@@ -153,14 +377,15 @@ static inline void set_djvu_render_mode(void)
 // returns 1 on success, 0 on error
 static inline int page_decoded_ok(void)
 {
-    gettimeofday(&tvstart, NULL);
+    BENCH_START(t);
+    TRACE_BEGIN(start);
     while (!ddjvu_page_decoding_done(djvu_page)) {
         ddjvu_message_wait(djvu_context);
         while (ddjvu_message_peek(djvu_context))
             ddjvu_message_pop(djvu_context);
     }
-    gettimeofday(&tvstop, NULL);
-    page_decode_time_ms = 1000*(tvstop.tv_sec - tvstart.tv_sec) + (tvstop.tv_usec - tvstart.tv_usec)/1000;
+    TRACE_END(start, TRACE_DECODE, page_number);
+    BENCH_STOP(t, BENCH_DECODE);
     if (ddjvu_page_decoding_error(djvu_page))
        return 0;
     return 1;
@@ -318,39 +543,169 @@ int Fit(void)
     return 1;
 }
 
-int GotoPage(int n)
+// scale the page for the zoom factor: prect is the part of it we show, page_rect all of it
+static inline void set_prect(void)
 {
-    int distance;
-    DPRINTF("%s(%d)\n", __FUNCTION__, n);
-    if (n < 0)
-        n = 0;
-    else if (n >= numpages)
-        n = numpages - 1;
-    ddjvu_page_release(djvu_page);
-    djvu_page = ddjvu_page_create_by_pageno(djvu_document, n);
-    if (!djvu_page) {
-        DPRINTF("%s: ddjvu_page_create_by_pageno() page=%d failed\n", __FUNCTION__, n);
-        return 0;
+    float cw = (float)(crop_box.x1 - crop_box.x0)/CROPBOX_UNIT, ch = (float)(crop_box.y1 - crop_box.y0)/CROPBOX_UNIT;
+
+    if (landscape) {
+        // the page is on its side, its top on the right
+        page_rect.h = (unsigned int)((float)SCREEN_HEIGHT * zoom_factor / cw);
+        page_rect.w = (unsigned int)((float)page_rect.h * page_aspect);
+        page_rect.x = -(int)((float)page_rect.w * (CROPBOX_UNIT - crop_box.y1)/CROPBOX_UNIT);
+        page_rect.y = -(int)((float)page_rect.h * crop_box.x0/CROPBOX_UNIT);
+        prect.w = (unsigned int)((float)page_rect.w * ch);
+        prect.h = (unsigned int)((float)page_rect.h * cw);
+    } else {
+        page_rect.w = (unsigned int)((float)SCREEN_WIDTH * zoom_factor / cw);
+        page_rect.h = (unsigned int)((float)page_rect.w * page_aspect);
+        page_rect.x = -(int)((float)page_rect.w * crop_box.x0/CROPBOX_UNIT);
+        page_rect.y = -(int)((float)page_rect.h * crop_box.y0/CROPBOX_UNIT);
+        prect.w = (unsigned int)((float)page_rect.w * cw);
+        prect.h = (unsigned int)((float)page_rect.h * ch);
     }
-    old_window_pos = -1;
-    if (!page_decoded_ok()) {
-        DPRINTF("%s: decoding failed on page %d\n", __FUNCTION__, n);
-        return 1;
+}
+
+// the content box of page n (page its handle, if any) when cropping, otherwise the whole page
+static inline void set_crop_box(int n, ddjvu_page_t *page)
+{
+    static const struct cropbox whole_page = {0, 0, CROPBOX_UNIT, CROPBOX_UNIT};
+
+    if (!(autocrop || multicol) || !cropbox_get(n, page, landscape, &crop_box))
+        crop_box = whole_page;
+    else if (!autocrop) {
+        // only the columns are wanted
+        crop_box.x0 = crop_box.y0 = 0;
+        crop_box.x1 = crop_box.y1 = CROPBOX_UNIT;
+    }
+}
+
+static inline int same_rect(const ddjvu_rect_t *a, const ddjvu_rect_t *b)
+{
+    return a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h;
+}
+
+// position of step i of path p down its strip, in reading order
+static inline int path_along(const struct reading_path *p, int i)
+{
+    return p->landscape ? -p->step[i].x : p->step[i].y;
+}
+
+// the reading path of the window shown, NULL if the columns of the page aren't known
+static struct reading_path *reading_path(void)
+{
+    struct reading_path *p;
+    int i, c, s, a, a0, a1, t, nstrips, last_a = -1, strip = 0;
+    int across = landscape ? prect.h : prect.w, across_win = landscape ? rrect.h : rrect.w;
+    int last = landscape ? prect.w - rrect.w : prect.h - rrect.h;
+    int delta = max(1, (landscape ? rrect.w : rrect.h)*vert_shift_factor/100);
+    int page_across = landscape ? page_rect.h : page_rect.w, offset = landscape ? page_rect.y : page_rect.x;
+
+    if (!crop_box.ncolumns)
+        return NULL;
+    for (i = 0; i < PATH_PAGES; i++) {
+        p = &paths[i];
+        if (p->nsteps && p->page == page_number && p->landscape == landscape &&
+            p->vert_shift_factor == vert_shift_factor && same_rect(&p->page_rect, &page_rect) &&
+            same_rect(&p->prect, &prect) && p->rrect.w == rrect.w && p->rrect.h == rrect.h)
+            return p;
+    }
+    p = &paths[next_path];
+    next_path = (next_path + 1) % PATH_PAGES;
+    p->page = page_number;
+    p->landscape = landscape;
+    p->vert_shift_factor = vert_shift_factor;
+    p->page_rect = page_rect;
+    p->prect = prect;
+    p->rrect = rrect;
+    p->nsteps = 0;
+    for (c = 0; c < crop_box.ncolumns; c++) {
+        a0 = max(0, crop_box.columns[c][0]*page_across/CROPBOX_UNIT + offset);
+        a1 = min(across, crop_box.columns[c][1]*page_across/CROPBOX_UNIT + offset);
+        if (a1 <= a0)
+            continue; // cropped off
+        nstrips = (a1 - a0 + across_win - 1)/across_win;
+        for (s = 0; s < nstrips; s++) {
+            if (nstrips == 1)
+                a = (a0 + a1 - across_win)/2; // centred on the column
+            else
+                a = a0 + s*(a1 - a0 - across_win)/(nstrips - 1);
+            a = max(0, min(a, across - across_win));
+            if (a == last_a)
+                continue; // the window takes in this one as well
+            last_a = a;
+            for (t = 0; ; t = min(t + delta, last)) {
+                if (p->nsteps == PATH_MAX_STEPS) {
+                    p->nsteps = 0;
+                    return NULL;
+                }
+                p->step[p->nsteps].x = landscape ? last - t : a; // the top of the page is on the right
+                p->step[p->nsteps].y = landscape ? a : t;
+                p->step[p->nsteps++].strip = strip;
+                if (t >= last)
+                    break;
+            }
+            strip++;
+        }
+    }
+    DPRINTF("%s: page %d, %d columns, %d strips, %d steps\n", __FUNCTION__, page_number, crop_box.ncolumns, strip, p->nsteps);
+    return p->nsteps ? p : NULL;
+}
+
+/*
+   Move the window along the reading path: to the next (dir 1) or the
+   previous (dir -1) step, or with strip set to the first step of the
+   next strip or the last of the previous one. Returns 1 if it moved, 0
+   at the end of the path, -1 if there is no path to follow.
+ */
+static int follow_path(int dir, int strip)
+{
+    struct reading_path *p = reading_path();
+    int i, d, best = -1, cur_strip = 0, cur_along, a = landscape ? rrect.y : rrect.x;
+
+    if (!p)
+        return -1;
+    // the strip we are in is the nearest one, the window may have been moved sideways
+    for (i = 0; i < p->nsteps; i++) {
+        d = abs((landscape ? p->step[i].y : p->step[i].x) - a);
+        if (best < 0 || d < best) {
+            best = d;
+            cur_strip = p->step[i].strip;
+        }
+    }
+    cur_along = landscape ? -rrect.x : rrect.y;
+    if (dir > 0) {
+        for (i = 0; i < p->nsteps; i++)
+            if (p->step[i].strip > cur_strip || (!strip && p->step[i].strip == cur_strip && path_along(p, i) > cur_along))
+                break;
+        if (i == p->nsteps)
+            return 0;
     } else {
-        ddjvu_page_release(djvu_page_next);
-        djvu_page_next = ddjvu_page_create_by_pageno(djvu_document, n + 1);
+        for (i = p->nsteps - 1; i >= 0; i--)
+            if (p->step[i].strip < cur_strip || (!strip && p->step[i].strip == cur_strip && path_along(p, i) < cur_along))
+                break;
+        if (i < 0)
+            return 0;
     }
-    page_width = ddjvu_page_get_width(djvu_page);
-    page_height = ddjvu_page_get_height(djvu_page);
-    page_aspect = (float)page_height/(float)page_width;
-    page_type = ddjvu_page_get_type(djvu_page);
-    if (!user_djvu_render_mode)
-        set_djvu_render_mode();
+    if (p->step[i].strip != cur_strip)
+        old_window_pos = -1;
+    else if (landscape)
+        old_window_pos = (dir > 0 ? 0 : (int)rrect.w) + rrect.x - p->step[i].x;
+    else
+        old_window_pos = (dir > 0 ? (int)rrect.h : 0) + rrect.y - p->step[i].y;
+    rrect.x = p->step[i].x;
+    rrect.y = p->step[i].y;
+    buffer_valid = 0;
+    return 1;
+}
 
-    // set up page and rendering rectangles
+// set up page and rendering rectangles for a page we have just turned to
+static inline void set_new_page_rects(void)
+{
+    struct reading_path *p;
+    int distance, i;
+    set_prect();
     if (landscape) {
-        prect.h = (unsigned int)((float)SCREEN_HEIGHT * zoom_factor);
-        prect.w = (unsigned int)((float)prect.h * page_aspect);
         rrect.w = min(prect.w, SCREEN_WIDTH);
         rrect.h = min(prect.h, SCREEN_HEIGHT);
         distance = (int)(prect.w - rrect.w);
@@ -364,8 +719,6 @@ int GotoPage(int n)
         if (rrect.y > distance || (multicol && next_page_bottom))
             rrect.y = distance;
     } else {
-        prect.w = (unsigned int)((float)SCREEN_WIDTH * zoom_factor);
-        prect.h = (unsigned int)((float)prect.w * page_aspect);
         rrect.w = min(prect.w, SCREEN_WIDTH);
         rrect.h = min(prect.h, SCREEN_HEIGHT);
         distance = (int)(prect.w - rrect.w);
@@ -379,12 +732,301 @@ int GotoPage(int n)
             if (multicol) rrect.x = 0;
         }
     }
+    // start from the first (or the last) window of the reading path
+    if (multicol && (next_page_top || next_page_bottom) && (p = reading_path())) {
+        i = next_page_top ? 0 : p->nsteps - 1;
+        rrect.x = p->step[i].x;
+        rrect.y = p->step[i].y;
+    }
+}
 
+// the geometry, type and crop box of page n for the flipbook being made
+static void flip_page_record(int n)
+{
+    struct flip_page fp;
+    int i;
+
+    memset(&fp, 0, sizeof(fp));
+    fp.width = page_width;
+    fp.height = page_height;
+    fp.type = page_type;
+    fp.landscape = landscape;
+    fp.autocrop = autocrop;
+    fp.multicol = multicol;
+    fp.box[0] = crop_box.x0;
+    fp.box[1] = crop_box.y0;
+    fp.box[2] = crop_box.x1;
+    fp.box[3] = crop_box.y1;
+    fp.ncolumns = crop_box.ncolumns;
+    for (i = 0; i < CROPBOX_MAX_COLUMNS; i++) {
+        fp.columns[i][0] = crop_box.columns[i][0];
+        fp.columns[i][1] = crop_box.columns[i][1];
+    }
+    flipbook_add_page(n, &fp, sizeof(fp));
+}
+
+// take the geometry and type of page n, freshly decoded
+static inline void set_page_info(ddjvu_page_t *page, int n)
+{
+    page_width = ddjvu_page_get_width(page);
+    page_height = ddjvu_page_get_height(page);
+    page_aspect = (float)page_height/(float)page_width;
+    page_type = ddjvu_page_get_type(page);
+    if (!user_djvu_render_mode)
+        set_djvu_render_mode();
+    set_crop_box(n, page);
+    set_new_page_rects();
+    if (flipbook_recording)
+        flip_page_record(n);
+}
+
+// take the geometry and type of page n from the flipbook, 0 if it doesn't have them for this view
+static int flip_page_info(int n)
+{
+    struct flip_page fp;
+    int i;
+
+    if (!flipbook_page(n, &fp) || fp.landscape != landscape || fp.autocrop != autocrop || fp.multicol != multicol)
+        return 0;
+    page_width = fp.width;
+    page_height = fp.height;
+    page_aspect = (float)page_height/(float)page_width;
+    page_type = fp.type;
+    if (!user_djvu_render_mode)
+        set_djvu_render_mode();
+    crop_box.x0 = fp.box[0];
+    crop_box.y0 = fp.box[1];
+    crop_box.x1 = fp.box[2];
+    crop_box.y1 = fp.box[3];
+    crop_box.ncolumns = fp.ncolumns;
+    for (i = 0; i < CROPBOX_MAX_COLUMNS; i++) {
+        crop_box.columns[i][0] = fp.columns[i][0];
+        crop_box.columns[i][1] = fp.columns[i][1];
+    }
+    set_new_page_rects();
+    return 1;
+}
+
+static void nav_preview(ddjvu_page_t *page);
+static void blit_dirty_rects(void);
+
+static void ui_lock_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ui_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static inline void ui_enter(void)
+{
+    pthread_once(&ui_lock_once, ui_lock_init);
+    pthread_mutex_lock(&ui_lock);
+}
+
+static inline void ui_leave(void)
+{
+    pthread_mutex_unlock(&ui_lock);
+}
+
+// have the page and the ones likely to be read after it fetched from the card
+static inline void read_ahead(int n)
+{
+    // Next() goes back a page in landscape mode
+    readahead_pages(n, landscape ? -last_direction : last_direction, readahead_ahead, pagecache_behind);
+}
+
+// the page shown came from the flipbook, decode it for what needs it. Returns 0 if it can't be
+static int need_page(void)
+{
+    if (djvu_page)
+        return 1;
+    read_ahead(page_number);
+    if (!(djvu_page = pagecache_get(page_number)))
+        return 0;
+    DPRINTF("%s: decoding page %d\n", __FUNCTION__, page_number);
+    return page_decoded_ok();
+}
+
+static void *nav_thread(void *arg)
+{
+    struct timespec ts;
+    struct timeval now;
+    ddjvu_message_t *msg;
+    ddjvu_page_t *page;
+    void *data;
+
+    ui_enter();
+    while (!nav.quit) {
+        if (!nav.pending) {
+            pthread_cond_wait(&nav.cond, &ui_lock);
+            continue;
+        }
+        page = pagecache_peek(nav.target);
+        read_ahead(nav.target); // again once DOCINFO is there if we are on a snapshot
+        if (page && !ddjvu_page_decoding_done(page)) {
+            // still not done a poll after a chunk arrived, so not a bitonal page finishing
+            if (progressive_display && !reflow && !nav.preview_shown && nav.chunks != nav.tried_chunks)
+                nav_preview(page);
+            while ((msg = ddjvu_message_peek(djvu_context))) {
+                if (msg->m_any.tag == DDJVU_CHUNK && msg->m_any.page == page && msg->m_chunk.chunkid) {
+                    if (!strncmp(msg->m_chunk.chunkid, "Sjbz", 4))
+                        nav.chunks |= NAV_CHUNK_MASK;
+                    else if (!strncmp(msg->m_chunk.chunkid, "BG44", 4))
+                        nav.chunks |= NAV_CHUNK_BG;
+                }
+                ddjvu_message_pop(djvu_context);
+            }
+            gettimeofday(&now, NULL);
+            ts.tv_sec = now.tv_sec;
+            ts.tv_nsec = now.tv_usec*1000 + NAV_POLL_MS*1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&nav.cond, &ui_lock, &ts);
+            continue;
+        }
+        nav.pending = 0;
+        TRACE_END(nav.start, TRACE_DECODE, nav.target);
+        if (!page || ddjvu_page_decoding_error(page)) {
+            DPRINTF("%s: decoding failed on page %d\n", __FUNCTION__, nav.target);
+            continue;
+        }
+        if (snapshot.numpages && ddjvu_document_decoding_done(djvu_document))
+            numpages = ddjvu_document_get_pagenum(djvu_document);
+        pagecache_prefetch(nav.target);
+        set_page_info(page, nav.target);
+        resuming = 0; // the viewer will get the live frame straight away
+        buffer_valid = 0;
+        GetPageData(&data);
+        DPRINTF("%s: page %d ready after %ums\n", __FUNCTION__, nav.target, trace_last_ms(TRACE_DECODE));
+        if (!nav.can_draw)
+            continue;
+        if (nav.preview_shown) {
+            // only replace what the preview got wrong
+            if (ndirty_rects) {
+                blit_dirty_rects();
+                v3_callbacks->PartialPrint();
+                partial_refreshes++;
+            }
+        } else {
+            v3_callbacks->BlitBitmap(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, data);
+            v3_callbacks->Print();
+        }
+    }
+    ui_leave();
+    return NULL;
+}
+
+// make page n the target of the pending page turn, returns 0 if it has to be done synchronously
+static int nav_start(int n)
+{
+    if (!nav.running) {
+        if (pthread_create(&nav.thread, NULL, nav_thread, NULL)) {
+            DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+            return 0;
+        }
+        nav.running = 1;
+    }
+    if (!nav.pending)
+        nav.start = trace_now();
+    if (!nav.pending || nav.target != n) {
+        // -1 so that a page already partly decoded gets a try at the first poll
+        nav.chunks = nav.preview_shown = 0;
+        nav.tried_chunks = -1;
+    }
+    nav.target = n;
+    nav.pending = nav.can_draw = 1;
+    pthread_cond_broadcast(&nav.cond);
+    return 1;
+}
+
+static inline void nav_stop(void)
+{
+    if (!nav.running)
+        return;
+    ui_enter();
+    nav.quit = 1;
+    pthread_cond_broadcast(&nav.cond);
+    ui_leave();
+    pthread_join(nav.thread, NULL);
+    nav.running = nav.quit = nav.pending = 0;
+}
+
+static void prerender_wait(void);
+
+// only pretend to turn to page n, see predict_next_frame()
+static inline int predict_page(int n)
+{
+    predicted_page = pagecache_peek(n);
+    if (!predicted_page || !ddjvu_page_decoding_done(predicted_page) || ddjvu_page_decoding_error(predicted_page)) {
+        predicted_page = NULL;
+        return 0;
+    }
+    old_window_pos = -1;
     page_number = n;
+    set_page_info(predicted_page, n);
+    return 1;
+}
+
+static int goto_page(int n)
+{
+    if (n < 0)
+        n = 0;
+    else if (n >= numpages)
+        n = numpages - 1;
+    if (predicting)
+        return predict_page(n);
+    reflow_screen = 0;
+    prerender_wait(); // the pre-render thread may be using the pages the cache is about to release
+    if (flip_page_info(n)) {
+        // its frames are in the flipbook, nothing to decode unless one isn't
+        nav.pending = 0;
+        djvu_page = NULL;
+        old_window_pos = -1;
+        page_number = n;
+        buffer_valid = 0;
+        return 1;
+    }
+    read_ahead(n);
+    djvu_page = pagecache_get(n);
+    if (!djvu_page) {
+        DPRINTF("%s: ddjvu_page_create_by_pageno() page=%d failed\n", __FUNCTION__, n);
+        return 0;
+    }
+    old_window_pos = -1;
+    // don't keep the viewer waiting for the page to decode
+    if (async_navigation && !ddjvu_page_decoding_done(djvu_page) && nav_start(n)) {
+        page_number = n;
+        return 2;
+    }
+    nav.pending = 0;
+    if (!page_decoded_ok()) {
+        DPRINTF("%s: decoding failed on page %d\n", __FUNCTION__, n);
+        return 1;
+    } else
+        pagecache_prefetch(n);
+    page_number = n;
+    set_page_info(djvu_page, n);
     buffer_valid = 0;
     return 1;
 }
 
+int GotoPage(int n)
+{
+    int retval;
+
+    DPRINTF("%s(%d)\n", __FUNCTION__, n);
+    trace_key(-1, trace_now());
+    ui_enter();
+    retval = goto_page(n);
+    ui_leave();
+    return retval;
+}
+
 static inline int goto_prev_page(void)
 {
     DPRINTF("%s()\n", __FUNCTION__);
@@ -441,6 +1083,29 @@ static inline void set_defaults(void)
     old_page_number = -1;
 }
 
+// returns 1 if there is a snapshot made for this very version of the file
+static int read_snapshot_header(char *filename)
+{
+    FILE *fp;
+    int ok = 0;
+
+    snprintf(snapfname, sizeof(snapfname), "%s.snap", filename);
+    memset(&snapshot, 0, sizeof(snapshot));
+    if (!(fp = fopen(snapfname, "r")))
+        return 0;
+    if (fread(&snapshot, sizeof(snapshot), 1, fp) == 1 &&
+        !memcmp(snapshot.magic, SNAPSHOT_MAGIC, sizeof(snapshot.magic)) &&
+        snapshot.size == (unsigned int)file_stat.st_size &&
+        snapshot.mtime == (unsigned int)file_stat.st_mtime &&
+        snapshot.bufsize == SCREEN_BUFFER_SIZE && snapshot.numpages > 0)
+        ok = 1;
+    (void)fclose(fp);
+    if (!ok)
+        snapshot.numpages = 0;
+    DPRINTF("%s: %s %s\n", __FUNCTION__, snapfname, ok ? "ok" : "not usable");
+    return ok;
+}
+
 int InitDoc(char *filename)
 {
     DPRINTF("%s(%s)\n", __FUNCTION__, filename);
@@ -451,8 +1116,9 @@ int InitDoc(char *filename)
            pid_t pid = fork();
            if (!pid) {
               int err;
+              char *argv[] = { filename, NULL }, *envp[] = { NULL };
               DPRINTF("%s -> exec(\"%s\")\n", __FUNCTION__, filename);
-              err = execve(filename, NULL, NULL);
+              err = execve(filename, argv, envp);
               if (err == -1)
                   DPRINTF("%s -> exec failed, errno = %d (%s)\n", __FUNCTION__, errno, strerror(errno));
               exit(0);
@@ -476,6 +1142,8 @@ int InitDoc(char *filename)
         DPRINTF("%s: ddjvu_document_create_by_filename() failed\n", __FUNCTION__);
         return 0;
     }
+    readahead_open(filename);
+    file_name = strdup(filename);
     base_file_name = basename(strdup(filename));
     dir_name = dirname(strdup(filename));
     djvu_format = ddjvu_format_create(DDJVU_FORMAT_GREY8, 0, NULL);
@@ -487,6 +1155,12 @@ int InitDoc(char *filename)
     ddjvu_format_set_y_direction(djvu_format, 1);
     ddjvu_format_set_ditherbits(djvu_format, 2);
     set_defaults();
+    shown_valid = panel_valid = 0;
+    tilecache_clear();
+    if (read_snapshot_header(filename)) {
+        numpages = snapshot.numpages; // DOCINFO arrives while the snapshot is on the screen
+        return 1;
+    }
     wait_for_ddjvu_message(djvu_context, DDJVU_DOCINFO);
     numpages = ddjvu_document_get_pagenum(djvu_document);
     return 1;
@@ -494,146 +1168,894 @@ int InitDoc(char *filename)
 
 #if PIXELS_PER_BYTE == 4
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 // for masking two bits in screenbuf to OR the data bits.
 static unsigned char notmask[4] = {0x3f, 0xcf, 0xf3, 0xfc};
 
+// reverses the order of the four 2-bit groups in a byte
+#define SWAP2(n) ((((n) & 0x03) << 6) | (((n) & 0x0c) << 2) | (((n) & 0x30) >> 2) | (((n) & 0xc0) >> 6))
+#define SWAP2_4(n)  SWAP2(n), SWAP2((n) + 1), SWAP2((n) + 2), SWAP2((n) + 3)
+#define SWAP2_16(n) SWAP2_4(n), SWAP2_4((n) + 4), SWAP2_4((n) + 8), SWAP2_4((n) + 12)
+#define SWAP2_64(n) SWAP2_16(n), SWAP2_16((n) + 16), SWAP2_16((n) + 32), SWAP2_16((n) + 48)
+static const unsigned char swap2[256] = { SWAP2_64(0), SWAP2_64(64), SWAP2_64(128), SWAP2_64(192) };
+
+// pack n (a multiple of 4) 8-bit pixels into n/4 bytes, leftmost pixel in the top bits
+static inline void pack_row(const unsigned char *s, unsigned char *d, int n)
+{
+    unsigned int t;
+#ifdef __SSE2__
+    const __m128i mask2 = _mm_set1_epi8(0x03);
+    const __m128i mask8 = _mm_set1_epi16(0x00ff);
+    const __m128i mask16 = _mm_set1_epi32(0x0000ffff);
+    __m128i v;
+
+    for (; n >= 16; n -= 16, s += 16, d += 4) {
+        v = _mm_and_si128(_mm_srli_epi16(_mm_loadu_si128((const __m128i *)s), 6), mask2);
+        // pixel pairs: 4 bits in each 16-bit lane, then pixel quads: 8 bits in each 32-bit lane
+        v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, mask8), 2), _mm_srli_epi16(v, 8));
+        v = _mm_or_si128(_mm_slli_epi32(_mm_and_si128(v, mask16), 4), _mm_srli_epi32(v, 16));
+        v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+        t = (unsigned int)_mm_cvtsi128_si32(v);
+        d[0] = t; d[1] = t >> 8; d[2] = t >> 16; d[3] = t >> 24;
+    }
+#endif
+    // four pixels at a time: keep the top two bits of each byte, fold them
+    // into one byte (first pixel lowest) and reverse the order with swap2[]
+    for (; n >= 4; n -= 4, s += 4) {
+        t = s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24);
+        t = (t >> 6) & 0x03030303;
+        t |= t >> 6;
+        *d++ = swap2[(t & 0x0f) | ((t >> 12) & 0xf0)];
+    }
+}
+
 // mapping a greyscale 8-bit pixel "b8b7b6b5b4b3b2b1" to the 2-bit "b8b7"
-// and then packing these two bits for each pixel into screenbuf,
-// starting from the top.
-static inline void grey8to2(void)
+// and then packing these two bits for each pixel into screenbuf.
+// src is a w x h block (rowsize bytes per row) which goes to pixel x0
+// of the rows of dst.
+static inline void grey8to2(const unsigned char *src, int rowsize, unsigned char *dst, int x0, int w, int h)
+{
+    int x, n, y;
+    const unsigned char *s;
+
+    for (y = 0; y < h; y++, src += rowsize, dst += SCREEN_STRIDE) {
+        // single pixels up to a byte boundary, whole bytes, then single pixels again
+        for (s = src, x = x0, n = w; n > 0 && (x & 3); n--, x++, s++) {
+            dst[x>>2] &= notmask[x&3];
+            dst[x>>2] |= (*s >> 6) << ((3 - (x&3))<<1);
+        }
+        pack_row(s, dst + (x>>2), n & ~3);
+        for (s += n & ~3, x += n & ~3, n &= 3; n > 0; n--, x++, s++) {
+            dst[x>>2] &= notmask[x&3];
+            dst[x>>2] |= (*s >> 6) << ((3 - (x&3))<<1);
+        }
+    }
+}
+
+#if DEBUG
+// the original one pixel at a time version, used to check grey8to2()
+static void grey8to2_ref(const unsigned char *src, int rowsize, unsigned char *dst, int x0, int w, int h)
 {
     int x, y;
     unsigned char tmp;
-    unsigned char *dst = screenbuf;
-
-    for (y = 0; y < rrect.h; y++) {
-        unsigned char *d = dst;
-        int dx = 0;
-        int step_y = y * SCREEN_WIDTH;
-        for (x=0; x < rrect.w; x++) {
-            tmp = imagebuf[x + step_y] >> 6;
+
+    for (y = 0; y < h; y++) {
+        unsigned char *d = dst + (x0>>2);
+        int dx = x0;
+        int step_y = y * rowsize;
+        for (x=0; x < w; x++) {
+            tmp = src[x + step_y] >> 6;
             *d &= notmask[dx&3];
-            if (!show_wmark || ((landscape ? x : y) != old_window_pos))
-                *d |= tmp << ((3 - (dx&3))<<1);
+            *d |= tmp << ((3 - (dx&3))<<1);
             if ((++dx & 3) == 0) d++;
         }
-        dst += (SCREEN_WIDTH + 3)/4;
+        dst += SCREEN_STRIDE;
     }
 }
 #endif
 
+// draw the window mark (a black line) over a packed frame
+static inline void show_window_mark(unsigned char *dst, const struct frame_key *k)
+{
+    int x, y, pos = k->wmark_pos;
+
+    if (k->landscape) {
+        if (pos < 0 || pos >= k->rrect.w)
+            return;
+        for (y = 0, dst += pos>>2; y < k->rrect.h; y++, dst += SCREEN_STRIDE)
+            *dst &= notmask[pos&3];
+    } else {
+        if (pos < 0 || pos >= k->rrect.h)
+            return;
+        dst += pos*SCREEN_STRIDE;
+        memset(dst, 0, k->rrect.w >> 2);
+        for (x = k->rrect.w & ~3; x < k->rrect.w; x++)
+            dst[x>>2] &= notmask[x&3];
+    }
+}
+
+// pack one band, checking the result against grey8to2_ref() in DEBUG builds
+static inline void pack_band(const unsigned char *src, int rowsize, unsigned char *dst, int x0, int w, int h)
+{
+#if DEBUG
+    unsigned char check[BAND_HEIGHT*SCREEN_STRIDE]; // not static, bands are packed on several threads
+    memcpy(check, dst, h*SCREEN_STRIDE);
+    grey8to2_ref(src, rowsize, check, x0, w, h);
+#endif
+    BENCH_START(t);
+    grey8to2(src, rowsize, dst, x0, w, h);
+    BENCH_STOP(t, BENCH_PACK);
+#if DEBUG
+    if (memcmp(check, dst, h*SCREEN_STRIDE))
+        DPRINTF("%s: grey8to2() output differs from grey8to2_ref()\n", __FUNCTION__);
+#endif
+}
+
+/*
+   Move the pixels of a packed row of w pixels dx pixels to the left (or
+   right if dx < 0). The pixels shifted in at the other end are garbage.
+ */
+static inline void shift_packed_row(unsigned char *row, int w, int dx)
+{
+    int i, nbytes = (w + 3) >> 2, q = abs(dx) >> 2, r = (abs(dx) & 3) << 1;
+    unsigned char tail = 0xff >> ((w & 3) << 1);
+
+    if (dx > 0) {
+        for (i = 0; i + q < nbytes; i++)
+            row[i] = (row[i + q] << r) | (r && i + q + 1 < nbytes ? row[i + q + 1] >> (8 - r) : 0);
+    } else {
+        for (i = nbytes - 1; i - q >= 0; i--)
+            row[i] = (row[i - q] >> r) | (r && i - q - 1 >= 0 ? row[i - q - 1] << (8 - r) : 0);
+    }
+    // pixels past w in the last byte are background, not page
+    if (w & 3)
+        row[w>>2] = (row[w>>2] & ~tail) | (PAGE_BACKGROUND & tail);
+}
+#endif
+
 #if PIXELS_PER_BYTE == 1
-static inline void show_window_mark(void)
+static inline void show_window_mark(unsigned char *dst, const struct frame_key *k)
 {
-    int x, y;
-    unsigned char *dst = screenbuf;
+    int y;
 
-    for (y = 0; y < rrect.h; y++) {
-        unsigned char *d = dst;
-        for (x=0; x < rrect.w; x++) {
-            if ((landscape ? x : y) == old_window_pos) *d = 0;
-            d++;
-        }
-        dst += SCREEN_WIDTH;
+    if (k->landscape) {
+        if (k->wmark_pos < 0 || k->wmark_pos >= k->rrect.w)
+            return;
+        for (y = 0, dst += k->wmark_pos; y < k->rrect.h; y++, dst += SCREEN_WIDTH)
+            *dst = 0;
+    } else {
+        if (k->wmark_pos < 0 || k->wmark_pos >= k->rrect.h)
+            return;
+        memset(dst + k->wmark_pos*SCREEN_WIDTH, 0, k->rrect.w);
     }
+}
+#endif
+
+static inline void make_frame_key(struct frame_key *k)
+{
+    memset(k, 0, sizeof(*k));
+    k->page = page_number;
+    k->prect = page_rect;
+    k->rrect = rrect;
+    k->mode = djvu_render_mode;
+    k->landscape = landscape;
+    k->wmark_pos = show_wmark ? old_window_pos : -1;
+}
+
+// render the part rect of the page into buf (rowsize bytes per row)
+static inline int render_part(ddjvu_page_t *page, const struct frame_key *k, const ddjvu_rect_t *rect, unsigned char *buf, int rowsize)
+{
+    int ok;
+    BENCH_START(t);
+
+    // a preview is not what the page looks like, don't let the tile cache keep it
+    if (tilecache_size_kb > 0 && tilecache_budget_kb > 0 && !k->preview)
+        ok = tilecache_render(page, k->page, k->mode, k->landscape, &k->prect, rect, buf, rowsize);
+    else
+        ok = ddjvu_page_render(page, k->mode, &k->prect, rect, djvu_format, rowsize, (char *)buf);
+    BENCH_STOP(t, BENCH_RENDER);
+    return ok;
+}
+
+/* a rectangle of a frame being rendered in strips, see render_rect() */
+struct render_job {
+    ddjvu_page_t *page;
+    const struct frame_key *k;
+    const ddjvu_rect_t *rect;
+    unsigned char *sbuf, *band;
+    int y0, rows; /* strip i starts at row y0 + i*rows, or rect->y for the first one */
+    unsigned long long packed[BANDPOOL_MAX_THREADS]; /* trace_now() time spent packing, by thread */
+};
+
+// render the rows y to y + h - 1 of j->rect into their place in the frame (band is scratch space on V3)
+static int render_rows(struct render_job *j, int y, int h, unsigned char *band, unsigned long long *packed)
+{
+    const struct frame_key *k = j->k;
+    ddjvu_rect_t r = *j->rect;
+#if PIXELS_PER_BYTE == 4
+    unsigned long long t;
+    int end = y + h;
+
+    for (; y < end; y += BAND_HEIGHT) {
+        r.y = y;
+        r.h = min(BAND_HEIGHT, end - y);
+        if (!render_part(j->page, k, &r, band, r.w))
+            return 0;
+        t = trace_now();
+        pack_band(band, r.w, j->sbuf + (r.y - k->rrect.y)*SCREEN_STRIDE, r.x - k->rrect.x, r.w, r.h);
+        *packed += trace_now() - t;
+    }
+    return 1;
+#endif
+#if PIXELS_PER_BYTE == 1
+    r.y = y;
+    r.h = h;
+    return render_part(j->page, k, &r, j->sbuf + (y - k->rrect.y)*SCREEN_STRIDE + (r.x - k->rrect.x), SCREEN_STRIDE);
+#endif
+}
+
+// strip i of j, on the thread slot of the band pool
+static int render_strip(void *arg, int i, int slot)
+{
+    struct render_job *j = arg;
+    int y = max(j->rect->y, j->y0 + i*j->rows);
+    int end = min(j->rect->y + (int)j->rect->h, j->y0 + (i + 1)*j->rows);
+
+#if PIXELS_PER_BYTE == 4
+    return render_rows(j, y, end - y, slot ? pool_bandbufs[slot - 1] : j->band, &j->packed[slot]);
+#endif
+#if PIXELS_PER_BYTE == 1
+    return render_rows(j, y, end - y, NULL, &j->packed[slot]);
+#endif
+}
 
+// render the part rect (within k->rrect) of the page into its place in the frame sbuf
+static int render_rect(ddjvu_page_t *page, const struct frame_key *k, const ddjvu_rect_t *rect, unsigned char *sbuf, unsigned char *band)
+{
+    struct render_job j;
+    int i, ok, align, n = 1, threads = bandpool_threads();
+    unsigned long long packed = 0;
+    TRACE_BEGIN(start);
+
+    memset(&j, 0, sizeof(j));
+    j.page = page;
+    j.k = k;
+    j.rect = rect;
+    j.sbuf = sbuf;
+    j.band = band;
+    if (threads > 1 && (int)rect->h >= 2*RENDER_STRIP_ROWS) {
+        // strips along tile rows don't render the same tile twice, along bands have no short band
+        if (tilecache_size_kb > 0 && tilecache_budget_kb > 0 && !k->preview)
+            align = TILE_SIZE;
+        else
+#if PIXELS_PER_BYTE == 4
+            align = BAND_HEIGHT;
+#else
+            align = 1;
+#endif
+        j.rows = max(RENDER_STRIP_ROWS, (int)rect->h/(2*threads));
+        j.rows = max(align, j.rows/align*align);
+        j.y0 = rect->y - (rect->y % align + align) % align;
+        n = (rect->y + (int)rect->h - j.y0 + j.rows - 1)/j.rows;
+        ok = bandpool_run(n, render_strip, &j);
+    } else
+        ok = render_rows(&j, rect->y, rect->h, band, &j.packed[0]);
+    for (i = 0; i < BANDPOOL_MAX_THREADS; i++)
+        packed += j.packed[i];
+#if PIXELS_PER_BYTE == 4
+    // one event for all the bands of each, they would fill the trace ring;
+    // on several threads the packing overlaps the rendering and stays in it
+    trace_add(TRACE_RENDER, start, trace_now() - start - (n > 1 ? 0 : packed), k->page);
+    trace_add(TRACE_PACK, start, packed, k->page);
+#endif
+#if PIXELS_PER_BYTE == 1
+    TRACE_END(start, TRACE_RENDER, k->page);
+#endif
+    return ok;
 }
+
+// put a w x h block of 8-bit pixels (rowsize bytes per row) at x, y of frame, for reflow.c
+void reflow_blit(const unsigned char *src, int rowsize, unsigned char *frame, int x, int y, int w, int h)
+{
+#if PIXELS_PER_BYTE == 4
+    grey8to2(src, rowsize, frame + y*SCREEN_STRIDE, x, w, h);
 #endif
+#if PIXELS_PER_BYTE == 1
+    for (frame += y*SCREEN_STRIDE + x; h > 0; h--, src += rowsize, frame += SCREEN_STRIDE)
+        memcpy(frame, src, w);
+#endif
+}
 
-#if 0
-int signal_level = 255;
+// the part of the screen not covered by the page must not show whatever was in this buffer before
+static inline void clear_outside_rrect(unsigned char *sbuf, const struct frame_key *k)
+{
+    int y, x = k->rrect.w/PIXELS_PER_BYTE; // on V3 the partly covered byte is done by grey8to2()
 
-static inline int do_trim_margins(void)
+    if (x < SCREEN_STRIDE)
+        for (y = 0; y < k->rrect.h; y++)
+            memset(sbuf + y*SCREEN_STRIDE + x, PAGE_BACKGROUND, SCREEN_STRIDE - x);
+    // whole rows to the end of the buffer (V3 has a few spare ones)
+    memset(sbuf + k->rrect.h*SCREEN_STRIDE, PAGE_BACKGROUND, (SCREEN_BUFFER_SIZE/SCREEN_STRIDE - k->rrect.h)*SCREEN_STRIDE);
+}
+
+// render the frame described by k into sbuf (band is scratch space on V3)
+static int render_frame(ddjvu_page_t *page, const struct frame_key *k, unsigned char *sbuf, unsigned char *band)
 {
-    DPRINTF("%s\n", __FUNCTION__);
-    int x, y, x1, x2, y1, y2, xstart, xend, ystart, yend, width, height;
-    unsigned int sum;
-
-    xstart = 0;
-    xend = rrect.w/4;
-    ystart = 0;
-    yend = rrect.h;
-    height = rrect.h;
-    DPRINTF("%s: testing the X range: %d -> %d\n", __FUNCTION__, xstart, xend);
-    for (x = xstart; x < xend; x++) {
-        for (sum = 0, y = ystart; y < yend; y++)
-            sum += imagebuf[x + y*SCREEN_WIDTH];
-        if (sum / height < signal_level) break;
-    }
-    x1 = max(x, xstart);
-
-    xstart = rrect.w;
-    xend = 3*rrect.w/4;
-    DPRINTF("%s: testing the X range: %d <- %d\n", __FUNCTION__, xstart, xend);
-    for (x = xstart; x > xend; x--) {
-        for (sum = 0, y = ystart; y < yend; y++)
-            sum += imagebuf[x + y*SCREEN_WIDTH];
-        if (sum / height < signal_level) break;
-    }
-    x2 = min(x, xstart);
-
-    xstart = 0;
-    xend = rrect.w;
-    ystart = 0;
-    yend = rrect.h/4;
-    width = rrect.w;
-    DPRINTF("%s: testing the Y range: %d -> %d\n", __FUNCTION__, ystart, yend);
-    for (y = ystart; y < yend; y++) {
-        for (sum = 0, x = xstart; x < xend; x++)
-            sum += imagebuf[x + y*SCREEN_WIDTH];
-        if (sum / width < signal_level) break;
-    }
-    y1 = max(y, ystart);
- 
-    ystart = rrect.h;
-    yend = 3*rrect.h/4;
-    DPRINTF("%s: testing the Y range: %d <- %d\n", __FUNCTION__, ystart, yend);
-    for (y = ystart; y > yend; y--) {
-        for (sum = 0, x = xstart; x < xend; x++)
-            sum += imagebuf[x + y*SCREEN_WIDTH];
-        if (sum / width < signal_level) break;
-    }
-    y2 = min(y, ystart);
-
-    DPRINTF("%s: x1=%d y1=%d x2=%d y2=%d\n", __FUNCTION__, x1, y1, x2, y2);
-    zoom_factor = (float)SCREEN_WIDTH / (float)(x2 - x1);
-    rrect.x = x1;
-    rrect.y = y1;
-    set_page_and_render_rects();
+    int ok;
+
+    ddjvu_page_set_rotation(page, k->landscape ? DDJVU_ROTATE_270 : DDJVU_ROTATE_0);
+    clear_outside_rrect(sbuf, k);
+    ok = render_rect(page, k, &k->rrect, sbuf, band);
+    if (k->wmark_pos >= 0) {
+        TRACE_BEGIN(start);
+        show_window_mark(sbuf, k);
+        TRACE_END(start, TRACE_WMARK, k->page);
+    }
+    return ok;
+}
+
+/*
+   If the frame k differs from the one in the front buffer only by a shift
+   along one axis by less than its size (which is what move_window_*() do
+   with steps under 100%), move the pixels that stay on screen and render
+   only the newly exposed strip. Returns 1 on success, 0 if k has to be
+   rendered from scratch.
+ */
+static int scroll_frame(ddjvu_page_t *page, const struct frame_key *k, unsigned char *band)
+{
+    const struct frame_key *o = &shown_key;
+    int dx = k->rrect.x - o->rrect.x, dy = k->rrect.y - o->rrect.y;
+    int y, w = k->rrect.w, h = k->rrect.h, mark;
+    ddjvu_rect_t strip = k->rrect;
+    unsigned char *buf = screenbuf;
+
+    if (!shown_valid || o->preview || o->page != k->page || o->mode != k->mode || o->landscape != k->landscape ||
+        memcmp(&o->prect, &k->prect, sizeof(k->prect)) || o->rrect.w != w || o->rrect.h != h ||
+        (dx && dy) || abs(dx) >= w || abs(dy) >= h)
+        return 0;
+
+    ddjvu_page_set_rotation(page, k->landscape ? DDJVU_ROTATE_270 : DDJVU_ROTATE_0);
+    if (dy > 0) {
+        memmove(buf, buf + dy*SCREEN_STRIDE, (h - dy)*SCREEN_STRIDE);
+        strip.y += h - dy;
+        strip.h = dy;
+    } else if (dy < 0) {
+        memmove(buf - dy*SCREEN_STRIDE, buf, (h + dy)*SCREEN_STRIDE);
+        strip.h = -dy;
+    } else if (dx) {
+        for (y = 0; y < h; y++)
+#if PIXELS_PER_BYTE == 4
+            shift_packed_row(buf + y*SCREEN_STRIDE, w, dx);
+#endif
+#if PIXELS_PER_BYTE == 1
+            if (dx > 0)
+                memmove(buf + y*SCREEN_STRIDE, buf + y*SCREEN_STRIDE + dx, w - dx);
+            else
+                memmove(buf + y*SCREEN_STRIDE - dx, buf + y*SCREEN_STRIDE, w + dx);
+#endif
+        if (dx > 0)
+            strip.x += w - dx;
+        strip.w = abs(dx);
+    }
+    if ((dx || dy) && !render_rect(page, k, &strip, buf, band))
+        return 0;
+
+    // the old window mark has moved along with the pixels, render that line again
+    mark = o->wmark_pos;
+    if (mark >= 0) {
+        strip = k->rrect;
+        if (k->landscape) {
+            mark -= dx;
+            strip.x += mark;
+            strip.w = 1;
+        } else {
+            mark -= dy;
+            strip.y += mark;
+            strip.h = 1;
+        }
+        if (mark >= 0 && mark < (k->landscape ? w : h))
+            render_rect(page, k, &strip, buf, band);
+    }
+    show_window_mark(buf, k);
+    DPRINTF("%s: scrolled by %d,%d\n", __FUNCTION__, dx, dy);
     return 1;
 }
+
+static void *prerender_thread(void *arg)
+{
+    struct frame_key key;
+    ddjvu_page_t *page;
+    int ok;
+
+    pthread_mutex_lock(&prerender.lock);
+    while (!prerender.quit) {
+        if (!prerender.busy) {
+            pthread_cond_wait(&prerender.cond, &prerender.lock);
+            continue;
+        }
+        key = prerender.key;
+        page = prerender.page;
+        pthread_mutex_unlock(&prerender.lock);
+#if PIXELS_PER_BYTE == 4
+        ok = render_frame(page, &key, back_screenbuf, back_bandbuf);
+#else
+        ok = render_frame(page, &key, back_screenbuf, NULL);
 #endif
+        DPRINTF("%s: page %d at %d,%d -> %d\n", __FUNCTION__, key.page, key.rrect.x, key.rrect.y, ok);
+        pthread_mutex_lock(&prerender.lock);
+        prerender.busy = 0;
+        prerender.ready = ok;
+        pthread_cond_broadcast(&prerender.cond);
+    }
+    pthread_mutex_unlock(&prerender.lock);
+    return NULL;
+}
 
-// render a portion of DjVu page if necessary
-void GetPageData(void **data)
+// wait until the pre-render thread is done with the current job (if any)
+static void prerender_wait(void)
 {
-    *data = screenbuf;
-    if (buffer_valid) {
-        DPRINTF("%s: satisfied from the cache\n", __FUNCTION__);
+    pthread_mutex_lock(&prerender.lock);
+    while (prerender.busy)
+        pthread_cond_wait(&prerender.cond, &prerender.lock);
+    pthread_mutex_unlock(&prerender.lock);
+}
+
+// returns 1 if the back buffer holds the frame k and it has been swapped in
+static int prerender_take(const struct frame_key *k)
+{
+    unsigned char *tmp;
+    int hit = 0;
+
+    pthread_mutex_lock(&prerender.lock);
+    while (prerender.busy)
+        pthread_cond_wait(&prerender.cond, &prerender.lock);
+    if (prerender.ready) {
+        if (!memcmp(&prerender.key, k, sizeof(*k))) {
+            tmp = screenbuf; screenbuf = back_screenbuf; back_screenbuf = tmp;
+            prerender.hits++;
+            hit = 1;
+        } else
+            prerender.misses++;
+        prerender.ready = 0;
+    }
+    pthread_mutex_unlock(&prerender.lock);
+    return hit;
+}
+
+static inline void prerender_stop(void)
+{
+    if (!prerender.running)
         return;
+    pthread_mutex_lock(&prerender.lock);
+    prerender.quit = 1;
+    pthread_cond_broadcast(&prerender.cond);
+    pthread_mutex_unlock(&prerender.lock);
+    pthread_join(prerender.thread, NULL);
+    prerender.running = prerender.quit = prerender.busy = prerender.ready = 0;
+}
+
+/* the navigation state which Next()/Prev() may change */
+struct view_state {
+    int page_number, page_width, page_height, old_window_pos;
+    int next_page_top, next_page_bottom, buffer_valid, multicol;
+    float page_aspect;
+    ddjvu_page_type_t page_type;
+    ddjvu_render_mode_t djvu_render_mode;
+    struct cropbox crop_box;
+    ddjvu_rect_t prect, rrect, page_rect;
+};
+
+static inline void save_view_state(struct view_state *s)
+{
+    s->page_number = page_number;
+    s->page_width = page_width;
+    s->page_height = page_height;
+    s->old_window_pos = old_window_pos;
+    s->next_page_top = next_page_top;
+    s->next_page_bottom = next_page_bottom;
+    s->buffer_valid = buffer_valid;
+    s->multicol = multicol;
+    s->page_aspect = page_aspect;
+    s->page_type = page_type;
+    s->djvu_render_mode = djvu_render_mode;
+    s->crop_box = crop_box;
+    s->prect = prect;
+    s->rrect = rrect;
+    s->page_rect = page_rect;
+}
+
+static inline void restore_view_state(const struct view_state *s)
+{
+    page_number = s->page_number;
+    page_width = s->page_width;
+    page_height = s->page_height;
+    old_window_pos = s->old_window_pos;
+    next_page_top = s->next_page_top;
+    next_page_bottom = s->next_page_bottom;
+    buffer_valid = s->buffer_valid;
+    multicol = s->multicol;
+    page_aspect = s->page_aspect;
+    page_type = s->page_type;
+    djvu_render_mode = s->djvu_render_mode;
+    crop_box = s->crop_box;
+    prect = s->prect;
+    rrect = s->rrect;
+    page_rect = s->page_rect;
+}
+
+/*
+   Work out which frame the next Next() (or Prev(), if that is where the
+   reader is heading) will ask for, by running it with "predicting" set and
+   then undoing all its effects. Returns the page handle to render from,
+   or NULL if the frame can't be rendered yet (e.g. next page not decoded).
+ */
+static ddjvu_page_t *predict_next_frame(struct frame_key *k)
+{
+    struct view_state s;
+    int ok;
+
+    save_view_state(&s);
+    predicting = 1;
+    predicted_page = djvu_page;
+    ok = (last_direction < 0) ? Prev() : Next();
+    predicting = 0;
+    if (ok && predicted_page)
+        make_frame_key(k);
+    else
+        predicted_page = NULL;
+    restore_view_state(&s);
+    return predicted_page;
+}
+
+// start rendering the frame we expect to be asked for next
+static void prerender_schedule(void)
+{
+    struct frame_key key;
+    ddjvu_page_t *page = predict_next_frame(&key);
+
+    if (!page || flipbook_frame(&key, NULL))
+        return;
+    pthread_mutex_lock(&prerender.lock);
+    if (!prerender.running) {
+        if (pthread_create(&prerender.thread, NULL, prerender_thread, NULL)) {
+            DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+            pthread_mutex_unlock(&prerender.lock);
+            return;
+        }
+        prerender.running = 1;
     }
-    ddjvu_page_set_rotation(djvu_page, landscape ? DDJVU_ROTATE_270 : DDJVU_ROTATE_0);
-    gettimeofday(&tvstart, NULL);
+    prerender.key = key;
+    prerender.page = page;
+    prerender.ready = 0;
+    prerender.busy = 1;
+    pthread_cond_broadcast(&prerender.cond);
+    pthread_mutex_unlock(&prerender.lock);
+}
+
+static inline void add_dirty_rect(int y0, int y1, unsigned int cols)
+{
+    int c0 = 0, c1 = DIRTY_COLS - 1;
+
+    while (!(cols & (1 << c0))) c0++;
+    while (!(cols & (1 << c1))) c1--;
+    if (ndirty_rects == DIRTY_MAX_RECTS) {
+        // too many, grow the last one to cover the rest
+        int i = ndirty_rects - 1;
+        c0 = min(c0, dirty_rects[i].x/DIRTY_COL_WIDTH);
+        c1 = max(c1, (dirty_rects[i].x + dirty_rects[i].w)/DIRTY_COL_WIDTH - 1);
+        y0 = dirty_rects[i].y;
+        dirty_area -= dirty_rects[i].w*dirty_rects[i].h;
+        ndirty_rects--;
+    }
+    dirty_rects[ndirty_rects].x = c0*DIRTY_COL_WIDTH;
+    dirty_rects[ndirty_rects].y = y0;
+    dirty_rects[ndirty_rects].w = (c1 - c0 + 1)*DIRTY_COL_WIDTH;
+    dirty_rects[ndirty_rects].h = y1 - y0;
+    dirty_area += dirty_rects[ndirty_rects].w*dirty_rects[ndirty_rects].h;
+    ndirty_rects++;
+}
+
+/*
+   Compare screenbuf with the frame on the panel and collect the changed
+   parts into dirty_rects[], one rectangle per run of changed rows.
+ */
+static void find_dirty_rects(void)
+{
+    const int n = DIRTY_COL_WIDTH/PIXELS_PER_BYTE;
+    int y, c, y0 = -1;
+    unsigned int cols, run_cols = 0;
+    const unsigned char *p;
+    unsigned char *q;
+
+    ndirty_rects = dirty_area = 0;
+    for (y = 0; y < SCREEN_HEIGHT; y++) {
+        p = screenbuf + y*SCREEN_STRIDE;
+        q = panel_frame + y*SCREEN_STRIDE;
+        cols = 0;
+        for (c = 0; c < DIRTY_COLS; c++, p += n, q += n)
+            if (memcmp(p, q, n)) {
+                memcpy(q, p, n);
+                cols |= 1 << c;
+            }
+        if (cols) {
+            if (y0 < 0) y0 = y;
+            run_cols |= cols;
+        } else if (y0 >= 0) {
+            add_dirty_rect(y0, y, run_cols);
+            y0 = -1;
+            run_cols = 0;
+        }
+    }
+    if (y0 >= 0)
+        add_dirty_rect(y0, SCREEN_HEIGHT, run_cols);
+    if (!panel_valid) {
+        ndirty_rects = 1;
+        dirty_rects[0].x = dirty_rects[0].y = 0;
+        dirty_rects[0].w = SCREEN_WIDTH;
+        dirty_rects[0].h = SCREEN_HEIGHT;
+        dirty_area = SCREEN_WIDTH*SCREEN_HEIGHT;
+        panel_valid = 1;
+    }
+}
 
+static void blit_dirty_rects(void)
+{
+    int i;
+
+    for (i = 0; i < ndirty_rects; i++)
+        v3_callbacks->BlitBitmap(dirty_rects[i].x, dirty_rects[i].y, dirty_rects[i].w, dirty_rects[i].h,
+                                 dirty_rects[i].x, dirty_rects[i].y, SCREEN_WIDTH, SCREEN_HEIGHT, screenbuf);
+}
+
+/*
+   Show the pending page as far as it has been decoded: the text layer
+   alone once the JB2 mask is there, or the first IW44 slices of a photo.
+   nav_thread() replaces it with the real thing when decoding is done.
+ */
+static void nav_preview(ddjvu_page_t *page)
+{
+    static const ddjvu_render_mode_t modes[] = {DDJVU_RENDER_MASKONLY, DDJVU_RENDER_COLOR};
+    ddjvu_rect_t pixel = {0, 0, 1, 1};
+    struct frame_key key;
+    unsigned char tmp[4];
+    int i;
+
+    nav.tried_chunks = nav.chunks;
+    if (ddjvu_page_get_width(page) <= 0) // no page info yet
+        return;
+    set_page_info(page, nav.target);
+    make_frame_key(&key);
+    key.preview = 1;
+    ddjvu_page_set_rotation(page, key.landscape ? DDJVU_ROTATE_270 : DDJVU_ROTATE_0);
+    // see what can be rendered yet on a single pixel, so that screenbuf isn't spoilt for nothing
+    pixel.x = key.rrect.x;
+    pixel.y = key.rrect.y;
+    for (i = 0; i < sizeof(modes)/sizeof(modes[0]); i++)
+        if (ddjvu_page_render(page, modes[i], &key.prect, &pixel, djvu_format, sizeof(tmp), (char *)tmp))
+            break;
+    if (i == sizeof(modes)/sizeof(modes[0]))
+        return;
+    key.mode = modes[i];
 #if PIXELS_PER_BYTE == 4
-    ddjvu_page_render(djvu_page, djvu_render_mode, &prect, &rrect, djvu_format, SCREEN_WIDTH, (char *)imagebuf);
-    memset(screenbuf, PAGE_BACKGROUND, SCREEN_BUFFER_SIZE);
+    if (!render_frame(page, &key, screenbuf, bandbuf))
 #endif
 #if PIXELS_PER_BYTE == 1
-    ddjvu_page_render(djvu_page, djvu_render_mode, &prect, &rrect, djvu_format, SCREEN_WIDTH, (char *)screenbuf);
+    if (!render_frame(page, &key, screenbuf, NULL))
 #endif
+        return;
+    shown_key = key;
+    shown_valid = 1;
+    find_dirty_rects();
+    nav.preview_shown = 1;
+    DPRINTF("%s: page %d in mode %d\n", __FUNCTION__, key.page, key.mode);
+    if (nav.can_draw) {
+        v3_callbacks->BlitBitmap(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, screenbuf);
+        v3_callbacks->Print();
+        partial_refreshes = 0;
+    }
+}
+
+/*
+   Called after a key has changed the window. Render the new frame and, if
+   only a small part of the screen changed, update just that part of the
+   panel. Returns what OnKeyPressed() should: 2 if the screen is up to date,
+   1 if the viewer has to do a full refresh.
+ */
+static int refresh_screen(void)
+{
+    void *data;
+
+    if (nav.pending)
+        return 2; // nav_thread() will show the page
+    if (buffer_valid || !partial_refresh_percent)
+        return 1;
+    refreshing = 1;
+    GetPageData(&data);
+    refreshing = 0;
+    DPRINTF("%s: %d rects, %d%% of the screen changed\n", __FUNCTION__, ndirty_rects, dirty_area/(SCREEN_WIDTH*SCREEN_HEIGHT/100));
+    if (!ndirty_rects)
+        return 2;
+    if (dirty_area > SCREEN_WIDTH*SCREEN_HEIGHT/100*partial_refresh_percent || partial_refreshes >= full_refresh_every) {
+        partial_refreshes = 0;
+        return 1;
+    }
+    blit_dirty_rects();
+    v3_callbacks->PartialPrint();
+    partial_refreshes++;
+    return 2;
+}
+
+/*
+   In reflow mode put screen reflow_screen of the reflowed page into sbuf,
+   waiting for reflow.c if it isn't done yet. Returns 0 if the page has no
+   text layer, it is then shown as it is.
+ */
+static int reflow_frame(unsigned char *sbuf)
+{
+    reflow_screens = 0;
+    if (!reflow || landscape)
+        return 0;
+    reflow_want(page_number, last_direction, (int)(100*zoom_factor + 0.5));
+    reflow_screens = reflow_get(page_number, &reflow_screen, sbuf);
+    return reflow_screens > 0;
+}
+
+static inline void invert_rect(unsigned char *sbuf, int x0, int y0, int x1, int y1)
+{
+    int x, y;
+
+    for (y = y0; y < y1; y++)
+        for (x = x0; x < x1; x++)
+#if PIXELS_PER_BYTE == 4
+            sbuf[y*SCREEN_STRIDE + (x>>2)] ^= 3 << ((3 - (x&3))<<1);
+#endif
+#if PIXELS_PER_BYTE == 1
+            sbuf[y*SCREEN_STRIDE + x] ^= 0xFF;
+#endif
+}
+
+/*
+   Invert the words found by the last search on the frame of k in sbuf.
+   Returns 1 if there were any on it.
+ */
+static int show_search_matches(unsigned char *sbuf, const struct frame_key *k)
+{
+    const ddjvu_rect_t *pr = &k->prect;
+    int i, n = 0, x0, y0, x1, y1, *b;
+
+    if (!search_term[0] || k->preview || page_width <= 0 || page_height <= 0)
+        return 0;
+    if (search_boxes_page != k->page) {
+        // the text may not be there yet, try again with the next frame
+        if ((search_nboxes = search_boxes(k->page, search_term, search_boxes_of_page, SEARCH_MAX_BOXES)) < 0) {
+            search_nboxes = 0;
+            return 0;
+        }
+        search_boxes_page = k->page;
+    }
+    for (i = 0; i < search_nboxes; i++) {
+        b = search_boxes_of_page[i];
+        // from the bottom left of the page to the frame, rotated like render_frame() does it
+        if (k->landscape) {
+            x0 = pr->x + b[1]*pr->w/page_height;
+            x1 = pr->x + b[3]*pr->w/page_height;
+            y0 = pr->y + b[0]*pr->h/page_width;
+            y1 = pr->y + b[2]*pr->h/page_width;
+        } else {
+            x0 = pr->x + b[0]*pr->w/page_width;
+            x1 = pr->x + b[2]*pr->w/page_width;
+            y0 = pr->y + (page_height - b[3])*pr->h/page_height;
+            y1 = pr->y + (page_height - b[1])*pr->h/page_height;
+        }
+        x0 = max(x0 - k->rrect.x - 1, 0);
+        y0 = max(y0 - k->rrect.y - 1, 0);
+        x1 = min(x1 - k->rrect.x + 1, (int)k->rrect.w);
+        y1 = min(y1 - k->rrect.y + 1, (int)k->rrect.h);
+        if (x0 < x1 && y0 < y1) {
+            invert_rect(sbuf, x0, y0, x1, y1);
+            n++;
+        }
+    }
+    return n > 0;
+}
+
+static void get_page_data(void **data)
+{
+    struct frame_key key;
+
+    // the viewer does a full refresh with whatever we give it here
+    if (!refreshing)
+        partial_refreshes = 0;
+    if (resuming) {
+        // the snapshot is going on the screen, nav_thread() can put the live frame over it
+        resuming = 0;
+        nav.can_draw = 1;
+    }
+    if (buffer_valid || nav.pending) {
+        DPRINTF("%s: satisfied from the cache\n", __FUNCTION__);
+        *data = screenbuf;
+        return;
+    }
+    make_frame_key(&key);
+    TRACE_BEGIN(start);
+    if (reflow_frame(screenbuf)) {
+        DPRINTF("%s: screen %d of %d of the reflowed page\n", __FUNCTION__, reflow_screen + 1, reflow_screens);
+    } else if (flipbook_frame(&key, screenbuf)) {
+        DPRINTF("%s: satisfied from the flipbook\n", __FUNCTION__);
+    } else if (prerender_take(&key)) {
+        DPRINTF("%s: satisfied from the pre-rendered buffer\n", __FUNCTION__);
+    } else if (need_page()) {
+#if PIXELS_PER_BYTE == 4
+        if (!scroll_frame(djvu_page, &key, bandbuf))
+            render_frame(djvu_page, &key, screenbuf, bandbuf);
+#endif
+#if PIXELS_PER_BYTE == 1
+        if (!scroll_frame(djvu_page, &key, NULL))
+            render_frame(djvu_page, &key, screenbuf, NULL);
+#endif
+        while (ddjvu_message_peek(djvu_context)) ddjvu_message_pop(djvu_context);
+    }
+    if (flipbook_recording && !reflow_screens)
+        flipbook_add(&key, sizeof(key), screenbuf, SCREEN_BUFFER_SIZE);
+    shown_key = key;
+    shown_valid = !reflow_screens; // not the page in that window, nothing to scroll from or keep
+    if (!reflow_screens && show_search_matches(screenbuf, &key))
+        shown_valid = 0;
+    TRACE_END(start, TRACE_FRAME, page_number);
+    buffer_valid = 1;
+    *data = screenbuf;
+    find_dirty_rects();
+    if (memory_pressure(page_number)) {
+        // reflow_frame() and flipbook_frame() don't go through prerender_take(), the
+        // pre-render thread may still be rendering from the pages and tiles about to go
+        prerender_wait();
+        memory_shrink();
+    }
+    if (!reflow_screens) // reflow.c has the next page on its way
+        prerender_schedule();
+}
+
+// render a portion of DjVu page if necessary
+void GetPageData(void **data)
+{
+    ui_enter();
+    get_page_data(data);
+    if (!nav.pending) // otherwise it is the old page until nav_thread() comes back here
+        trace_handoff(page_number);
+    ui_leave();
+}
 
-    buffer_valid = 1;
-    while (ddjvu_message_peek(djvu_context)) ddjvu_message_pop(djvu_context);
-    gettimeofday(&tvstop, NULL);
-    page_render_time_ms = 1000*(tvstop.tv_sec - tvstart.tv_sec) + (tvstop.tv_usec - tvstart.tv_usec)/1000;
+// keep the frame on the screen for the next time the document is opened
+static void save_snapshot(void)
+{
+    FILE *fp;
+    int ok = 0;
 
-#if PIXELS_PER_BYTE == 4
-    grey8to2();
-#endif
-#if PIXELS_PER_BYTE == 1
-    if (show_wmark) show_window_mark();
-#endif
+    if (!resume_snapshot || !buffer_valid || !shown_valid || nav.pending || shown_key.preview) {
+        (void)unlink(snapfname);
+        return;
+    }
+    memset(&snapshot, 0, sizeof(snapshot));
+    memcpy(snapshot.magic, SNAPSHOT_MAGIC, sizeof(snapshot.magic));
+    snapshot.size = file_stat.st_size;
+    snapshot.mtime = file_stat.st_mtime;
+    snapshot.bufsize = SCREEN_BUFFER_SIZE;
+    snapshot.numpages = numpages;
+    snapshot.page_width = page_width;
+    snapshot.page_height = page_height;
+    snapshot.page_type = page_type;
+    snapshot.key = shown_key;
+    if ((fp = fopen(snapfname, "w"))) {
+        ok = fwrite(&snapshot, sizeof(snapshot), 1, fp) == 1 && fwrite(screenbuf, SCREEN_BUFFER_SIZE, 1, fp) == 1;
+        ok = !fclose(fp) && ok;
+    }
+    if (!ok) {
+        DPRINTF("%s: can't write %s\n", __FUNCTION__, snapfname);
+        (void)unlink(snapfname);
+    }
 }
 
 // closing the document, release all the resources.
@@ -641,25 +2063,57 @@ void vEndDoc(void)
 {
     FILE *fp;
     DPRINTF("%s\n", __FUNCTION__);
+    nav_stop();
+    thumbs_close();
+    save_snapshot();
+    cropbox_close();
+    reflow_close();
+    search_close();
+    outline_close();
+    if (trace_file) {
+        if (!strncmp(trace_file, DJVULOGDIR "/", strlen(DJVULOGDIR "/")))
+            mkdir(DJVULOGDIR, 0777);
+        (void)trace_dump(trace_file);
+    }
+    trace_reset();
+    memset(paths, 0, sizeof(paths));
     if ((fp = fopen(inifname, "w"))) {
         fprintf(fp, "zoom_factor=%f\nzoom_factor_inc=%d\n"
                        "horiz_shift_factor=%d\nvert_shift_factor=%d\n"
                        "landscape=%d\ndjvu_render_mode=%d\nuser_djvu_render_mode=%d\n"
                        "show_wmark=%d\n"
                        "multicol=%d\n"
+                       "autocrop=%d\n"
+                       "reflow=%d\n"
                        "rrect.x=%d\nrrect.y=%d\n"
+                       "page_cache_ahead=%d\npage_cache_behind=%d\ntile_cache_size_kb=%d\n"
+                       "partial_refresh_percent=%d\nfull_refresh_every=%d\n"
+                       "async_navigation=%d\nprogressive_display=%d\nthumbnails=%d\n"
+                       "resume_snapshot=%d\nreadahead_pages=%d\nmemory_budget_kb=%d\n"
+                       "search_index=%d\nrender_threads=%d\nflipbook=%d\n"
                        "page_number=%d",
                         zoom_factor, zoom_factor_inc,
                         horiz_shift_factor, vert_shift_factor,
                         landscape, djvu_render_mode, user_djvu_render_mode,
                         show_wmark,
                         multicol,
+                        autocrop,
+                        reflow,
                         rrect.x, rrect.y,
+                        pagecache_ahead, pagecache_behind, tilecache_size_kb,
+                        partial_refresh_percent, full_refresh_every,
+                        async_navigation, progressive_display, thumbnails,
+                        resume_snapshot, readahead_ahead, memory_budget_kb,
+                        search_index, render_threads, flipbook,
                         page_number);
         (void)fclose(fp);
     }
-    ddjvu_page_release(djvu_page);
-    ddjvu_page_release(djvu_page_next);
+    prerender_stop();
+    bandpool_close();
+    flipbook_close();
+    pagecache_clear();
+    tilecache_clear();
+    readahead_close();
     ddjvu_document_release(djvu_document);
     ddjvu_format_release(djvu_format);
     ddjvu_context_release(djvu_context);
@@ -671,13 +2125,7 @@ void vEndDoc(void)
 static inline void set_page_and_render_rects(void)
 {
     int distance;
-    if (landscape) {
-        prect.h = (unsigned int)((float)SCREEN_HEIGHT * zoom_factor);
-        prect.w = (unsigned int)((float)prect.h * page_aspect);
-    } else {
-        prect.w = (unsigned int)((float)SCREEN_WIDTH * zoom_factor);
-        prect.h = (unsigned int)((float)prect.w * page_aspect);
-    }
+    set_prect();
     rrect.w = min(prect.w, SCREEN_WIDTH);
     rrect.h = min(prect.h, SCREEN_HEIGHT);
     distance = (int)(prect.w - rrect.w);
@@ -690,13 +2138,66 @@ static inline void set_page_and_render_rects(void)
     old_window_pos = -1;
 }
 
+/*
+   Put the snapshot of the last session into screenbuf if it shows page
+   pageno in the very window we are about to open, and let nav_thread()
+   replace whatever turns out to be different once the page is decoded.
+   Returns 0 if the page has to be decoded and rendered the usual way.
+ */
+static int resume_from_snapshot(int pageno)
+{
+    struct frame_key key;
+    FILE *fp;
+    int ok;
+
+    if (!resume_snapshot || !snapshot.numpages || snapshot.key.page != pageno)
+        return 0;
+    page_width = snapshot.page_width;
+    page_height = snapshot.page_height;
+    page_aspect = (float)page_height/(float)page_width;
+    page_type = snapshot.page_type;
+    if (!user_djvu_render_mode)
+        set_djvu_render_mode();
+    set_crop_box(pageno, NULL);
+    set_page_and_render_rects();
+    page_number = pageno;
+    make_frame_key(&key);
+    if (memcmp(&key, &snapshot.key, sizeof(key))) {
+        DPRINTF("%s: the snapshot is of another window\n", __FUNCTION__);
+        return 0;
+    }
+    if (!(fp = fopen(snapfname, "r")))
+        return 0;
+    ok = !fseek(fp, sizeof(snapshot), SEEK_SET) && fread(screenbuf, SCREEN_BUFFER_SIZE, 1, fp) == 1;
+    (void)fclose(fp);
+    if (!ok)
+        return 0;
+    ui_enter();
+    if (!nav_start(pageno)) {
+        ui_leave();
+        return 0;
+    }
+    // not before the viewer has asked for the frame, see get_page_data()
+    nav.can_draw = 0;
+    resuming = 1;
+    nav.preview_shown = 1;
+    key.preview = 1; // never scrolled from or saved again
+    shown_key = key;
+    shown_valid = buffer_valid = 1;
+    find_dirty_rects();
+    ui_leave();
+    DPRINTF("%s: showing the snapshot of page %d\n", __FUNCTION__, pageno);
+    return 1;
+}
+
 int iInitDocF(char *filename, int pageno, int flag)
 {
     char buf[129];
     FILE *fp;
 
     DPRINTF("%s(%s,%d,%d)\n", __FUNCTION__, filename, pageno, flag);
-    djvu_page = ddjvu_page_create_by_pageno(djvu_document, pageno);
+    read_ahead(pageno);
+    djvu_page = pagecache_get(pageno);
     if (!djvu_page) {
         DPRINTF("%s: ddjvu_page_create_by_pageno() file=%s page=%d failed\n", __FUNCTION__, filename, pageno);
         return 0;
@@ -722,35 +2223,93 @@ int iInitDocF(char *filename, int pageno, int flag)
             show_wmark = atoi(buf + 11);
         else if (!strncmp(buf, "multicol=", 9))
             multicol = atoi(buf + 9);
+        else if (!strncmp(buf, "autocrop=", 9))
+            autocrop = atoi(buf + 9);
+        else if (!strncmp(buf, "reflow=", 7))
+            reflow = atoi(buf + 7);
         else if (!strncmp(buf, "rrect.x=", 8))
             rrect.x = atoi(buf + 8);
         else if (!strncmp(buf, "rrect.y=", 8))
             rrect.y = atoi(buf + 8);
         else if (!strncmp(buf, "page_number=", 12))
             page_number = atoi(buf + 12);
+        else if (!strncmp(buf, "page_cache_ahead=", 17))
+            pagecache_ahead = atoi(buf + 17);
+        else if (!strncmp(buf, "page_cache_behind=", 18))
+            pagecache_behind = atoi(buf + 18);
+        else if (!strncmp(buf, "tile_cache_size_kb=", 19))
+            tilecache_size_kb = atoi(buf + 19);
+        else if (!strncmp(buf, "partial_refresh_percent=", 24))
+            partial_refresh_percent = atoi(buf + 24);
+        else if (!strncmp(buf, "full_refresh_every=", 19))
+            full_refresh_every = atoi(buf + 19);
+        else if (!strncmp(buf, "async_navigation=", 17))
+            async_navigation = atoi(buf + 17);
+        else if (!strncmp(buf, "progressive_display=", 20))
+            progressive_display = atoi(buf + 20);
+        else if (!strncmp(buf, "thumbnails=", 11))
+            thumbnails = atoi(buf + 11);
+        else if (!strncmp(buf, "resume_snapshot=", 16))
+            resume_snapshot = atoi(buf + 16);
+        else if (!strncmp(buf, "readahead_pages=", 16))
+            readahead_ahead = atoi(buf + 16);
+        else if (!strncmp(buf, "memory_budget_kb=", 17))
+            memory_budget_kb = atoi(buf + 17);
+        else if (!strncmp(buf, "search_index=", 13))
+            search_index = atoi(buf + 13);
+        else if (!strncmp(buf, "render_threads=", 15))
+            render_threads = atoi(buf + 15);
+        else if (!strncmp(buf, "flipbook=", 9))
+            flipbook = atoi(buf + 9);
     }
     (void)fclose(fp);
     if (page_number != pageno) set_defaults(); // invalidate the data from .ini file
 out:
+    memory_init(MEMORY_BUDGET_KB);
+    if (autocrop || multicol)
+        (void)cropbox_open(filename, &file_stat, numpages);
+    if (reflow)
+        reflow = reflow_open(numpages, SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BUFFER_SIZE);
+    if (resume_from_snapshot(pageno))
+        goto done;
     if (!page_decoded_ok()) {
         DPRINTF("%s: decoding of \"%s\" failed on page %d\n", __FUNCTION__, filename, pageno);
         return 0;
     } else
-        djvu_page_next = ddjvu_page_create_by_pageno(djvu_document, pageno + 1);
+        pagecache_prefetch(pageno);
+    if (snapshot.numpages) // InitDoc() didn't wait for DOCINFO
+        numpages = ddjvu_document_get_pagenum(djvu_document);
     page_width = ddjvu_page_get_width(djvu_page);
     page_height = ddjvu_page_get_height(djvu_page);
     page_aspect = (float)page_height/(float)page_width;
     page_type = ddjvu_page_get_type(djvu_page);
     if (!user_djvu_render_mode)
         set_djvu_render_mode();
+    set_crop_box(pageno, djvu_page);
     set_page_and_render_rects();
     page_number = pageno;
+    if (flipbook_recording)
+        flip_page_record(pageno);
+done:
+    if (thumbnails && thumbs_open(filename, &file_stat, numpages))
+        thumbs_want(pageno - pageno % GRID_PAGES, 0);
+    if (search_index)
+        (void)search_open(filename, &file_stat, numpages);
+    (void)outline_open();
+    if (render_threads != 1)
+        (void)bandpool_open(render_threads);
+    if (flipbook)
+        (void)flipbook_open(filename, SCREEN_BUFFER_SIZE, sizeof(struct frame_key), sizeof(struct flip_page));
     return 0;
 }
 
 /* returns 1 if move was successful, otherwise 0 */
 static inline int goto_next_column(void)
 {
+    int retval = follow_path(1, 1);
+
+    if (retval >= 0)
+        return retval;
     if (move_window_right() == 1) {
         multicol = 0;
         while (move_window_up()) ;
@@ -764,6 +2323,10 @@ static inline int goto_next_column(void)
 /* returns 1 if move was successful, otherwise 0 */
 static inline int goto_prev_column(void)
 {
+    int retval = follow_path(-1, 1);
+
+    if (retval >= 0)
+        return retval;
     if (move_window_left() == 1) {
         multicol = 0;
         while (move_window_down()) ;
@@ -780,6 +2343,15 @@ static inline int move_window_down(void)
     int delta, distance;
     DPRINTF("%s()\n", __FUNCTION__);
     next_page_top = next_page_bottom = 0;
+    if (multicol) {
+        switch (follow_path(1, 0)) {
+            case 0:
+                next_page_top = 1;
+                return 0;
+            case 1:
+                return 1;
+        }
+    }
     if (landscape) {
         if (rrect.x == 0) {
             DPRINTF("%s: hit the bottom prect.w=%d, rrect.w=%d, rrect.x=%d\n", __FUNCTION__, prect.w, rrect.w, rrect.x);
@@ -825,6 +2397,15 @@ static inline int move_window_up(void)
     int delta, distance;
     DPRINTF("%s()\n", __FUNCTION__);
     next_page_top = next_page_bottom = 0;
+    if (multicol) {
+        switch (follow_path(-1, 0)) {
+            case 0:
+                next_page_bottom = 1;
+                return 0;
+            case 1:
+                return 1;
+        }
+    }
     if (landscape) {
         distance = (int)(prect.w - rrect.w);
         if (rrect.x == distance) {
@@ -914,25 +2495,382 @@ int Next(void)
 {
     int retval;
     DPRINTF("%s()\n", __FUNCTION__);
+    if (!predicting) // not a key, predict_next_frame() asking where it leads
+        trace_key(KEY_NEXT, trace_now());
+    ui_enter();
+    last_direction = 1;
+    if (nav.pending && !predicting) {
+        // the page we are going to isn't shown yet, go on to the one after it
+        next_page_top = !landscape;
+        next_page_bottom = landscape;
+        retval = (landscape ? goto_prev_page() : goto_next_page()) ? : 2;
+        goto out;
+    }
+    if (reflow_screens && !predicting) {
+        if (reflow_screen + 1 < reflow_screens) {
+            reflow_screen++;
+            buffer_valid = 0;
+            retval = 1;
+        } else
+            retval = goto_next_page();
+        goto out;
+    }
     retval = landscape ? move_window_up() : move_window_down();
     if (retval)
         goto out;
     retval = landscape ? goto_prev_page() : goto_next_page();
 out:
+    ui_leave();
     return retval;
 }
 
 int Prev(void)
 {
     DPRINTF("%s()\n", __FUNCTION__);
-    int retval = landscape ? move_window_down() : move_window_up();
+    if (!predicting)
+        trace_key(KEY_PREV, trace_now());
+    ui_enter();
+    last_direction = -1;
+    int retval;
+    if (nav.pending && !predicting) {
+        next_page_top = landscape;
+        next_page_bottom = !landscape;
+        retval = (landscape ? goto_next_page() : goto_prev_page()) ? : 2;
+        goto out;
+    }
+    if (reflow_screens && !predicting) {
+        if (reflow_screen > 0) {
+            reflow_screen--;
+            buffer_valid = 0;
+            retval = 1;
+        } else if ((retval = goto_prev_page()))
+            reflow_screen = -1; // the last screen of that page
+        goto out;
+    }
+    retval = landscape ? move_window_down() : move_window_up();
     if (retval)
         goto out;
     retval = landscape ? goto_next_page() : goto_prev_page();
 out:
+    ui_leave();
     return retval;
 }
 
+// draw the cell of page p, with the cursor frame if it is on it
+static void paint_grid_cell(int p)
+{
+    static unsigned char cell[GRID_CELL_W*GRID_CELL_H];
+#if PIXELS_PER_BYTE == 4
+    static unsigned char packed[GRID_CELL_W/4*GRID_CELL_H];
+#endif
+    static unsigned char thumb[THUMB_STRIDE*THUMB_HEIGHT];
+    int i = p - grid_first, cx = GRID_LEFT + (i % GRID_COLS)*GRID_CELL_W, cy = (i / GRID_COLS)*GRID_CELL_H;
+    int x, y, w, h, x0, y0, b;
+    char label[16];
+    unsigned char *d;
+
+    memset(cell, 0xff, sizeof(cell));
+    if (thumbs_get(p, &w, &h, thumb)) {
+        x0 = (GRID_CELL_W - w)/2;
+        y0 = (GRID_CELL_H - GRID_LABEL_H - h)/2;
+        for (y = 0; y < h; y++)
+            for (x = 0, d = cell + (y0 + y)*GRID_CELL_W + x0; x < w; x++)
+                d[x] = ((thumb[y*THUMB_STRIDE + (x>>2)] >> ((3 - (x&3))<<1)) & 3)*0x55;
+    } else {
+        // not made yet, just an outline where it goes
+        x0 = (GRID_CELL_W - THUMB_WIDTH)/2;
+        y0 = (GRID_CELL_H - GRID_LABEL_H - THUMB_HEIGHT)/2;
+        for (x = 0; x < THUMB_WIDTH; x++)
+            cell[y0*GRID_CELL_W + x0 + x] = cell[(y0 + THUMB_HEIGHT - 1)*GRID_CELL_W + x0 + x] = 0x80;
+        for (y = 0; y < THUMB_HEIGHT; y++)
+            cell[(y0 + y)*GRID_CELL_W + x0] = cell[(y0 + y)*GRID_CELL_W + x0 + THUMB_WIDTH - 1] = 0x80;
+    }
+    if (p == grid_cursor)
+        for (b = 1; b < 4; b++) {
+            memset(cell + b*GRID_CELL_W + b, 0, GRID_CELL_W - 2*b);
+            memset(cell + (GRID_CELL_H - 1 - b)*GRID_CELL_W + b, 0, GRID_CELL_W - 2*b);
+            for (y = b; y < GRID_CELL_H - b; y++)
+                cell[y*GRID_CELL_W + b] = cell[y*GRID_CELL_W + GRID_CELL_W - 1 - b] = 0;
+        }
+#if PIXELS_PER_BYTE == 4
+    memset(packed, 0, sizeof(packed));
+    for (y = 0; y < GRID_CELL_H; y++)
+        for (x = 0; x < GRID_CELL_W; x++)
+            packed[y*(GRID_CELL_W/4) + (x>>2)] |= (cell[y*GRID_CELL_W + x] >> 6) << ((3 - (x&3))<<1);
+    v3_callbacks->BlitBitmap(cx, cy, GRID_CELL_W, GRID_CELL_H, 0, 0, GRID_CELL_W, GRID_CELL_H, packed);
+#endif
+#if PIXELS_PER_BYTE == 1
+    v3_callbacks->BlitBitmap(cx, cy, GRID_CELL_W, GRID_CELL_H, 0, 0, GRID_CELL_W, GRID_CELL_H, cell);
+#endif
+    sprintf(label, "%d", p + 1);
+    v3_callbacks->TextOut(cx + GRID_CELL_W/2 - 5*strlen(label), cy + GRID_CELL_H - 8, label, strlen(label), TF_ASCII);
+}
+
+static void paint_grid(void)
+{
+    int p;
+
+    v3_callbacks->ClearScreen(0xFF);
+    v3_callbacks->SetFontSize(18);
+    for (p = grid_first; p < grid_first + GRID_PAGES && p < numpages; p++)
+        paint_grid_cell(p);
+    thumbs_want(grid_first, GRID_PAGES);
+    v3_callbacks->Print();
+}
+
+static inline void open_grid(void)
+{
+    nav.can_draw = 0;
+    grid_active = 1;
+    grid_cursor = page_number;
+    grid_first = page_number - page_number % GRID_PAGES;
+    v3_callbacks->BeginDialog();
+    paint_grid();
+}
+
+// move the cursor by n pages, turning the grid's page if it goes off it
+static void move_grid_cursor(int n)
+{
+    int old = grid_cursor;
+
+    grid_cursor += n;
+    if (grid_cursor < 0)
+        grid_cursor = 0;
+    else if (grid_cursor >= numpages)
+        grid_cursor = numpages - 1;
+    if (grid_cursor == old)
+        return;
+    if (grid_cursor < grid_first || grid_cursor >= grid_first + GRID_PAGES) {
+        grid_first = grid_cursor - grid_cursor % GRID_PAGES;
+        paint_grid();
+        return;
+    }
+    v3_callbacks->SetFontSize(18);
+    paint_grid_cell(old);
+    paint_grid_cell(grid_cursor);
+    v3_callbacks->PartialPrint();
+}
+
+static int grid_key(int key)
+{
+    switch (key) {
+        case KEY_NEXT:
+            move_grid_cursor(1);
+            break;
+        case KEY_PREV:
+            move_grid_cursor(-1);
+            break;
+        case KEY_DOWN:
+            move_grid_cursor(GRID_COLS);
+            break;
+        case KEY_UP:
+            move_grid_cursor(-GRID_COLS);
+            break;
+        case KEY_SHORTCUT_VOLUME_DOWN:
+        case LONG_KEY_NEXT:
+            move_grid_cursor(GRID_PAGES);
+            break;
+        case KEY_SHORTCUT_VOLUME_UP:
+        case LONG_KEY_PREV:
+            move_grid_cursor(-GRID_PAGES);
+            break;
+        case LONG_SHORTCUT_KEY_VOLUME_DOWN:
+            move_grid_cursor(10*GRID_PAGES);
+            break;
+        case LONG_SHORTCUT_KEY_VOLUME_UP:
+            move_grid_cursor(-10*GRID_PAGES);
+            break;
+        case KEY_OK:
+            grid_active = 0;
+            thumbs_want(grid_first, 0);
+            if (grid_cursor != page_number) {
+                next_page_top = next_page_bottom = 0;
+                GotoPage(grid_cursor);
+            }
+            v3_callbacks->EndDialog();
+            return 1;
+        default:
+            grid_active = 0;
+            thumbs_want(grid_first, 0);
+            v3_callbacks->EndDialog();
+            return 1;
+    }
+    return 2;
+}
+
+// called by the thumbnail thread when the thumbnail of page p has been made
+void thumbs_ready(int p)
+{
+    ui_enter();
+    if (grid_active && p >= grid_first && p < grid_first + GRID_PAGES) {
+        v3_callbacks->SetFontSize(18);
+        paint_grid_cell(p);
+        v3_callbacks->PartialPrint();
+    }
+    ui_leave();
+}
+
+#define HELP_STARTX 17
+#define HELP_STARTY 35
+#define HELP_STEPY  33
+
+char *get_local_string(char *name)
+{
+    return v3_callbacks->GetString(name) ? : name;
+}
+
+static inline void print_help_line(int y, char *name)
+{
+    char *msg = get_local_string(name);
+    v3_callbacks->TextOut(HELP_STARTX, y, msg, strlen(msg), TF_UTF8);
+}
+
+static inline void draw_help_frame(void)
+{
+    v3_callbacks->Rect(2, 2, SCREEN_WIDTH-4, SCREEN_HEIGHT-4);
+    v3_callbacks->Rect(5, 5, SCREEN_WIDTH-9, SCREEN_HEIGHT-9);
+    v3_callbacks->Rect(8, 8, SCREEN_WIDTH-14, SCREEN_HEIGHT-14);
+}
+
+static void paint_search(void)
+{
+    char line[64];
+    int i, y = 50, first, n = search_active == 1 ? search_nwords : min(search_nhits, SEARCH_MAX_HITS);
+
+    v3_callbacks->ClearScreen(0xFF);
+    draw_help_frame();
+    v3_callbacks->SetFontSize(28);
+    if (search_active == 1)
+        snprintf(line, sizeof(line), "%s: %s_", get_local_string("DJVU_SEARCH_TITLE"), search_code);
+    else
+        snprintf(line, sizeof(line), "%s: %d %s", search_term, search_nhits, get_local_string("DJVU_SEARCH_PAGES"));
+    v3_callbacks->TextOut(HELP_STARTX, y, line, strlen(line), TF_UTF8);
+    v3_callbacks->SetFontSize(20);
+    if (search_count() < numpages) {
+        snprintf(line, sizeof(line), "%s: %d/%d", get_local_string("DJVU_SEARCH_INDEXED"), search_count(), numpages);
+        v3_callbacks->TextOut(HELP_STARTX, y + 30, line, strlen(line), TF_UTF8);
+    }
+    y += 50;
+    v3_callbacks->SetFontSize(24);
+    if (!n) {
+        print_help_line(y += HELP_STEPY, "DJVU_SEARCH_NONE");
+    }
+    first = search_cursor - search_cursor % SEARCH_ROWS;
+    for (i = first; i < n && i < first + SEARCH_ROWS; i++) {
+        if (search_active == 1)
+            snprintf(line, sizeof(line), "%s %s", i == search_cursor ? ">" : " ", search_words[i]);
+        else
+            snprintf(line, sizeof(line), "%s %d", i == search_cursor ? ">" : " ", search_hits[i] + 1);
+        v3_callbacks->TextOut(HELP_STARTX, y += HELP_STEPY + 5, line, strlen(line), TF_UTF8);
+    }
+    v3_callbacks->PartialPrint();
+}
+
+// the words which fit the keys typed so far
+static inline void search_update_words(void)
+{
+    search_nwords = search_complete(search_code, search_words, SEARCH_ROWS);
+    search_cursor = 0;
+}
+
+// the pages the word is on, the cursor on the first one from the current page on
+static void search_pick(const char *word)
+{
+    if (word != search_term)
+        strcpy(search_term, word);
+    search_boxes_page = -1;
+    search_nhits = search_find(search_term, search_hits, SEARCH_MAX_HITS);
+    for (search_cursor = 0; search_cursor < min(search_nhits, SEARCH_MAX_HITS) - 1; search_cursor++)
+        if (search_hits[search_cursor] >= page_number)
+            break;
+    search_active = 2;
+}
+
+static inline void open_search(void)
+{
+    nav.can_draw = 0;
+    v3_callbacks->BeginDialog();
+    search_hurry(1);
+    if (search_term[0])
+        search_pick(search_term);
+    else {
+        search_active = 1;
+        search_code[0] = 0;
+        search_update_words();
+    }
+    paint_search();
+}
+
+static inline int close_search(void)
+{
+    search_active = 0;
+    search_hurry(0);
+    buffer_valid = 0; // the matches to show may have changed
+    v3_callbacks->EndDialog();
+    return 1;
+}
+
+static int search_key(int key)
+{
+    int len = strlen(search_code), n = search_active == 1 ? search_nwords : min(search_nhits, SEARCH_MAX_HITS);
+
+    if (search_active == 1 && key >= KEY_1 && key <= KEY_9) {
+        if (len < SEARCH_MAX_WORD/2) {
+            search_code[len] = '1' + key - KEY_1;
+            search_code[len + 1] = 0;
+            search_update_words();
+        }
+        paint_search();
+        return 2;
+    }
+    switch (key) {
+        case KEY_NEXT:
+        case KEY_DOWN:
+            if (search_cursor + 1 < n)
+                search_cursor++;
+            break;
+        case KEY_UP:
+            if (search_cursor > 0)
+                search_cursor--;
+            break;
+        case KEY_SHORTCUT_VOLUME_DOWN:
+            search_cursor = min(search_cursor + SEARCH_ROWS, max(n - 1, 0));
+            break;
+        case KEY_SHORTCUT_VOLUME_UP:
+            search_cursor = max(search_cursor - SEARCH_ROWS, 0);
+            break;
+        case KEY_CANCEL:
+            if (search_active == 2) {
+                search_active = 1;
+                search_update_words();
+            } else if (len) {
+                search_code[len - 1] = 0;
+                search_update_words();
+            } else {
+                // nothing typed, don't show the last word any more
+                search_term[0] = 0;
+                return close_search();
+            }
+            break;
+        case KEY_OK:
+            if (!n)
+                break;
+            if (search_active == 1) {
+                search_pick(search_words[search_cursor]);
+                break;
+            }
+            if (search_hits[search_cursor] != page_number) {
+                next_page_top = next_page_bottom = 0;
+                GotoPage(search_hits[search_cursor]);
+            }
+            return close_search();
+        default:
+            return 2;
+    }
+    paint_search();
+    return 2;
+}
+
 static inline void add_text(char *buf, char *text)
 {
     DPRINTF("%s(\"%s\")\n", __FUNCTION__, text ? : "NULL");
@@ -950,6 +2888,12 @@ static inline int process_input_key(int key)
 
     DPRINTF("%s(%d)\n", __FUNCTION__, key);
 
+    if (grid_active)
+        return grid_key(key);
+
+    if (search_active)
+        return search_key(key);
+
     if (waiting_for_a_key) {
         waiting_for_a_key = 0;
         v3_callbacks->EndDialog();
@@ -1064,6 +3008,7 @@ static inline void save_window(void)
     DPRINTF("%s\n", __FUNCTION__);
     old_prect = prect;
     old_rrect = rrect;
+    old_page_rect = page_rect;
     old_zoom_factor = zoom_factor;
     old_zoom_factor_inc = zoom_factor_inc;
     old_horiz_shift_factor = horiz_shift_factor;
@@ -1081,6 +3026,7 @@ static inline void restore_window(void)
         return;
     prect = old_prect;
     rrect = old_rrect;
+    page_rect = old_page_rect;
     zoom_factor = old_zoom_factor;
     horiz_shift_factor = old_horiz_shift_factor;
     vert_shift_factor = old_vert_shift_factor;
@@ -1094,12 +3040,10 @@ static inline void restore_window(void)
     }
 }
 
-int OnKeyPressed(int key, int state)
+static int on_key_pressed(int key, int state)
 {
     int retval = 0;
 
-    DPRINTF("%s(%d,%d)\n", __FUNCTION__, key, state);
-
     if (state == CUSTOMIZESTATE)
         return process_input_key(key);
 
@@ -1134,11 +3078,14 @@ int OnKeyPressed(int key, int state)
             break;
 
         case LONG_KEY_NEXT:
-            retval = landscape ? GotoPage(page_number - 10) : GotoPage(page_number + 10);
-            break;
-
         case LONG_KEY_PREV:
-            retval = landscape ? GotoPage(page_number + 10) : GotoPage(page_number - 10);
+            if (thumbnails) {
+                open_grid();
+                retval = 2;
+            } else if ((key == LONG_KEY_NEXT) != landscape)
+                retval = GotoPage(page_number + 10);
+            else
+                retval = GotoPage(page_number - 10);
             break;
 
         case KEY_5:
@@ -1153,6 +3100,11 @@ int OnKeyPressed(int key, int state)
 
         case LONG_KEY_OK:
             landscape = 1 - landscape;
+            // pages are reflowed upright only
+            if (reflow) {
+                reflow = 0;
+                reflow_close();
+            }
         case KEY_EXPANSION:
             zoom_factor = 1.0;
             rrect.x = landscape ? (unsigned int)((float)rrect.h * page_aspect) - rrect.w : 0;
@@ -1205,10 +3157,40 @@ int OnKeyPressed(int key, int state)
             retval = landscape ? move_window_right() : move_window_left();
             break;
 
+        // same as the viewer does, but through refresh_screen() below
+        case KEY_NEXT:
+            retval = Next();
+            break;
+
+        case KEY_PREV:
+            retval = Prev();
+            break;
+
         default:
             break;
     }
 
+    // the window may have moved even if the last step hit the edge
+    if (retval && !buffer_valid)
+        retval = refresh_screen();
+    return retval;
+}
+
+int OnKeyPressed(int key, int state)
+{
+    int retval;
+    TRACE_BEGIN(start);
+
+    DPRINTF("%s(%d,%d)\n", __FUNCTION__, key, state);
+    ui_enter();
+    retval = on_key_pressed(key, state);
+    // the viewer will ask for the frame now, or nav_thread() will show it
+    if (state == NORMALSTATE && (retval == 1 || nav.pending))
+        trace_key(key, start);
+    // the viewer takes over the screen for the keys we leave to it, our own dialogs see to it themselves
+    if ((state != NORMALSTATE && state != CUSTOMIZESTATE) || !retval)
+        nav.can_draw = 0;
+    ui_leave();
     return retval;
 }
 
@@ -1219,6 +3201,9 @@ int OnKeyPressed(int key, int state)
 #define DJVU_MENU_SHOW_WMARK        2004
 #define DJVU_MENU_MULTICOL          2005
 #define DJVU_MENU_HELP              2006
+#define DJVU_MENU_AUTOCROP          2007
+#define DJVU_MENU_REFLOW            2008
+#define DJVU_MENU_SEARCH            2009
 
 #if EREADER_MODEL == HANLIN_V3
 #define VIEWER_MENU_GOTOFIRSTPAGE 118
@@ -1245,6 +3230,9 @@ static struct viewer_menu_item_t libdjvu_menu[] = {
 {DJVU_MENU_VSHIFT_ENTER, "DJVU_MENU_VSHIFT_ENTER", NULL},
 {DJVU_MENU_SHOW_WMARK, "DJVU_MENU_SHOW_WMARK", NULL},
 {DJVU_MENU_MULTICOL, "DJVU_MENU_MULTICOL", NULL},
+{DJVU_MENU_AUTOCROP, "DJVU_MENU_AUTOCROP", NULL},
+{DJVU_MENU_REFLOW, "DJVU_MENU_REFLOW", NULL},
+{DJVU_MENU_SEARCH, "DJVU_MENU_SEARCH", NULL},
 {DJVU_MENU_HELP, "DJVU_MENU_HELP", NULL},
 {0, NULL, NULL}
 };
@@ -1262,28 +3250,6 @@ static inline void paint_white_block(void)
     v3_callbacks->PartialPrint();
 }
 
-#define HELP_STARTX 17
-#define HELP_STARTY 35
-#define HELP_STEPY  33
-
-char *get_local_string(char *name)
-{
-    return v3_callbacks->GetString(name) ? : name;
-}
-
-static inline void print_help_line(int y, char *name)
-{
-    char *msg = get_local_string(name);
-    v3_callbacks->TextOut(HELP_STARTX, y, msg, strlen(msg), TF_UTF8);
-}
-
-static inline void draw_help_frame(void)
-{
-    v3_callbacks->Rect(2, 2, SCREEN_WIDTH-4, SCREEN_HEIGHT-4);
-    v3_callbacks->Rect(5, 5, SCREEN_WIDTH-9, SCREEN_HEIGHT-9);
-    v3_callbacks->Rect(8, 8, SCREEN_WIDTH-14, SCREEN_HEIGHT-14);
-}
-
 static inline void paint_help_screen(void)
 {
     int y = HELP_STARTY;
@@ -1322,7 +3288,7 @@ static inline void paint_help_screen(void)
 
 #define ABOUT_STARTX 17
 #define ABOUT_STARTY 10
-#define ABOUT_STEPY  40
+#define ABOUT_STEPY  38
 
 static void gui_printf(int y, const char *fmt, ...)
 {
@@ -1337,6 +3303,8 @@ static void gui_printf(int y, const char *fmt, ...)
 static inline void paint_about_screen(void)
 {
     int y = ABOUT_STARTY;
+    unsigned long rss;
+    unsigned int decode50 = 0, decode95 = 0, frame50 = 0, frame95 = 0, turn50 = 0, turn95 = 0;
     char *date;
 
     v3_callbacks->BeginDialog();
@@ -1371,25 +3339,54 @@ static inline void paint_about_screen(void)
     gui_printf(y += ABOUT_STEPY,
         "%s %d: %s %dx%d %ddpi v%d (Lib v%d)",
         get_local_string("DJVU_ABOUT_PAGE"), page_number + 1, get_djvu_page_type(),
-        page_width, page_height, ddjvu_page_get_resolution(djvu_page),
-        ddjvu_page_get_version(djvu_page), ddjvu_code_get_version());
+        page_width, page_height, need_page() ? ddjvu_page_get_resolution(djvu_page) : 0,
+        djvu_page ? ddjvu_page_get_version(djvu_page) : 0, ddjvu_code_get_version());
 
     gui_printf(y += ABOUT_STEPY,
         "%s: %s",
         get_local_string("DJVU_ABOUT_RENDMODE"), get_djvu_render_mode());
 
+    // medians and 95th percentiles of the last few
+    (void)trace_percentiles(TRACE_DECODE, &decode50, &decode95);
+    (void)trace_percentiles(TRACE_FRAME, &frame50, &frame95);
+    (void)trace_percentiles(TRACE_TURN, &turn50, &turn95);
+    gui_printf(y += ABOUT_STEPY,
+        "%s: %u/%ums, %s: %u/%ums, %s: %u/%ums",
+        get_local_string("DJVU_ABOUT_DECODE"), decode50, decode95,
+        get_local_string("DJVU_ABOUT_RENDER"), frame50, frame95,
+        get_local_string("DJVU_ABOUT_TURN"), turn50, turn95);
+
+    gui_printf(y += ABOUT_STEPY,
+        "%s: %d+%d+1, %u %s, %u %s",
+        get_local_string("DJVU_ABOUT_PAGECACHE"), pagecache_behind, pagecache_ahead,
+        pagecache_hits, get_local_string("DJVU_ABOUT_HITS"),
+        pagecache_misses, get_local_string("DJVU_ABOUT_MISSES"));
+
     gui_printf(y += ABOUT_STEPY,
-        "%s: %dms%s, %s: %dms",
-        get_local_string("DJVU_ABOUT_DECODE"), page_decode_time_ms,
-        page_decode_time_ms ? "" : get_local_string("DJVU_ABOUT_CACHED"),
-        get_local_string("DJVU_ABOUT_RENDER"), page_render_time_ms);
+        "%s: %u %s, %u %s",
+        get_local_string("DJVU_ABOUT_PRERENDER"),
+        prerender.hits, get_local_string("DJVU_ABOUT_HITS"),
+        prerender.misses, get_local_string("DJVU_ABOUT_MISSES"));
 
     gui_printf(y += ABOUT_STEPY,
-        "%s: %ldMB, %s: %s",
-        get_local_string("DJVU_ABOUT_DJVUCACHE"), ddjvu_cache_get_size(djvu_context)/(1024*1024),
+        "%s: %lu/%dKB, %u %s, %u %s",
+        get_local_string("DJVU_ABOUT_TILECACHE"), tilecache_bytes()/1024, min(tilecache_size_kb, tilecache_budget_kb),
+        tilecache_hits, get_local_string("DJVU_ABOUT_HITS"),
+        tilecache_misses, get_local_string("DJVU_ABOUT_MISSES"));
+
+    gui_printf(y += ABOUT_STEPY,
+        "%s: %ldKB, %s: %s", // djvulibre tells the limit of its cache, not what is in it
+        get_local_string("DJVU_ABOUT_DJVUCACHE"), ddjvu_cache_get_size(djvu_context)/1024,
         get_local_string("DJVU_ABOUT_MULTICOL"),
         multicol ? get_local_string("DJVU_ABOUT_ON") : get_local_string("DJVU_ABOUT_OFF"));
 
+    rss = memory_rss();
+    gui_printf(y += ABOUT_STEPY,
+        "%s: %lu/%luKB, %s ~%luKB, RSS %luKB (%s %luKB)",
+        get_local_string("DJVU_ABOUT_MEMORY"), rss > memory_base_rss ? rss - memory_base_rss : 0, memory_budget,
+        get_local_string("DJVU_ABOUT_PAGES"), pagecache_bytes()/1024,
+        rss, get_local_string("DJVU_ABOUT_PEAK"), memory_peak());
+
     gui_printf(y += ABOUT_STEPY,
         "%s: %s, %s: %s",
         get_local_string("DJVU_ABOUT_ORIENT"),
@@ -1398,14 +3395,18 @@ static inline void paint_about_screen(void)
         show_wmark ? get_local_string("DJVU_ABOUT_ON") : get_local_string("DJVU_ABOUT_OFF"));
 
     gui_printf(y += ABOUT_STEPY,
-        "%s: %.0f%%, %s: %d%%",
+        "%s: %.0f%%, %s: %d%%, %s: %s (%d)",
         get_local_string("DJVU_ABOUT_ZM"), 100*zoom_factor,
-        get_local_string("DJVU_ABOUT_ZM_STEP"), zoom_factor_inc);
+        get_local_string("DJVU_ABOUT_ZM_STEP"), zoom_factor_inc,
+        get_local_string("DJVU_ABOUT_AUTOCROP"),
+        autocrop ? get_local_string("DJVU_ABOUT_ON") : get_local_string("DJVU_ABOUT_OFF"), cropbox_count());
 
     gui_printf(y += ABOUT_STEPY,
-        "%s: %d%%, %s: %d%%",
+        "%s: %d%%, %s: %d%%, %s: %s",
         get_local_string("DJVU_ABOUT_HORIZ_STEP"), horiz_shift_factor,
-        get_local_string("DJVU_ABOUT_VERT_STEP"), vert_shift_factor);
+        get_local_string("DJVU_ABOUT_VERT_STEP"), vert_shift_factor,
+        get_local_string("DJVU_ABOUT_REFLOW"),
+        reflow ? get_local_string("DJVU_ABOUT_ON") : get_local_string("DJVU_ABOUT_OFF"));
 
     gui_printf(y += ABOUT_STEPY,
         "%s: %d%s",
@@ -1431,6 +3432,8 @@ int OnMenuAction(int action)
     int retval = 0;
 
     DPRINTF("%s(%d)\n", __FUNCTION__, action);
+    ui_enter();
+    nav.can_draw = 0;
 
     switch (action) {
         case DJVU_MENU_ZOOMFACTOR_ENTER:
@@ -1461,9 +3464,44 @@ int OnMenuAction(int action)
 
         case DJVU_MENU_MULTICOL:
             multicol = 1 - multicol;
+            if (multicol)
+                (void)cropbox_open(file_name, &file_stat, numpages);
+            (void)need_page();
+            set_crop_box(page_number, djvu_page);
+            retval = 1;
+            break;
+
+        case DJVU_MENU_AUTOCROP:
+            autocrop = 1 - autocrop;
+            if (autocrop)
+                (void)cropbox_open(file_name, &file_stat, numpages);
+            (void)need_page();
+            set_crop_box(page_number, djvu_page);
+            // start from the top of the page (or its box)
+            set_prect();
+            rrect.x = landscape ? (int)prect.w : 0;
+            rrect.y = 0;
+            set_page_and_render_rects();
+            retval = 1;
+            break;
+
+        case DJVU_MENU_REFLOW:
+            if (reflow) {
+                reflow = 0;
+                reflow_close();
+            } else if ((reflow = reflow_open(numpages, SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BUFFER_SIZE)) && landscape) {
+                landscape = 0;
+                rrect.x = rrect.y = 0;
+            }
+            reflow_screen = 0;
+            set_page_and_render_rects();
             retval = 1;
             break;
 
+        case DJVU_MENU_SEARCH:
+            open_search();
+            break;
+
         case DJVU_MENU_ABOUT:
             paint_about_screen();
             waiting_for_a_key = 1;
@@ -1476,5 +3514,6 @@ int OnMenuAction(int action)
     }
 
     if (retval) leave_menu_mode();
+    ui_leave();
     return retval;
 }
@@ -1,17 +1,14 @@
 #ifndef _LIBDJVU_H
 #define _LIBDJVU_H
 
-// in libdjvu.c
-static inline int move_window_up(void);
-static inline int move_window_down(void);
-static inline int move_window_right(void);
-static inline int move_window_left(void);
-
 // in id2string.c
 extern const char *get_djvu_render_mode(void);
 extern const char *get_djvu_page_type(void);
 extern const char *get_djvu_doc_type(void);
 
+// in libdjvu.c: where vEndDoc() saves the trace (see trace.c), NULL for nowhere
+extern const char *trace_file;
+
 extern void vSetCurPage(int);
 extern int bGetRotate(void);
 extern void vSetRotate(int);
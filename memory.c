@@ -0,0 +1,191 @@
+/*
+ * memory.c Memory budget of libdjvu
+ *
+ * The memory we can use beyond what the viewer, the plugin and its static
+ * buffers take when the document is opened is shared out between the
+ * djvulibre cache, the decoded pages held by the page cache and the tile
+ * cache. The budget is memory_budget_kb if set, otherwise the default for
+ * the model, or less if there isn't that much free RAM.
+ *
+ * The resident size of the process and the free RAM are checked when a
+ * new page is shown and every MEMORY_CHECK_FRAMES frames. When we are over
+ * the budget, or the system is running out of memory, the caches are cut
+ * down in this order until the resident size goes down: the tile cache
+ * (cheapest to rebuild), the djvulibre cache, then the pages kept around
+ * the current one. They get their full shares back with the next
+ * document.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "memory.h"
+#include "pagecache.h"
+#include "tilecache.h"
+#include "debug.h"
+
+int memory_budget_kb; // 0 to work it out
+unsigned long memory_budget, memory_base_rss; // in KB
+static unsigned long peak_rss, shrunk_rss; // the RSS after the last cut, freed memory doesn't always go back
+static int checked_page, unchecked_frames;
+
+// KB on the "key:" line of a /proc file, -1 if there is none
+static long proc_kb(const char *file, const char *key)
+{
+    char line[128];
+    long kb = -1;
+    int len = strlen(key);
+    FILE *fp = fopen(file, "r");
+
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (!strncmp(line, key, len)) {
+            kb = atol(line + len);
+            break;
+        }
+    (void)fclose(fp);
+    return kb;
+}
+
+// what the kernel could give us without swapping: free, buffers and page cache, -1 if unknown
+static long free_kb(void)
+{
+    char line[128];
+    long kb = 0;
+    int found = 0;
+    FILE *fp = fopen("/proc/meminfo", "r");
+
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp) && found < 3)
+        if (!strncmp(line, "MemFree:", 8) || !strncmp(line, "Buffers:", 8) || !strncmp(line, "Cached:", 7)) {
+            kb += atol(strchr(line, ':') + 1);
+            found++;
+        }
+    (void)fclose(fp);
+    return found ? kb : -1;
+}
+
+unsigned long memory_rss(void)
+{
+    unsigned long size, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    if (fp) {
+        if (fscanf(fp, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        (void)fclose(fp);
+    }
+    resident *= sysconf(_SC_PAGESIZE)/1024;
+    if (resident > peak_rss)
+        peak_rss = resident;
+    return resident;
+}
+
+// the highest the resident size has been, from the kernel if it keeps count
+unsigned long memory_peak(void)
+{
+    long hwm = proc_kb("/proc/self/status", "VmHWM:");
+
+    (void)memory_rss();
+    if (hwm > (long)peak_rss)
+        peak_rss = hwm;
+    return peak_rss;
+}
+
+/*
+   Work out the budget for the document being opened and give each cache
+   its share. default_kb is the budget for the model.
+ */
+void memory_init(int default_kb)
+{
+    unsigned long djvu_kb;
+    long avail = free_kb();
+
+    memory_base_rss = memory_rss();
+    shrunk_rss = 0;
+    checked_page = -1;
+    if (memory_budget_kb > 0)
+        memory_budget = memory_budget_kb;
+    else {
+        memory_budget = default_kb;
+        if (avail > 0 && avail*MEMORY_FREE_PERCENT/100 < memory_budget)
+            memory_budget = avail*MEMORY_FREE_PERCENT/100;
+    }
+    tilecache_budget_kb = memory_budget*MEMORY_TILES_PERCENT/100;
+    pagecache_budget = PAGECACHE_MAX;
+    djvu_kb = memory_budget*MEMORY_DJVU_PERCENT/100;
+    ddjvu_cache_set_size(djvu_context, djvu_kb*1024);
+    DPRINTF("%s: %luKB (%ldKB free), %luKB djvulibre cache, %dKB tiles, base RSS %luKB\n",
+            __FUNCTION__, memory_budget, avail, djvu_kb, tilecache_budget_kb, memory_base_rss);
+}
+
+// returns 1 if some memory has to be given back, page is the one shown
+int memory_pressure(int page)
+{
+    unsigned long rss;
+    long avail;
+
+    if (page == checked_page && ++unchecked_frames < MEMORY_CHECK_FRAMES)
+        return 0;
+    checked_page = page;
+    unchecked_frames = 0;
+    rss = memory_rss();
+
+    if (rss > memory_base_rss + memory_budget && rss > shrunk_rss) {
+        DPRINTF("%s: RSS %luKB, over the budget by %luKB\n", __FUNCTION__, rss, rss - memory_base_rss - memory_budget);
+        return 1;
+    }
+    avail = free_kb();
+    if (avail >= 0 && avail < MEMORY_MIN_FREE_KB) {
+        DPRINTF("%s: only %ldKB free\n", __FUNCTION__, avail);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+   Cut down the caches in order until the resident size goes down. The
+   djvulibre cache only tells its limit, not what it holds: a cut of it
+   which gives nothing back is undone and the next cache is tried. The
+   page cache may release handles, so nothing may be rendering from them.
+ */
+void memory_shrink(void)
+{
+    unsigned long rss = memory_rss(), djvu_limit = ddjvu_cache_get_size(djvu_context);
+    int step;
+
+    for (step = 0; step < 3; step++) {
+        if (step == 0 && tilecache_bytes() >= 2*TILE_SIZE*TILE_SIZE) {
+            tilecache_budget_kb = tilecache_bytes()/2/1024;
+            tilecache_shrink();
+            DPRINTF("%s: tile cache down to %dKB\n", __FUNCTION__, tilecache_budget_kb);
+        } else if (step == 1 && djvu_limit > MEMORY_MIN_DJVU_KB*1024) {
+            ddjvu_cache_set_size(djvu_context, djvu_limit/2);
+            DPRINTF("%s: djvulibre cache down to %luKB\n", __FUNCTION__, djvu_limit/2/1024);
+        } else if (step == 2 && pagecache_count() > 1) {
+            pagecache_budget = pagecache_count() - 1;
+            pagecache_trim();
+            DPRINTF("%s: page cache down to %d pages\n", __FUNCTION__, pagecache_budget);
+        } else
+            continue;
+        (void)malloc_trim(0);
+        shrunk_rss = memory_rss();
+        unchecked_frames = MEMORY_CHECK_FRAMES; // see on the next frame if that was enough
+        if (shrunk_rss < rss)
+            return;
+        DPRINTF("%s: RSS still %luKB\n", __FUNCTION__, shrunk_rss);
+        if (step == 1)
+            ddjvu_cache_set_size(djvu_context, djvu_limit);
+    }
+    ddjvu_cache_clear(djvu_context);
+    (void)malloc_trim(0);
+    shrunk_rss = memory_rss();
+    DPRINTF("%s: nothing left to give back\n", __FUNCTION__);
+}
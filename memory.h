@@ -0,0 +1,23 @@
+#ifndef _MEMORY_H
+#define _MEMORY_H
+
+#define MEMORY_FREE_PERCENT  50    // at most this much of the free RAM by default
+#define MEMORY_DJVU_PERCENT  50    // share of the budget for the djvulibre cache
+#define MEMORY_TILES_PERCENT 25    // for the tile cache, the decoded pages get the rest
+#define MEMORY_MIN_FREE_KB   1024  // give memory back when the system has less than this free
+#define MEMORY_MIN_DJVU_KB   512   // the djvulibre cache isn't cut below this
+#define MEMORY_CHECK_FRAMES  8     // frames on the same page between two checks
+
+extern int memory_budget_kb;
+extern unsigned long memory_budget, memory_base_rss;
+
+extern void memory_init(int);
+extern int memory_pressure(int);
+extern void memory_shrink(void);
+extern unsigned long memory_rss(void);
+extern unsigned long memory_peak(void);
+
+// in libdjvu.c
+extern ddjvu_context_t *djvu_context;
+
+#endif
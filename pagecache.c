@@ -0,0 +1,216 @@
+/*
+ * pagecache.c Cache of decoded page handles around the current page for libdjvu
+ *
+ * Pages within pagecache_ahead/pagecache_behind of the current page are
+ * created (i.e. start decoding) in advance, so that turning a page either
+ * way, or going back to a page seen recently, finds it already decoded.
+ * When the cache is full the least recently used page outside of that
+ * window goes first. Under memory pressure memory.c lowers
+ * pagecache_budget, which narrows the window, pages behind first.
+ *
+ * None of these functions may be called while another thread is rendering
+ * from a handle in the cache, as any of them may release it.
+ */
+
+#include <stdio.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "pagecache.h"
+#include "debug.h"
+
+int pagecache_ahead = 2, pagecache_behind = 1;
+int pagecache_budget = PAGECACHE_MAX;
+unsigned int pagecache_hits, pagecache_misses;
+
+static struct pagecache_entry {
+    int pageno;
+    ddjvu_page_t *page;
+    unsigned int stamp;
+} cache[PAGECACHE_MAX];
+
+static int nentries, curpage;
+static unsigned int lru_clock;
+
+// keep the window within what the cache can hold
+static inline void clamp_window(void)
+{
+    if (pagecache_ahead < 0) pagecache_ahead = 0;
+    if (pagecache_behind < 0) pagecache_behind = 0;
+    if (pagecache_ahead > PAGECACHE_MAX/2 - 1) pagecache_ahead = PAGECACHE_MAX/2 - 1;
+    if (pagecache_behind > PAGECACHE_MAX/2 - 1) pagecache_behind = PAGECACHE_MAX/2 - 1;
+}
+
+// the window as far as pagecache_budget allows
+static inline void get_window(int *ahead, int *behind)
+{
+    *ahead = pagecache_ahead;
+    *behind = pagecache_behind;
+    while (*ahead + *behind + 1 > pagecache_budget && *behind > 0)
+        (*behind)--;
+    while (*ahead + *behind + 1 > pagecache_budget && *ahead > 0)
+        (*ahead)--;
+}
+
+static inline int capacity(void)
+{
+    int ahead, behind, n;
+
+    get_window(&ahead, &behind);
+    n = ahead + behind + 2; // one more for the page we just left
+    if (n > pagecache_budget)
+        n = pagecache_budget > 1 ? pagecache_budget : 1;
+    return n > PAGECACHE_MAX ? PAGECACHE_MAX : n;
+}
+
+static inline int in_window(int pageno)
+{
+    int ahead, behind;
+
+    get_window(&ahead, &behind);
+    return pageno >= curpage - behind && pageno <= curpage + ahead;
+}
+
+static inline struct pagecache_entry *lookup(int pageno)
+{
+    int i;
+    for (i = 0; i < nentries; i++)
+        if (cache[i].pageno == pageno)
+            return &cache[i];
+    return NULL;
+}
+
+// make room for one more entry, never evicting the current page
+static inline void evict(void)
+{
+    int i, victim = -1;
+
+    for (i = 0; i < nentries; i++) {
+        if (cache[i].pageno == curpage)
+            continue;
+        if (victim == -1 ||
+            (!in_window(cache[i].pageno) && in_window(cache[victim].pageno)) ||
+            (in_window(cache[i].pageno) == in_window(cache[victim].pageno) && cache[i].stamp < cache[victim].stamp))
+            victim = i;
+    }
+    if (victim == -1)
+        return;
+    DPRINTF("%s: releasing page %d\n", __FUNCTION__, cache[victim].pageno);
+    ddjvu_page_release(cache[victim].page);
+    cache[victim] = cache[--nentries];
+}
+
+static inline struct pagecache_entry *insert(int pageno)
+{
+    ddjvu_page_t *page;
+
+    // the number of pages isn't known before DOCINFO, see InitDoc()
+    if (pageno < 0 || (ddjvu_document_decoding_done(djvu_document) && pageno >= ddjvu_document_get_pagenum(djvu_document)))
+        return NULL;
+    while (nentries >= capacity() && nentries > 0)
+        evict();
+    if (nentries >= PAGECACHE_MAX)
+        return NULL;
+    page = ddjvu_page_create_by_pageno(djvu_document, pageno);
+    if (!page) {
+        DPRINTF("%s: ddjvu_page_create_by_pageno() page=%d failed\n", __FUNCTION__, pageno);
+        return NULL;
+    }
+    cache[nentries].pageno = pageno;
+    cache[nentries].page = page;
+    cache[nentries].stamp = ++lru_clock;
+    return &cache[nentries++];
+}
+
+// returns the handle for page "pageno", which becomes the current page
+ddjvu_page_t *pagecache_get(int pageno)
+{
+    struct pagecache_entry *e;
+
+    curpage = pageno;
+    if ((e = lookup(pageno))) {
+        pagecache_hits++;
+        e->stamp = ++lru_clock;
+        DPRINTF("%s(%d): hit\n", __FUNCTION__, pageno);
+        return e->page;
+    }
+    pagecache_misses++;
+    DPRINTF("%s(%d): miss\n", __FUNCTION__, pageno);
+    e = insert(pageno);
+    return e ? e->page : NULL;
+}
+
+// returns the handle for page "pageno" if we have it, NULL otherwise
+ddjvu_page_t *pagecache_peek(int pageno)
+{
+    struct pagecache_entry *e = lookup(pageno);
+    return e ? e->page : NULL;
+}
+
+// start decoding the pages around "pageno", nearest ones first
+void pagecache_prefetch(int pageno)
+{
+    int i, ahead, behind;
+
+    curpage = pageno;
+    clamp_window();
+    get_window(&ahead, &behind);
+    for (i = 1; i <= ahead || i <= behind; i++) {
+        if (i <= ahead && !lookup(pageno + i))
+            insert(pageno + i);
+        if (i <= behind && !lookup(pageno - i))
+            insert(pageno - i);
+    }
+}
+
+int pagecache_count(void)
+{
+    return nentries;
+}
+
+// release pages until what is left fits in pagecache_budget
+void pagecache_trim(void)
+{
+    int n = nentries + 1;
+
+    while (nentries > capacity() && nentries < n) {
+        n = nentries;
+        evict();
+    }
+}
+
+/*
+   A rough idea of the memory held by the decoded pages: the JB2 mask
+   about as much as a bitmap of the page, the IW44 layers 2 bytes per
+   coefficient for each of the 3 colour components, at a third of the
+   resolution for the background of a compound page.
+ */
+unsigned long pagecache_bytes(void)
+{
+    unsigned long pixels, bytes = 0;
+    int i;
+
+    for (i = 0; i < nentries; i++) {
+        if (ddjvu_page_get_width(cache[i].page) <= 0)
+            continue; // nothing decoded yet
+        pixels = (unsigned long)ddjvu_page_get_width(cache[i].page)*ddjvu_page_get_height(cache[i].page);
+        switch (ddjvu_page_get_type(cache[i].page)) {
+            case DDJVU_PAGETYPE_BITONAL:
+                bytes += pixels/8;
+                break;
+            case DDJVU_PAGETYPE_PHOTO:
+                bytes += pixels*6;
+                break;
+            default:
+                bytes += pixels/8 + pixels*6/9;
+                break;
+        }
+    }
+    return bytes;
+}
+
+void pagecache_clear(void)
+{
+    while (nentries > 0)
+        ddjvu_page_release(cache[--nentries].page);
+}
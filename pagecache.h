@@ -0,0 +1,20 @@
+#ifndef _PAGECACHE_H
+#define _PAGECACHE_H
+
+#define PAGECACHE_MAX   16  // hard limit on the number of page handles kept
+
+extern int pagecache_ahead, pagecache_behind, pagecache_budget;
+extern unsigned int pagecache_hits, pagecache_misses;
+
+extern ddjvu_page_t *pagecache_get(int);
+extern ddjvu_page_t *pagecache_peek(int);
+extern void pagecache_prefetch(int);
+extern int pagecache_count(void);
+extern void pagecache_trim(void);
+extern unsigned long pagecache_bytes(void);
+extern void pagecache_clear(void);
+
+// in libdjvu.c
+extern ddjvu_document_t *djvu_document;
+
+#endif
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+#
+# mkbook.sh - Make perf/book.djvu, a bundled document of JB2, IW44 and
+# compound pages, from the pages "mkcorpus -b" writes. Needs cjb2, c44,
+# djvuextract, djvumake and djvm of djvulibre.
+#
+# Usage: mkbook.sh mkcorpus out.djvu
+#
+
+for tool in cjb2 c44 djvuextract djvumake djvm
+do
+   type $tool > /dev/null 2>&1 || { echo "mkbook.sh: no $tool, djvulibre is needed"; exit 1; }
+done
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf $tmp' EXIT
+
+"$1" -b $tmp || exit 1
+pages=""
+while read page dpi
+do
+   cd $tmp
+   if [ -f $page.pbm ] && [ -f $page.pgm ]; then
+      # text over a picture: a JB2 mask, and the picture as an IW44
+      # background at a third of its resolution
+      cjb2 -dpi $dpi $page.pbm mask.djvu && djvuextract mask.djvu Sjbz=mask.jb2 &&
+      c44 -dpi $((dpi / 3)) $page.pgm bg.djvu && djvuextract bg.djvu BG44=bg.iw4 &&
+      djvumake $page.djvu INFO=$(head -2 $page.pbm | tail -1 | tr ' ' ,),$dpi \
+         Sjbz=mask.jb2 BG44=bg.iw4 || exit 1
+   elif [ -f $page.pbm ]; then
+      cjb2 -dpi $dpi $page.pbm $page.djvu || exit 1
+   else
+      c44 -dpi $dpi $page.pgm $page.djvu || exit 1
+   fi
+   cd - > /dev/null 2>&1
+   pages="$pages $tmp/$page.djvu"
+done < $tmp/book.txt
+
+djvm -c "$2" $pages
@@ -0,0 +1,543 @@
+/*
+ * mkcorpus.c Makes the documents of perf/ ("make perf-corpus")
+ *
+ * Draws a few pages of made up text, columns and tables in a made up
+ * script (glyphs built from strokes drawn from a fixed seed, so nothing
+ * is copied from anywhere) and writes each as a DjVu document of one
+ * bitonal page: an INFO chunk and the mask in an Smmr chunk, CCITT G4
+ * coded. That is the only DjVu coding which needs no ZP coder, and the
+ * reason the documents have a page each: the directory of a multi-page
+ * one is BZZ compressed. The output is the same on every run, and is in
+ * the public domain.
+ *
+ * The pages of book.djvu, a bundled document of JB2, IW44 and compound
+ * pages, are written with -b for perf/mkbook.sh, which codes them with
+ * the djvulibre tools: book-<n>.pbm for the text (the mask of a compound
+ * page), book-<n>.pgm for the picture (its background), and book.txt with
+ * a "<name> <dpi>" line for each page.
+ *
+ * Usage: mkcorpus [-p | -b] dir
+ *
+ *   -p  write each page as a PBM file too, to look at it
+ *   -b  write the pages of book.djvu instead
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#define GLYPHS 40
+
+// a byte a pixel, 1 is black
+struct bitmap {
+    int w, h, dpi;
+    unsigned char *p;
+};
+
+// the strokes of a glyph, in a box of its width and the x-height
+enum { STEM_LEFT = 1, STEM_RIGHT = 2, BAR_TOP = 4, BAR_MIDDLE = 8, BAR_BOTTOM = 16,
+       BOWL = 32, ASCENDER = 64, DESCENDER = 128, DIAGONAL = 256 };
+
+static struct {
+    int strokes, width; // width in tenths of the x-height
+} glyphs[GLYPHS];
+
+static unsigned int seed = 1;
+
+static int rnd(int n)
+{
+    seed = seed*1103515245 + 12345;
+    return (seed >> 16) % n;
+}
+
+static void make_glyphs(void)
+{
+    int i;
+
+    for (i = 0; i < GLYPHS; i++) {
+        do
+            glyphs[i].strokes = rnd(512);
+        while (!(glyphs[i].strokes & (STEM_LEFT | STEM_RIGHT | BOWL | DIAGONAL)));
+        glyphs[i].width = 6 + rnd(6);
+    }
+}
+
+static void fill_rect(struct bitmap *bm, int x0, int y0, int x1, int y1)
+{
+    int y;
+
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > bm->w ? bm->w : x1;
+    y1 = y1 > bm->h ? bm->h : y1;
+    for (y = y0; y < y1; y++)
+        if (x0 < x1)
+            memset(bm->p + (size_t)y*bm->w + x0, 1, x1 - x0);
+}
+
+static void line(struct bitmap *bm, int x0, int y0, int x1, int y1, int pen)
+{
+    int i, n = abs(x1 - x0) > abs(y1 - y0) ? abs(x1 - x0) : abs(y1 - y0);
+
+    for (i = 0; i <= n; i++) {
+        int x = x0 + (n ? (x1 - x0)*i/n : 0), y = y0 + (n ? (y1 - y0)*i/n : 0);
+        fill_rect(bm, x, y, x + pen, y + pen);
+    }
+}
+
+// an ellipse pen pixels thick in the box
+static void ring(struct bitmap *bm, int x0, int y0, int x1, int y1, int pen)
+{
+    double cx = (x0 + x1)/2.0, cy = (y0 + y1)/2.0, rx = (x1 - x0)/2.0, ry = (y1 - y0)/2.0, d, e;
+    int x, y;
+
+    for (y = y0; y < y1; y++)
+        for (x = x0; x < x1; x++) {
+            d = (x + 0.5 - cx)*(x + 0.5 - cx)/(rx*rx) + (y + 0.5 - cy)*(y + 0.5 - cy)/(ry*ry);
+            e = (x + 0.5 - cx)*(x + 0.5 - cx)/((rx - pen)*(rx - pen)) + (y + 0.5 - cy)*(y + 0.5 - cy)/((ry - pen)*(ry - pen));
+            if (d <= 1 && (rx <= pen || ry <= pen || e >= 1) && x >= 0 && y >= 0 && x < bm->w && y < bm->h)
+                bm->p[(size_t)y*bm->w + x] = 1;
+        }
+}
+
+// glyph g on the baseline at x, returns its advance
+static int draw_glyph(struct bitmap *bm, int x, int base, int g, int xh)
+{
+    int s = glyphs[g].strokes, w = glyphs[g].width*xh/10, top = base - xh, pen = xh/7 ? xh/7 : 1;
+
+    if (s & STEM_LEFT)
+        fill_rect(bm, x, s & ASCENDER ? top - xh/2 : top, x + pen, base);
+    if (s & STEM_RIGHT)
+        fill_rect(bm, x + w - pen, top, x + w, s & DESCENDER ? base + xh/2 : base);
+    if (s & BAR_TOP)
+        fill_rect(bm, x, top, x + w, top + pen);
+    if (s & BAR_MIDDLE)
+        fill_rect(bm, x, top + (xh - pen)/2, x + w, top + (xh + pen)/2);
+    if (s & BAR_BOTTOM)
+        fill_rect(bm, x, base - pen, x + w, base);
+    if (s & BOWL)
+        ring(bm, x, top, x + w, base, pen);
+    if (s & DIAGONAL)
+        line(bm, x, base - pen, x + w - pen, top, pen);
+    return w + xh/4;
+}
+
+/*
+   Words of made up text from (x, y) between x0 and x1, lines lead apart,
+   until nwords words are set or y1 is reached. Returns the baseline after
+   the last line.
+ */
+static int paragraph(struct bitmap *bm, int x0, int x1, int y, int y1, int xh, int lead, int nwords)
+{
+    int x = x0 + 2*xh, len, i, w, word[12];
+
+    y += xh;
+    while (nwords-- > 0 && y < y1) {
+        len = 1 + rnd(9);
+        for (i = w = 0; i < len; i++) {
+            word[i] = rnd(GLYPHS);
+            w += glyphs[word[i]].width*xh/10 + xh/4;
+        }
+        if (x + w > x1 && x > x0) {
+            x = x0;
+            if ((y += lead) >= y1)
+                break;
+        }
+        for (i = 0; i < len; i++)
+            x += draw_glyph(bm, x, y, word[i], xh);
+        x += xh/2;
+    }
+    return y + lead;
+}
+
+static void heading(struct bitmap *bm, int x, int y, int xh, int len)
+{
+    while (len-- > 0)
+        x += draw_glyph(bm, x, y + xh, rnd(GLYPHS), xh);
+}
+
+static void page_number(struct bitmap *bm, int n, int xh)
+{
+    int g = 1 + n % (GLYPHS - 1);
+
+    draw_glyph(bm, (bm->w - glyphs[g].width*xh/10)/2, bm->h - bm->dpi*3/4, g, xh);
+}
+
+// a letter page of one column at 300 dpi
+static void text_page(struct bitmap *bm)
+{
+    int margin = bm->dpi, y = bm->dpi + bm->dpi/3, xh = bm->dpi/15;
+
+    heading(bm, margin, bm->dpi, 2*xh, 12);
+    while (y < bm->h - bm->dpi*5/4)
+        y = paragraph(bm, margin, bm->w - margin, y, bm->h - bm->dpi*5/4, xh, 3*xh, 40 + rnd(120)) + xh;
+    page_number(bm, 1, xh);
+}
+
+// two columns, a figure at the top of the first
+static void columns_page(struct bitmap *bm)
+{
+    int margin = bm->dpi*3/4, gap = bm->dpi/3, xh = bm->dpi/16, col = (bm->w - 2*margin - gap)/2;
+    int x, y, top = bm->dpi, bottom = bm->h - bm->dpi*5/4, fig = top + col*3/4, pen = bm->dpi/100;
+
+    // the figure: a frame, a circle, a curve through it and its caption
+    line(bm, margin, top, margin + col, top, pen);
+    line(bm, margin, fig, margin + col, fig, pen);
+    line(bm, margin, top, margin, fig, pen);
+    line(bm, margin + col, top, margin + col, fig + pen, pen);
+    ring(bm, margin + col/4, top + col/8, margin + col*3/4, top + col*5/8, 2*pen);
+    for (x = 0; x < col - 2*pen; x += 4)
+        fill_rect(bm, margin + x, top + col*3/8 + (int)(col/4*sin(x*6.283/col)),
+                  margin + x + 4, top + col*3/8 + (int)(col/4*sin(x*6.283/col)) + 2*pen);
+    y = paragraph(bm, margin + col/8, margin + col - col/8, fig + xh, bottom, xh*3/4, 2*xh, 12);
+    for (x = margin; x < bm->w - margin; x += col + gap) {
+        for (; y < bottom; y += xh)
+            y = paragraph(bm, x, x + col, y, bottom, xh, 3*xh, 30 + rnd(90));
+        y = top;
+    }
+    page_number(bm, 2, xh);
+}
+
+// a landscape page at 150 dpi with a ruled table
+static void table_page(struct bitmap *bm)
+{
+    int margin = bm->dpi/2, xh = bm->dpi/12, rows = 14, cols = 6, pen = 2, r, c;
+    int top = margin + 3*xh, w = bm->w - 2*margin, h = bm->h - top - margin - 2*xh;
+
+    heading(bm, margin, margin, 2*xh, 8);
+    for (r = 0; r <= rows; r++)
+        fill_rect(bm, margin, top + r*h/rows, margin + w + pen, top + r*h/rows + (r < 2 ? 2*pen : pen));
+    for (c = 0; c <= cols; c++)
+        fill_rect(bm, margin + c*w/cols, top, margin + c*w/cols + pen, top + h + pen);
+    for (r = 0; r < rows; r++)
+        for (c = 0; c < cols; c++)
+            heading(bm, margin + c*w/cols + xh/2, top + r*h/rows + (h/rows - xh)/2,
+                    r ? xh : xh*5/4, 1 + rnd(c ? 5 : 9));
+}
+
+// a photo-like picture, gray levels 0 (black) to 255
+static void picture(unsigned char *p, int w, int h)
+{
+    double cx[6], cy[6], r[6], v;
+    int i, x, y;
+
+    for (i = 0; i < 6; i++) {
+        cx[i] = rnd(w);
+        cy[i] = rnd(h);
+        r[i] = (w < h ? w : h)/8 + rnd((w < h ? w : h)/4);
+    }
+    for (y = 0; y < h; y++)
+        for (x = 0; x < w; x++) {
+            v = 200 - 120.0*y/h + 30*sin(x*12.0/w)*cos(y*9.0/h);
+            for (i = 0; i < 6; i++)
+                if ((x - cx[i])*(x - cx[i]) + (y - cy[i])*(y - cy[i]) < r[i]*r[i])
+                    v -= 40 + 10*i;
+            v += rnd(17) - 8;
+            p[(size_t)y*w + x] = v < 0 ? 0 : v > 255 ? 255 : v;
+        }
+}
+
+/* CCITT T.4 codes, for runs of white and of black */
+
+static const char *white_codes[64] = {
+    "00110101", "000111", "0111", "1000", "1011", "1100", "1110", "1111",
+    "10011", "10100", "00111", "01000", "001000", "000011", "110100", "110101",
+    "101010", "101011", "0100111", "0001100", "0001000", "0010111", "0000011", "0000100",
+    "0101000", "0101011", "0010011", "0100100", "0011000", "00000010", "00000011", "00011010",
+    "00011011", "00010010", "00010011", "00010100", "00010101", "00010110", "00010111", "00101000",
+    "00101001", "00101010", "00101011", "00101100", "00101101", "00000100", "00000101", "00001010",
+    "00001011", "01010010", "01010011", "01010100", "01010101", "00100100", "00100101", "01011000",
+    "01011001", "01011010", "01011011", "01001010", "01001011", "00110010", "00110011", "00110100"
+};
+
+static const char *black_codes[64] = {
+    "0000110111", "010", "11", "10", "011", "0011", "0010", "00011",
+    "000101", "000100", "0000100", "0000101", "0000111", "00000100", "00000111", "000011000",
+    "0000010111", "0000011000", "0000001000", "00001100111", "00001101000", "00001101100", "00000110111", "00000101000",
+    "00000010111", "00000011000", "000011001010", "000011001011", "000011001100", "000011001101", "000001101000", "000001101001",
+    "000001101010", "000001101011", "000011010010", "000011010011", "000011010100", "000011010101", "000011010110", "000011010111",
+    "000001101100", "000001101101", "000011011010", "000011011011", "000001010100", "000001010101", "000001010110", "000001010111",
+    "000001100100", "000001100101", "000001010010", "000001010011", "000000100100", "000000110111", "000000111000", "000000100111",
+    "000000101000", "000001011000", "000001011001", "000000101011", "000000101100", "000001011010", "000001100110", "000001100111"
+};
+
+// runs of 64 to 1728, a multiple of 64 each
+static const char *white_makeup[27] = {
+    "11011", "10010", "010111", "0110111", "00110110", "00110111", "01100100", "01100101",
+    "01101000", "01100111", "011001100", "011001101", "011010010", "011010011", "011010100", "011010101",
+    "011010110", "011010111", "011011000", "011011001", "011011010", "011011011", "010011000", "010011001",
+    "010011010", "011000", "010011011"
+};
+
+static const char *black_makeup[27] = {
+    "0000001111", "000011001000", "000011001001", "000001011011", "000000110011", "000000110100", "000000110101", "0000001101100",
+    "0000001101101", "0000001001010", "0000001001011", "0000001001100", "0000001001101", "0000001110010", "0000001110011", "0000001110100",
+    "0000001110101", "0000001110110", "0000001110111", "0000001010010", "0000001010011", "0000001010100", "0000001010101", "0000001011010",
+    "0000001011011", "0000001100100", "0000001100101"
+};
+
+// of either colour, 1792 to 2560
+static const char *long_makeup[13] = {
+    "00000001000", "00000001100", "00000001101", "000000010010", "000000010011", "000000010100", "000000010101",
+    "000000010110", "000000010111", "000000011100", "000000011101", "000000011110", "000000011111"
+};
+
+static struct {
+    unsigned char *buf;
+    size_t len, size;
+    int nbits;
+} out;
+
+static void put_bits(const char *code)
+{
+    void *p;
+
+    for (; *code; code++) {
+        if (!out.nbits) {
+            if (out.len == out.size) {
+                out.size = out.size ? 2*out.size : 65536;
+                if (!(p = realloc(out.buf, out.size))) {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+                out.buf = p;
+            }
+            out.buf[out.len++] = 0;
+        }
+        if (*code == '1')
+            out.buf[out.len - 1] |= 0x80 >> out.nbits;
+        out.nbits = (out.nbits + 1) & 7;
+    }
+}
+
+static void put_run(unsigned int run, int black)
+{
+    unsigned int m;
+
+    while (run >= 2624) {
+        put_bits(long_makeup[12]);
+        run -= 2560;
+    }
+    if ((m = run/64) >= 28)
+        put_bits(long_makeup[m - 28]);
+    else if (m > 0)
+        put_bits((black ? black_makeup : white_makeup)[m - 1]);
+    put_bits((black ? black_codes : white_codes)[run % 64]);
+}
+
+// the first changing element of colour after a0 on row, w if there is none
+static int next_change(const unsigned char *row, int w, int a0, int colour)
+{
+    int x;
+
+    for (x = a0 < 0 ? 0 : a0 + 1; x < w; x++)
+        if (row[x] == colour && row[x] != (x ? row[x - 1] : 0))
+            return x;
+    return w;
+}
+
+// the page in out.buf, G4 coded (ITU-T T.6), 0 is white
+static void encode_g4(const struct bitmap *bm)
+{
+    static const char *vertical[7] = { "0000010", "000010", "010", "1", "011", "000011", "0000011" };
+    unsigned char *white = calloc(bm->w, 1);
+    const unsigned char *ref = white, *row;
+    int y, a0, a1, a2, b1, b2, colour;
+
+    out.len = out.nbits = 0;
+    for (y = 0; y < bm->h; y++, ref = row) {
+        row = bm->p + (size_t)y*bm->w;
+        for (a0 = -1, colour = 0; a0 < bm->w; ) {
+            a1 = next_change(row, bm->w, a0, !colour);
+            b1 = next_change(ref, bm->w, a0, !colour);
+            b2 = next_change(ref, bm->w, b1, colour);
+            if (b2 < a1) {
+                put_bits("0001");
+                a0 = b2;
+            } else if (abs(a1 - b1) <= 3) {
+                put_bits(vertical[a1 - b1 + 3]);
+                a0 = a1;
+                colour = !colour;
+            } else {
+                a2 = next_change(row, bm->w, a1, colour);
+                put_bits("001");
+                put_run(a1 - (a0 < 0 ? 0 : a0), colour);
+                put_run(a2 - a1, !colour);
+                a0 = a2;
+            }
+        }
+    }
+    put_bits("000000000001000000000001");
+    free(white);
+}
+
+static void put32(FILE *fp, unsigned int n)
+{
+    putc(n >> 24, fp);
+    putc(n >> 16, fp);
+    putc(n >> 8, fp);
+    putc(n, fp);
+}
+
+static int write_djvu(const char *path, const struct bitmap *bm)
+{
+    // width, height, version 24, dpi (little endian), gamma 2.2, not rotated
+    unsigned char info[10] = { bm->w >> 8, bm->w, bm->h >> 8, bm->h, 24, 0, bm->dpi, bm->dpi >> 8, 22, 1 };
+    unsigned char mmr[8] = { 'M', 'M', 'R', 0, bm->w >> 8, bm->w, bm->h >> 8, bm->h };
+    size_t size;
+    FILE *fp;
+
+    encode_g4(bm);
+    size = sizeof(mmr) + out.len;
+    if (!(fp = fopen(path, "wb")))
+        return 0;
+    fwrite("AT&TFORM", 1, 8, fp);
+    put32(fp, 4 + 8 + sizeof(info) + 8 + size + (size & 1));
+    fwrite("DJVUINFO", 1, 8, fp);
+    put32(fp, sizeof(info));
+    fwrite(info, 1, sizeof(info), fp);
+    fwrite("Smmr", 1, 4, fp);
+    put32(fp, size);
+    fwrite(mmr, 1, sizeof(mmr), fp);
+    fwrite(out.buf, 1, out.len, fp);
+    if (size & 1)
+        putc(0, fp);
+    return fclose(fp) == 0;
+}
+
+static int write_pbm(const char *path, const struct bitmap *bm)
+{
+    int x, y, byte;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "wb")))
+        return 0;
+    fprintf(fp, "P4\n%d %d\n", bm->w, bm->h);
+    for (y = 0; y < bm->h; y++)
+        for (x = byte = 0; x < bm->w; x++) {
+            byte |= bm->p[(size_t)y*bm->w + x] << (7 - (x & 7));
+            if ((x & 7) == 7 || x == bm->w - 1) {
+                putc(byte, fp);
+                byte = 0;
+            }
+        }
+    return fclose(fp) == 0;
+}
+
+static int write_pgm(const char *path, const unsigned char *p, int w, int h)
+{
+    FILE *fp;
+
+    if (!(fp = fopen(path, "wb")))
+        return 0;
+    fprintf(fp, "P5\n%d %d\n255\n", w, h);
+    fwrite(p, 1, (size_t)w*h, fp);
+    return fclose(fp) == 0;
+}
+
+/*
+   The pages of book.djvu in dir: text and columns pages, a photo, a
+   compound page (text over a picture at a third of its resolution) and a
+   table. Returns 0 if one can't be written.
+ */
+static int write_book(const char *dir)
+{
+    static const struct {
+        int w, h, dpi;
+        void (*draw)(struct bitmap *); // NULL for a photo
+        int picture;                   // the text is over a picture
+    } pages[] = {
+        { 2550, 3300, 300, text_page, 0 },
+        { 2550, 3300, 300, columns_page, 0 },
+        { 1275, 1650, 150, NULL, 1 },
+        { 2550, 3300, 300, text_page, 1 },
+        { 1650, 1275, 150, table_page, 0 },
+        { 2550, 3300, 300, columns_page, 0 },
+        { 2550, 3300, 300, text_page, 0 },
+        { 2550, 3300, 300, text_page, 0 },
+    };
+    char path[PATH_MAX];
+    struct bitmap bm;
+    unsigned char *pic;
+    FILE *list;
+    int i, ok = 1, w, h;
+
+    snprintf(path, sizeof(path), "%s/book.txt", dir);
+    if (!(list = fopen(path, "w")))
+        return 0;
+    for (i = 0; ok && i < (int)(sizeof(pages)/sizeof(pages[0])); i++) {
+        bm.w = pages[i].w;
+        bm.h = pages[i].h;
+        bm.dpi = pages[i].dpi;
+        w = pages[i].draw ? (bm.w + 2)/3 : bm.w;
+        h = pages[i].draw ? (bm.h + 2)/3 : bm.h;
+        if (!(bm.p = calloc((size_t)bm.w*bm.h, 1)) || !(pic = malloc((size_t)w*h))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        fprintf(list, "book-%d %d\n", i + 1, bm.dpi);
+        if (pages[i].draw) {
+            pages[i].draw(&bm);
+            snprintf(path, sizeof(path), "%s/book-%d.pbm", dir, i + 1);
+            ok = write_pbm(path, &bm);
+        }
+        if (ok && pages[i].picture) {
+            picture(pic, w, h);
+            snprintf(path, sizeof(path), "%s/book-%d.pgm", dir, i + 1);
+            ok = write_pgm(path, pic, w, h);
+        }
+        if (!ok)
+            perror(path);
+        free(bm.p);
+        free(pic);
+    }
+    return fclose(list) == 0 && ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+        const char *name;
+        int w, h, dpi;
+        void (*draw)(struct bitmap *);
+    } pages[] = {
+        { "text", 2550, 3300, 300, text_page },
+        { "columns", 2550, 3300, 300, columns_page },
+        { "table", 1650, 1275, 150, table_page },
+    };
+    char path[PATH_MAX];
+    struct bitmap bm;
+    int i, pbm = argc > 1 && !strcmp(argv[1], "-p"), book = argc > 1 && !strcmp(argv[1], "-b");
+
+    if (argc != 2 + pbm + book) {
+        fprintf(stderr, "usage: mkcorpus [-p | -b] dir\n");
+        return 2;
+    }
+    make_glyphs();
+    if (book)
+        return !write_book(argv[2]);
+    for (i = 0; i < (int)(sizeof(pages)/sizeof(pages[0])); i++) {
+        bm.w = pages[i].w;
+        bm.h = pages[i].h;
+        bm.dpi = pages[i].dpi;
+        if (!(bm.p = calloc((size_t)bm.w*bm.h, 1))) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        pages[i].draw(&bm);
+        snprintf(path, sizeof(path), "%s/%s.djvu", argv[1 + pbm], pages[i].name);
+        if (!write_djvu(path, &bm)) {
+            perror(path);
+            return 1;
+        }
+        snprintf(path, sizeof(path), "%s/%s.pbm", argv[1 + pbm], pages[i].name);
+        if (pbm && !write_pbm(path, &bm)) {
+            perror(path);
+            return 1;
+        }
+        free(bm.p);
+    }
+    return 0;
+}
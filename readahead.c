@@ -0,0 +1,386 @@
+/*
+ * readahead.c Page-aware readahead of documents for libdjvu
+ *
+ * djvulibre reads a page of a bundled document in many small pieces,
+ * each a separate trip to the SD card, and only when the page is being
+ * decoded. The document file is mapped and the offsets of its components
+ * read straight from the directory (the DIRM chunk at the start of the
+ * file, the offsets are not compressed). Knowing where each page is, we
+ * ask the kernel with posix_madvise() to read the whole of the page
+ * about to be decoded in one go, and the pages likely to be read next
+ * while the reader is still on this one. djvulibre then finds them in
+ * the page cache.
+ *
+ * The mapping is advised rather than the file with posix_fadvise(),
+ * which older kernels don't have.
+ *
+ * In an indirect document every page is a file of its own, next to the
+ * index file, and so are the shared dictionaries its pages include. A
+ * thread reads the files of the pages around the current one, and the
+ * files they include, from a short queue which is replaced on every page
+ * turn so that it never lags behind the reader.
+ *
+ * Nothing is done for single page documents.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "readahead.h"
+#include "debug.h"
+
+#define READAHEAD_CHUNK 65536  // read() size for the files of indirect documents
+#define READAHEAD_INCL  8      // at most this many INCL chunks looked at in a page
+
+static struct {
+    int state; // 0 until the pages are found, 1 if we can read ahead, -1 if not
+    int last_page, last_dir; // what we were last asked for
+    int nfiles, npages;
+    // bundled documents
+    unsigned char *map;
+    size_t size;
+    unsigned int *file_offset; // from the directory, -> "FORM" of each component
+    unsigned int *page_offset, *page_size; // by page number, once we know which component is which
+    // indirect documents
+    char *dir;
+    char **file_id;
+    int *page_file; // by page number, -1 if unknown
+    unsigned char *file_done; // read (and so probably still in the page cache)
+} ra = { .last_page = -1 };
+
+/* the reader thread of indirect documents */
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running, quit;
+    int queue[READAHEAD_QUEUE], nqueued; // file numbers, the first one is read next
+} io = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static inline unsigned int get32(const unsigned char *p)
+{
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+   Map "filename" and read the offsets of its components if it is a
+   bundled document. Which pages these are, and everything about other
+   kinds of documents, waits for djvulibre to decode the directory.
+ */
+int readahead_open(const char *filename)
+{
+    struct stat st;
+    const unsigned char *p;
+    char *name;
+    int fd, i;
+
+    readahead_close();
+    if ((name = strdup(filename))) {
+        ra.dir = strdup(dirname(name));
+        free(name);
+    }
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return 0;
+    if (fstat(fd, &st) == -1 || st.st_size < 27) {
+        (void)close(fd);
+        return 0;
+    }
+    ra.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    (void)close(fd); // the mapping keeps the file open
+    if (ra.map == MAP_FAILED) {
+        DPRINTF("%s: can't map %s\n", __FUNCTION__, filename);
+        ra.map = NULL;
+        return 0;
+    }
+    ra.size = st.st_size;
+    // AT&T FORM size DJVM DIRM size flags nfiles offsets...
+    p = ra.map;
+    if (memcmp(p, "AT&TFORM", 8) || memcmp(p + 12, "DJVMDIRM", 8) || !(p[24] & 0x80) ||
+        (ra.nfiles = (p[25] << 8) | p[26]) <= 0 || 27 + 4*(size_t)ra.nfiles > ra.size ||
+        !(ra.file_offset = malloc(ra.nfiles*sizeof(*ra.file_offset)))) {
+        // not bundled, nothing to map
+        (void)munmap(ra.map, ra.size);
+        ra.map = NULL;
+        ra.nfiles = 0;
+        return 1;
+    }
+    for (i = 0; i < ra.nfiles; i++)
+        ra.file_offset[i] = get32(p + 27 + 4*i);
+    DPRINTF("%s: %d components in %s\n", __FUNCTION__, ra.nfiles, filename);
+    return 1;
+}
+
+static inline void io_stop(void)
+{
+    if (!io.running)
+        return;
+    pthread_mutex_lock(&io.lock);
+    io.quit = 1;
+    pthread_cond_broadcast(&io.cond);
+    pthread_mutex_unlock(&io.lock);
+    pthread_join(io.thread, NULL);
+    io.running = io.quit = io.nqueued = 0;
+}
+
+void readahead_close(void)
+{
+    int i;
+
+    io_stop();
+    if (ra.map)
+        (void)munmap(ra.map, ra.size);
+    for (i = 0; i < ra.nfiles; i++) {
+        if (ra.file_id)
+            free(ra.file_id[i]);
+    }
+    free(ra.file_offset);
+    free(ra.page_offset);
+    free(ra.page_size);
+    free(ra.file_id);
+    free(ra.page_file);
+    free(ra.file_done);
+    free(ra.dir);
+    memset(&ra, 0, sizeof(ra));
+    ra.last_page = -1;
+}
+
+/*
+   Read file number f of an indirect document, leaving its first
+   READAHEAD_CHUNK bytes in buf. djvulibre opens it by its id (the load
+   name), which may differ from its name (the save name).
+ */
+static int read_file(int f, unsigned char *buf)
+{
+    char path[512];
+    int fd, n, total = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", ra.dir, ra.file_id[f]);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        DPRINTF("%s: can't open %s\n", __FUNCTION__, path);
+        return 0;
+    }
+    while ((n = read(fd, total ? buf + READAHEAD_CHUNK : buf, READAHEAD_CHUNK)) > 0)
+        total += n;
+    (void)close(fd);
+    DPRINTF("%s: %s, %d bytes\n", __FUNCTION__, ra.file_id[f], total);
+    return total;
+}
+
+// put the file numbers of what the page in buf includes in incl[], returns how many
+static int find_includes(const unsigned char *buf, int n, int *incl)
+{
+    unsigned int pos, len;
+    int i, count = 0;
+
+    // AT&T FORM size DJVU, then the chunks: id size data (padded to even)
+    if (n > READAHEAD_CHUNK)
+        n = READAHEAD_CHUNK;
+    if (n < 16 || memcmp(buf, "AT&TFORM", 8) || memcmp(buf + 12, "DJVU", 4))
+        return 0;
+    for (pos = 16; pos + 8 <= n && count < READAHEAD_INCL; pos += 8 + len + (len & 1)) {
+        len = get32(buf + pos + 4);
+        if (len > n - pos - 8)
+            break; // the INCL chunks come before the big ones
+        if (memcmp(buf + pos, "INCL", 4))
+            continue;
+        for (i = 0; i < ra.nfiles; i++)
+            if (ra.file_id[i] && strlen(ra.file_id[i]) == len && !memcmp(ra.file_id[i], buf + pos + 8, len)) {
+                incl[count++] = i;
+                break;
+            }
+    }
+    return count;
+}
+
+static void *io_thread(void *arg)
+{
+    static unsigned char buf[2*READAHEAD_CHUNK];
+    int incl[READAHEAD_INCL], f, n, i;
+
+    pthread_mutex_lock(&io.lock);
+    while (!io.quit) {
+        if (!io.nqueued) {
+            pthread_cond_wait(&io.cond, &io.lock);
+            continue;
+        }
+        f = io.queue[0];
+        memmove(io.queue, io.queue + 1, --io.nqueued*sizeof(io.queue[0]));
+        if (ra.file_done[f])
+            continue;
+        pthread_mutex_unlock(&io.lock);
+        n = find_includes(buf, read_file(f, buf), incl);
+        pthread_mutex_lock(&io.lock);
+        ra.file_done[f] = 1;
+        // the page can't be decoded without its shared dictionaries
+        for (i = 0; i < n && !io.quit; i++)
+            if (!ra.file_done[incl[i]]) {
+                pthread_mutex_unlock(&io.lock);
+                (void)read_file(incl[i], buf);
+                pthread_mutex_lock(&io.lock);
+                ra.file_done[incl[i]] = 1;
+            }
+    }
+    pthread_mutex_unlock(&io.lock);
+    return NULL;
+}
+
+/*
+   Find the component of each page. Only the (compressed) part of the
+   directory djvulibre has decoded for us says which components are
+   pages, so this has to wait until the document has been decoded.
+ */
+static int map_bundled(void)
+{
+    ddjvu_fileinfo_t fi;
+    unsigned int end;
+    int i;
+
+    if (!ra.map || ddjvu_document_get_filenum(djvu_document) != ra.nfiles)
+        return 0;
+    ra.page_offset = calloc(ra.npages, sizeof(*ra.page_offset));
+    ra.page_size = calloc(ra.npages, sizeof(*ra.page_size));
+    if (!ra.page_offset || !ra.page_size)
+        return 0;
+    for (i = 0; i < ra.nfiles; i++) {
+        if (ddjvu_document_get_fileinfo(djvu_document, i, &fi) != DDJVU_JOB_OK ||
+            fi.type != 'P' || fi.pageno < 0 || fi.pageno >= ra.npages || ra.file_offset[i] >= ra.size)
+            continue;
+        // components follow each other in the file, in the order of the directory
+        end = i + 1 < ra.nfiles && ra.file_offset[i + 1] > ra.file_offset[i] ? ra.file_offset[i + 1] : ra.size;
+        if (fi.size > 0 && ra.file_offset[i] + 8 + fi.size < end)
+            end = ra.file_offset[i] + 8 + fi.size;
+        ra.page_offset[fi.pageno] = ra.file_offset[i];
+        ra.page_size[fi.pageno] = end - ra.file_offset[i];
+    }
+    return 1;
+}
+
+// the same for the files of an indirect document, and start the thread which reads them
+static int map_indirect(void)
+{
+    ddjvu_fileinfo_t fi;
+    int i;
+
+    ra.nfiles = ddjvu_document_get_filenum(djvu_document);
+    if (!ra.dir || ra.nfiles <= 0)
+        return 0;
+    ra.file_id = calloc(ra.nfiles, sizeof(*ra.file_id));
+    ra.file_done = calloc(ra.nfiles, 1);
+    ra.page_file = malloc(ra.npages*sizeof(*ra.page_file));
+    if (!ra.file_id || !ra.file_done || !ra.page_file)
+        return 0;
+    for (i = 0; i < ra.npages; i++)
+        ra.page_file[i] = -1;
+    for (i = 0; i < ra.nfiles; i++) {
+        if (ddjvu_document_get_fileinfo(djvu_document, i, &fi) != DDJVU_JOB_OK || !fi.id ||
+            !(ra.file_id[i] = strdup(fi.id))) {
+            ra.file_done[i] = 1; // can't be read anyway
+            continue;
+        }
+        if (fi.type == 'P' && fi.pageno >= 0 && fi.pageno < ra.npages)
+            ra.page_file[fi.pageno] = i;
+    }
+    if (pthread_create(&io.thread, NULL, io_thread, NULL)) {
+        DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+        return 0;
+    }
+    io.running = 1;
+    return 1;
+}
+
+// returns 1 if we can read ahead, 0 if we don't know yet, -1 if we can't
+static int map_pages(void)
+{
+    int ok;
+
+    if (!ddjvu_document_decoding_done(djvu_document))
+        return 0;
+    ra.npages = ddjvu_document_get_pagenum(djvu_document);
+    switch (ddjvu_document_get_type(djvu_document)) {
+        case DDJVU_DOCTYPE_BUNDLED:
+            ok = map_bundled();
+            break;
+        case DDJVU_DOCTYPE_INDIRECT:
+            ok = map_indirect();
+            break;
+        default:
+            ok = 0;
+            break;
+    }
+    if (ok)
+        return 1;
+    DPRINTF("%s: no readahead for this document\n", __FUNCTION__);
+    readahead_close();
+    return -1;
+}
+
+static inline void advise(int pageno)
+{
+    unsigned long pagesize = sysconf(_SC_PAGESIZE);
+    unsigned long start, end;
+
+    if (pageno < 0 || pageno >= ra.npages || !ra.page_size[pageno])
+        return;
+    start = ra.page_offset[pageno] & ~(pagesize - 1);
+    end = ra.page_offset[pageno] + ra.page_size[pageno];
+    if (posix_madvise(ra.map + start, end - start, POSIX_MADV_WILLNEED))
+        DPRINTF("%s: posix_madvise() failed on page %d\n", __FUNCTION__, pageno);
+}
+
+// add the file of page pageno to the reader's queue, called with io.lock held
+static inline void enqueue(int pageno)
+{
+    int f;
+
+    if (pageno < 0 || pageno >= ra.npages || io.nqueued == READAHEAD_QUEUE)
+        return;
+    f = ra.page_file[pageno];
+    if (f >= 0 && !ra.file_done[f])
+        io.queue[io.nqueued++] = f;
+}
+
+/*
+   Have page pageno read in, then the next "ahead" pages in the direction
+   of reading (dir is +1 or -1) and "behind" pages the other way.
+ */
+void readahead_pages(int pageno, int dir, int ahead, int behind)
+{
+    int i;
+
+    if (!ra.state)
+        ra.state = map_pages();
+    if (ra.state <= 0)
+        return;
+    if (pageno == ra.last_page && dir == ra.last_dir)
+        return;
+    ra.last_page = pageno;
+    ra.last_dir = dir;
+    if (ra.map) {
+        advise(pageno);
+        for (i = 1; i <= ahead; i++)
+            advise(pageno + dir*i);
+        for (i = 1; i <= behind; i++)
+            advise(pageno - dir*i);
+        return;
+    }
+    // whatever is still queued was for where the reader was before
+    pthread_mutex_lock(&io.lock);
+    io.nqueued = 0;
+    enqueue(pageno);
+    for (i = 1; i <= ahead; i++)
+        enqueue(pageno + dir*i);
+    for (i = 1; i <= behind; i++)
+        enqueue(pageno - dir*i);
+    pthread_cond_broadcast(&io.cond);
+    pthread_mutex_unlock(&io.lock);
+}
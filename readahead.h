@@ -0,0 +1,13 @@
+#ifndef _READAHEAD_H
+#define _READAHEAD_H
+
+#define READAHEAD_QUEUE 8  // files of an indirect document waiting to be read, at most
+
+extern int readahead_open(const char *);
+extern void readahead_close(void);
+extern void readahead_pages(int, int, int, int);
+
+// in libdjvu.c
+extern ddjvu_document_t *djvu_document;
+
+#endif
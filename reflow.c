@@ -0,0 +1,457 @@
+/*
+ * reflow.c Reflow mode of libdjvu
+ *
+ * The words of a page are taken from its hidden text layer
+ * (ddjvu_document_get_pagetext() at "word" detail), cut out of the page
+ * rendered at the reflow scale and set again, in reading order, into
+ * lines as wide as the screen. A new paragraph starts on a new line. The
+ * result is a few whole screens per page, in the format of the frames
+ * handed to the viewer, so that showing one of them is a single copy.
+ *
+ * A background thread does the current page first, then the next and
+ * the previous one in the direction of reading, and keeps REFLOW_PAGES
+ * of them. Pages without a text layer are left for libdjvu.c to show as
+ * they are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <libdjvu/miniexp.h>
+#include <libdjvu/ddjvuapi.h>
+
+#include "reflow.h"
+#include "debug.h"
+
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#define max(a,b) (((a)>(b))?(a):(b))
+#endif
+
+enum { REFLOW_EMPTY, REFLOW_BUSY, REFLOW_DONE, REFLOW_NO_TEXT };
+
+struct reflowed {
+    int page, zoom, state, nscreens;
+    unsigned char *screens; // nscreens frames one after the other
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running, quit, npages, width, height, frame_bytes;
+    int zoom, want[REFLOW_PAGES]; // the page being read first, -1 for none
+    struct reflowed pages[REFLOW_PAGES];
+} reflow = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/*
+   The text of the page being reflowed, only used by the thread. Boxes are
+   top down, in page pixels while collecting and at the reflow scale once
+   scaled.
+ */
+struct box {
+    int x0, y0, x1, y1;
+};
+
+static struct word {
+    struct box box;
+    int line, para; // index in lines[], first word of a paragraph
+    int screen, x, y; // where it goes
+} words[REFLOW_MAX_WORDS];
+static struct box lines[REFLOW_MAX_WORDS];
+static int nwords, nlines, new_para;
+
+// the page p at the reflow zoom, NULL if we don't have it
+static struct reflowed *find(int p, int zoom)
+{
+    int i;
+
+    for (i = 0; i < REFLOW_PAGES; i++)
+        if (reflow.pages[i].state != REFLOW_EMPTY && reflow.pages[i].page == p && reflow.pages[i].zoom == zoom)
+            return &reflow.pages[i];
+    return NULL;
+}
+
+// the page to reflow next, -1 if there is none
+static int next_page(void)
+{
+    int i;
+
+    for (i = 0; i < REFLOW_PAGES; i++)
+        if (reflow.want[i] >= 0 && !find(reflow.want[i], reflow.zoom))
+            return reflow.want[i];
+    return -1;
+}
+
+// a slot for a new page: one with a page nobody wants any more
+static struct reflowed *free_slot(void)
+{
+    struct reflowed *rp;
+    int i, j;
+
+    for (i = 0; i < REFLOW_PAGES; i++) {
+        rp = &reflow.pages[i];
+        if (rp->state == REFLOW_EMPTY)
+            return rp;
+        if (rp->state == REFLOW_BUSY)
+            continue;
+        for (j = 0; j < REFLOW_PAGES; j++)
+            if (rp->page == reflow.want[j] && rp->zoom == reflow.zoom)
+                break;
+        if (j == REFLOW_PAGES)
+            return rp;
+    }
+    return NULL;
+}
+
+// sleep for ms milliseconds or until woken up, called with the lock held
+static inline void nap(int ms)
+{
+    struct timeval now;
+    struct timespec ts;
+
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec + ms/1000;
+    ts.tv_nsec = now.tv_usec*1000 + (ms%1000)*1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&reflow.cond, &reflow.lock, &ts);
+}
+
+static inline void add_to_box(struct box *b, const struct box *r)
+{
+    b->x0 = min(b->x0, r->x0);
+    b->y0 = min(b->y0, r->y0);
+    b->x1 = max(b->x1, r->x1);
+    b->y1 = max(b->y1, r->y1);
+}
+
+/*
+   Collect the words of a zone (type xmin ymin xmax ymax children-or-text)
+   of a page h pixels high. line is the line they are on, -1 outside of
+   a line. A zone with text and no children is a word, whatever its type.
+ */
+static void collect(miniexp_t zone, int h, int line, int depth)
+{
+    miniexp_t r = miniexp_cdr(zone);
+    const char *type;
+    struct box b;
+    int v[4], i;
+
+    if (!miniexp_consp(zone) || !miniexp_symbolp(miniexp_car(zone)) || depth > 8)
+        return;
+    for (i = 0; i < 4; i++, r = miniexp_cdr(r)) {
+        if (!miniexp_numberp(miniexp_car(r)))
+            return;
+        v[i] = miniexp_to_int(miniexp_car(r));
+    }
+    b.x0 = v[0];
+    b.y0 = h - v[3];
+    b.x1 = v[2];
+    b.y1 = h - v[1];
+    type = miniexp_to_name(miniexp_car(zone));
+    if (!strcmp(type, "para") || !strcmp(type, "region") || !strcmp(type, "column"))
+        new_para = 1;
+    if (miniexp_stringp(miniexp_car(r))) {
+        if (b.x1 <= b.x0 || b.y1 <= b.y0 || nwords == REFLOW_MAX_WORDS || (line < 0 && nlines == REFLOW_MAX_WORDS))
+            return;
+        if (line < 0) {
+            line = nlines++;
+            lines[line] = b;
+        }
+        add_to_box(&lines[line], &b);
+        words[nwords].box = b;
+        words[nwords].line = line;
+        words[nwords].para = new_para;
+        new_para = 0;
+        nwords++;
+        return;
+    }
+    if (!strcmp(type, "line") && nlines < REFLOW_MAX_WORDS) {
+        line = nlines++;
+        lines[line] = b;
+    }
+    for (; miniexp_consp(r); r = miniexp_cdr(r))
+        collect(miniexp_car(r), h, line, depth + 1);
+}
+
+// v*s rounded up, for v >= 0
+static inline int scale_up(int v, float s)
+{
+    int r = v*s;
+    return r + (r < v*s);
+}
+
+static inline void scale_box(struct box *b, float s, int w, int h)
+{
+    b->x0 = max(0, (int)(b->x0*s));
+    b->y0 = max(0, (int)(b->y0*s));
+    b->x1 = min(w, scale_up(b->x1, s));
+    b->y1 = min(h, scale_up(b->y1, s));
+}
+
+/*
+   Put the words first ... last-1 on a line at *y of screen *screen, or at
+   the top of the next screen if they don't fit. The words keep where
+   they were in height on their own lines. Returns the height of the line.
+ */
+static int place_line(int first, int last, int *screen, int *y)
+{
+    int i, h = 0;
+
+    for (i = first; i < last; i++)
+        h = max(h, lines[words[i].line].y1 - lines[words[i].line].y0);
+    if (*y + h > reflow.height - REFLOW_MARGIN && *y > REFLOW_MARGIN) {
+        (*screen)++;
+        *y = REFLOW_MARGIN;
+    }
+    for (i = first; i < last; i++) {
+        words[i].screen = *screen;
+        words[i].y = *y + words[i].box.y0 - lines[words[i].line].y0;
+    }
+    *y += h + max(1, h/REFLOW_LEADING);
+    return h;
+}
+
+// lay the (scaled) words out on the screens, returns how many screens they take
+static int layout(void)
+{
+    int i, first = 0, x = REFLOW_MARGIN, y = REFLOW_MARGIN, screen = 0, w, h;
+
+    for (i = 0; i < nwords; i++) {
+        w = words[i].box.x1 - words[i].box.x0;
+        if (i > first && (words[i].para || x + w > reflow.width - REFLOW_MARGIN)) {
+            h = place_line(first, i, &screen, &y);
+            if (words[i].para)
+                y += h/2;
+            first = i;
+            x = REFLOW_MARGIN;
+        }
+        words[i].x = x;
+        x += w + max(2, (lines[words[i].line].y1 - lines[words[i].line].y0)/4);
+    }
+    if (first < nwords)
+        place_line(first, nwords, &screen, &y);
+    if (screen >= REFLOW_MAX_SCREENS)
+        DPRINTF("%s: %d screens, only %d kept\n", __FUNCTION__, screen + 1, REFLOW_MAX_SCREENS);
+    return min(screen + 1, REFLOW_MAX_SCREENS);
+}
+
+// render each line of the page once and copy its words to their places on the screens
+static int render_words(ddjvu_page_t *page, const ddjvu_rect_t *prect, unsigned char *screens, int nscreens)
+{
+    static unsigned char *buf;
+    static unsigned int bufsize;
+    const struct box *l;
+    struct word *w;
+    ddjvu_rect_t r;
+    int i, j, k, ww, wh;
+
+    ddjvu_page_set_rotation(page, DDJVU_ROTATE_0);
+    for (i = 0; i < nwords; i = j) {
+        l = &lines[words[i].line];
+        for (j = i; j < nwords && words[j].line == words[i].line; j++) ;
+        r.x = l->x0;
+        r.y = l->y0;
+        r.w = l->x1 - l->x0;
+        r.h = l->y1 - l->y0;
+        if (!r.w || !r.h || words[i].screen >= nscreens)
+            continue;
+        if (r.w*r.h > bufsize) {
+            free(buf);
+            bufsize = r.w*r.h;
+            if (!(buf = malloc(bufsize))) {
+                bufsize = 0;
+                return 0;
+            }
+        }
+        if (!ddjvu_page_render(page, DDJVU_RENDER_COLOR, prect, &r, djvu_format, r.w, (char *)buf))
+            return 0;
+        for (k = i; k < j; k++) {
+            w = &words[k];
+            ww = min(w->box.x1 - w->box.x0, reflow.width - w->x);
+            wh = min(w->box.y1 - w->box.y0, reflow.height - w->y);
+            if (w->screen < nscreens && ww > 0 && wh > 0)
+                reflow_blit(buf + (w->box.y0 - l->y0)*r.w + (w->box.x0 - l->x0), r.w,
+                            screens + w->screen*reflow.frame_bytes, w->x, w->y, ww, wh);
+        }
+    }
+    return 1;
+}
+
+/*
+   Reflow page p at the zoom of rp into rp->screens, called with the lock
+   held. Returns the number of screens, 0 if the page has no text layer
+   or can't be rendered.
+ */
+static int reflow_page(int p, struct reflowed *rp)
+{
+    ddjvu_page_t *page = NULL;
+    miniexp_t text;
+    ddjvu_rect_t prect;
+    unsigned char *screens = NULL;
+    int i, n = 0, w, h;
+    float s;
+
+    while ((text = ddjvu_document_get_pagetext(djvu_document, p, "word")) == miniexp_dummy) {
+        if (reflow.quit)
+            return 0;
+        nap(REFLOW_POLL_MS);
+    }
+    if (text == miniexp_nil)
+        return 0;
+    if (!(page = ddjvu_page_create_by_pageno(djvu_document, p)))
+        goto out;
+    while (!ddjvu_page_decoding_done(page)) {
+        if (reflow.quit)
+            goto out;
+        nap(REFLOW_POLL_MS);
+    }
+    if (ddjvu_page_decoding_error(page) || (w = ddjvu_page_get_width(page)) <= 0 || (h = ddjvu_page_get_height(page)) <= 0)
+        goto out;
+    pthread_mutex_unlock(&reflow.lock);
+    nwords = nlines = 0;
+    new_para = 1;
+    collect(text, h, -1, 0);
+    s = rp->zoom/100.0f*reflow.width/w;
+    prect.x = prect.y = 0;
+    prect.w = scale_up(w, s);
+    prect.h = scale_up(h, s);
+    for (i = 0; i < nlines; i++)
+        scale_box(&lines[i], s, prect.w, prect.h);
+    for (i = 0; i < nwords; i++)
+        scale_box(&words[i].box, s, prect.w, prect.h);
+    if (nwords && (n = layout()) > 0 && (screens = malloc(n*reflow.frame_bytes))) {
+        memset(screens, 0xFF, n*reflow.frame_bytes);
+        if (!render_words(page, &prect, screens, n)) {
+            free(screens);
+            screens = NULL;
+        }
+    }
+    pthread_mutex_lock(&reflow.lock);
+    DPRINTF("%s: page %d, %d words on %d lines, %d screens\n", __FUNCTION__, p, nwords, nlines, screens ? n : 0);
+    if (reflow.quit) {
+        free(screens);
+        screens = NULL;
+    }
+    rp->screens = screens;
+out:
+    if (page)
+        ddjvu_page_release(page);
+    ddjvu_miniexp_release(djvu_document, text);
+    return rp->screens ? n : 0;
+}
+
+static void *reflow_thread(void *arg)
+{
+    struct reflowed *rp;
+    int p, n;
+
+    pthread_mutex_lock(&reflow.lock);
+    while (!reflow.quit) {
+        if ((p = next_page()) < 0 || !(rp = free_slot())) {
+            pthread_cond_wait(&reflow.cond, &reflow.lock);
+            continue;
+        }
+        free(rp->screens);
+        rp->screens = NULL;
+        rp->page = p;
+        rp->zoom = reflow.zoom;
+        rp->state = REFLOW_BUSY;
+        n = reflow_page(p, rp);
+        if (reflow.quit)
+            break;
+        rp->nscreens = n;
+        rp->state = n ? REFLOW_DONE : REFLOW_NO_TEXT;
+        pthread_cond_broadcast(&reflow.cond);
+    }
+    pthread_mutex_unlock(&reflow.lock);
+    return NULL;
+}
+
+/*
+   Start reflowing the pages of a document of npages pages on width x
+   height screens, frame_bytes each. Returns 1 on success.
+ */
+int reflow_open(int npages, int width, int height, int frame_bytes)
+{
+    int i;
+
+    if (reflow.running)
+        return 1;
+    reflow.npages = npages;
+    reflow.width = width;
+    reflow.height = height;
+    reflow.frame_bytes = frame_bytes;
+    for (i = 0; i < REFLOW_PAGES; i++)
+        reflow.want[i] = -1;
+    reflow.quit = 0;
+    if (pthread_create(&reflow.thread, NULL, reflow_thread, NULL)) {
+        DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+        return 0;
+    }
+    reflow.running = 1;
+    return 1;
+}
+
+void reflow_close(void)
+{
+    int i;
+
+    if (!reflow.running)
+        return;
+    pthread_mutex_lock(&reflow.lock);
+    reflow.quit = 1;
+    pthread_cond_broadcast(&reflow.cond);
+    pthread_mutex_unlock(&reflow.lock);
+    pthread_join(reflow.thread, NULL);
+    reflow.running = 0;
+    for (i = 0; i < REFLOW_PAGES; i++) {
+        free(reflow.pages[i].screens);
+        memset(&reflow.pages[i], 0, sizeof(reflow.pages[i]));
+    }
+}
+
+// page p at zoom percent is being read in direction dir (+1/-1), reflow it and its neighbours
+void reflow_want(int p, int dir, int zoom)
+{
+    int i, q;
+
+    pthread_mutex_lock(&reflow.lock);
+    reflow.zoom = zoom;
+    for (i = 0; i < REFLOW_PAGES; i++) {
+        q = p + (i == 0 ? 0 : i == 1 ? dir : -dir);
+        reflow.want[i] = q >= 0 && q < reflow.npages ? q : -1;
+    }
+    pthread_cond_broadcast(&reflow.cond);
+    pthread_mutex_unlock(&reflow.lock);
+}
+
+/*
+   Copy screen *screen of page p, reflowed at the zoom of the last
+   reflow_want(), to frame, waiting for it if need be. A screen past the
+   end (or -1) is the last one and *screen is set to it. Returns the
+   number of screens of the page, 0 if it can't be reflowed.
+ */
+int reflow_get(int p, int *screen, unsigned char *frame)
+{
+    struct reflowed *rp;
+    int n = 0;
+
+    pthread_mutex_lock(&reflow.lock);
+    while (reflow.running && (!(rp = find(p, reflow.zoom)) || rp->state == REFLOW_BUSY))
+        pthread_cond_wait(&reflow.cond, &reflow.lock);
+    if (reflow.running && rp->state == REFLOW_DONE) {
+        n = rp->nscreens;
+        if (*screen < 0 || *screen >= n)
+            *screen = n - 1;
+        memcpy(frame, rp->screens + *screen*reflow.frame_bytes, reflow.frame_bytes);
+    }
+    pthread_mutex_unlock(&reflow.lock);
+    return n;
+}
@@ -0,0 +1,21 @@
+#ifndef _REFLOW_H
+#define _REFLOW_H
+
+#define REFLOW_PAGES       3    // pages kept reflowed: the current one and one either side
+#define REFLOW_MAX_SCREENS 16   // words past this many screens of a page are left out
+#define REFLOW_MAX_WORDS   4096
+#define REFLOW_MARGIN      16   // pixels of paper around the text on the screen
+#define REFLOW_LEADING     5    // 1/REFLOW_LEADING of the line height between two lines
+#define REFLOW_POLL_MS     20
+
+extern int reflow_open(int, int, int, int);
+extern void reflow_close(void);
+extern void reflow_want(int, int, int);
+extern int reflow_get(int, int *, unsigned char *);
+
+// in libdjvu.c
+extern ddjvu_document_t *djvu_document;
+extern ddjvu_format_t *djvu_format;
+extern void reflow_blit(const unsigned char *, int, unsigned char *, int, int, int, int);
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ * search.c Full-text search of libdjvu
+ *
+ * A background thread reads the hidden text layer of every page with
+ * ddjvu_document_get_pagetext() and builds an inverted index: for each
+ * word, in lower case and without the punctuation around it, the pages
+ * it is on. Once all the pages are done it is written to a sidecar file
+ * next to the document ("<document>.idx"), tied to the size and mtime of
+ * the document like the other sidecars, and from then on used straight
+ * from mmap(): a table of the words in strcmp() order, looked up by
+ * binary search, followed by their page lists and the words themselves.
+ * Until then lookups go to the hash table being built, so the pages done
+ * so far can be searched already. An index which wasn't finished is
+ * started again the next time.
+ *
+ * There is no keyboard, so words are typed the way phones do it: each
+ * key stands for its letters, Latin or Cyrillic (see key_of()), and
+ * search_complete() offers the words of the document which fit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include <libdjvu/miniexp.h>
+#include <libdjvu/ddjvuapi.h>
+
+#include "search.h"
+#include "debug.h"
+
+#define SEARCH_MAGIC "DJVUIDX1"
+
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#endif
+
+struct search_header {
+    char magic[8];
+    unsigned int size, mtime, npages;
+    unsigned int nterms, npostings, textsize;
+};
+
+// followed by nterms of these, npostings page numbers and textsize bytes of words
+struct search_term {
+    unsigned int text; // offset of the word in the words
+    unsigned int first, count; // its pages
+};
+
+// a word of the index being built
+struct build_term {
+    unsigned int text, next; // next: 1 + the next word in its hash chain, 0 at the end
+    unsigned int count, size;
+    unsigned short *pages;
+};
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running, quit, hurry, npages, done;
+    char name[512];
+    struct search_header want;
+    // the index on file, NULL until it is there
+    void *map;
+    size_t mapsize;
+    const struct search_term *terms;
+    const unsigned short *postings;
+    const char *text;
+    // the one being built
+    struct build_term *bterms;
+    unsigned int nbterms, bterms_size, *buckets, nbuckets;
+    char *btext;
+    unsigned int btext_len, btext_size;
+} search = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+// sleep for ms milliseconds or until woken up, called with the lock held
+static inline void nap(int ms)
+{
+    struct timeval now;
+    struct timespec ts;
+
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec + ms/1000;
+    ts.tv_nsec = now.tv_usec*1000 + (ms%1000)*1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&search.cond, &search.lock, &ts);
+}
+
+// the next character of a UTF-8 string, 0 at the end
+static int next_char(const unsigned char **s)
+{
+    const unsigned char *p = *s;
+    int c = *p++;
+
+    if (c >= 0xe0 && (p[0] & 0xc0) == 0x80 && (p[1] & 0xc0) == 0x80) {
+        c = ((c & 0x0f) << 12) | ((p[0] & 0x3f) << 6) | (p[1] & 0x3f);
+        p += 2;
+    } else if (c >= 0xc0 && (p[0] & 0xc0) == 0x80) {
+        c = ((c & 0x1f) << 6) | (p[0] & 0x3f);
+        p++;
+    }
+    *s = c ? p : *s;
+    return c;
+}
+
+static inline int put_char(int c, char *d)
+{
+    if (c < 0x80) {
+        d[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        d[0] = 0xc0 | (c >> 6);
+        d[1] = 0x80 | (c & 0x3f);
+        return 2;
+    }
+    d[0] = 0xe0 | (c >> 12);
+    d[1] = 0x80 | ((c >> 6) & 0x3f);
+    d[2] = 0x80 | (c & 0x3f);
+    return 3;
+}
+
+// lower case of the Latin, Latin-1 and Cyrillic letters
+static inline int lower(int c)
+{
+    if ((c >= 'A' && c <= 'Z') || (c >= 0xc0 && c <= 0xde && c != 0xd7) || (c >= 0x410 && c <= 0x42f))
+        return c + 0x20;
+    if (c >= 0x400 && c <= 0x40f)
+        return c + 0x50;
+    if (c == 0x490)
+        return 0x491;
+    return c;
+}
+
+static inline int is_letter(int c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || (c >= 0xc0 && c != 0xd7 && c != 0xf7);
+}
+
+/*
+   Lower case the word s (UTF-8) into d, SEARCH_MAX_WORD bytes at most,
+   without the punctuation around it. Returns its length, 0 if nothing is
+   left of it.
+ */
+int search_normalize(const char *s, char *d)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    int c, n, len = 0, end = 0;
+    char tmp[3];
+
+    while ((c = lower(next_char(&p)))) {
+        if (!len && !is_letter(c))
+            continue;
+        n = put_char(c, tmp);
+        if (len + n >= SEARCH_MAX_WORD)
+            break;
+        memcpy(d + len, tmp, n);
+        len += n;
+        if (is_letter(c))
+            end = len;
+    }
+    d[end] = 0;
+    return end;
+}
+
+// the key a lower case letter is on, '1' for everything else
+static char key_of(int c)
+{
+    static const char latin[] = "22233344455566677778889999";
+    static const char latin1[] = "722222222" "3333" "4444" "36" "66666" "16" "8888" "989"; // from 0xdf
+    static const char cyrillic[] = "2222" "3333" "4444" "5555" "6666" "7777" "8888" "9999"; // from 0x430
+
+    if (c >= 'a' && c <= 'z')
+        return latin[c - 'a'];
+    if (c >= '1' && c <= '9')
+        return c;
+    if (c >= 0xdf && c <= 0xff)
+        return latin1[c - 0xdf];
+    if (c >= 0x430 && c <= 0x44f)
+        return cyrillic[c - 0x430];
+    switch (c) {
+        case 0x491: // ukrainian ghe
+            return '2';
+        case 0x451: case 0x454: // io, ukrainian ie
+            return '3';
+        case 0x456: case 0x457: // byelorussian-ukrainian i, yi
+            return '4';
+        case 0x45e: // short u
+            return '6';
+    }
+    return '1';
+}
+
+/*
+   If the keys of the word w start with code, the number of letters of w
+   (so that the words typed in full can go first), otherwise -1.
+ */
+static int code_match(const char *w, const char *code)
+{
+    const unsigned char *p = (const unsigned char *)w;
+    int c, n = 0, len = strlen(code);
+
+    while ((c = next_char(&p))) {
+        if (n < len && key_of(c) != code[n])
+            return -1;
+        n++;
+    }
+    return n < len ? -1 : n;
+}
+
+static inline unsigned int hash(const char *s)
+{
+    unsigned int h = 5381;
+
+    while (*s)
+        h = (h << 5) + h + (unsigned char)*s++;
+    return h;
+}
+
+static int rehash(unsigned int nbuckets)
+{
+    unsigned int *buckets = calloc(nbuckets, sizeof(*buckets)), i, h;
+
+    if (!buckets)
+        return 0;
+    for (i = 0; i < search.nbterms; i++) {
+        h = hash(search.btext + search.bterms[i].text) & (nbuckets - 1);
+        search.bterms[i].next = buckets[h];
+        buckets[h] = i + 1;
+    }
+    free(search.buckets);
+    search.buckets = buckets;
+    search.nbuckets = nbuckets;
+    return 1;
+}
+
+// the word w of the index being built, NULL if it isn't in it
+static struct build_term *build_lookup(const char *w)
+{
+    unsigned int i;
+
+    if (!search.nbuckets)
+        return NULL;
+    for (i = search.buckets[hash(w) & (search.nbuckets - 1)]; i; i = search.bterms[i - 1].next)
+        if (!strcmp(search.btext + search.bterms[i - 1].text, w))
+            return &search.bterms[i - 1];
+    return NULL;
+}
+
+// note that the word w is on page p, returns 0 if we are out of memory
+static int add_word(const char *w, int p)
+{
+    struct build_term *t = build_lookup(w);
+    unsigned int len = strlen(w) + 1, h;
+    void *tmp;
+
+    if (!t) {
+        if (search.nbterms == search.bterms_size) {
+            if (!(tmp = realloc(search.bterms, 2*search.bterms_size*sizeof(*search.bterms))))
+                return 0;
+            search.bterms = tmp;
+            search.bterms_size *= 2;
+        }
+        if (search.btext_len + len > search.btext_size) {
+            if (!(tmp = realloc(search.btext, 2*search.btext_size)))
+                return 0;
+            search.btext = tmp;
+            search.btext_size *= 2;
+        }
+        if (search.nbterms >= 2*search.nbuckets && !rehash(2*search.nbuckets))
+            return 0;
+        t = &search.bterms[search.nbterms++];
+        memset(t, 0, sizeof(*t));
+        t->text = search.btext_len;
+        memcpy(search.btext + search.btext_len, w, len);
+        search.btext_len += len;
+        h = hash(w) & (search.nbuckets - 1);
+        t->next = search.buckets[h];
+        search.buckets[h] = search.nbterms;
+    }
+    if (t->count && t->pages[t->count - 1] == p)
+        return 1;
+    if (t->count == t->size) {
+        if (!(tmp = realloc(t->pages, (t->size ? 2*t->size : 4)*sizeof(*t->pages))))
+            return 0;
+        t->pages = tmp;
+        t->size = t->size ? 2*t->size : 4;
+    }
+    t->pages[t->count++] = p;
+    return 1;
+}
+
+static void free_build(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < search.nbterms; i++)
+        free(search.bterms[i].pages);
+    free(search.bterms);
+    free(search.buckets);
+    free(search.btext);
+    search.bterms = NULL;
+    search.buckets = NULL;
+    search.btext = NULL;
+    search.nbterms = search.bterms_size = search.nbuckets = search.btext_len = search.btext_size = 0;
+}
+
+static int init_build(void)
+{
+    search.bterms_size = 1024;
+    search.btext_size = 8192;
+    search.bterms = malloc(search.bterms_size*sizeof(*search.bterms));
+    search.btext = malloc(search.btext_size);
+    if (!search.bterms || !search.btext || !rehash(1024)) {
+        free_build();
+        return 0;
+    }
+    return 1;
+}
+
+/*
+   Call fn for each word of a zone (type xmin ymin xmax ymax children-or-
+   text) with its text and box. A zone with text and no children is a
+   word, whatever its type.
+ */
+static void walk(miniexp_t zone, void (*fn)(const char *, const int *, void *), void *arg, int depth)
+{
+    miniexp_t r = miniexp_cdr(zone);
+    int box[4], i;
+
+    if (!miniexp_consp(zone) || !miniexp_symbolp(miniexp_car(zone)) || depth > 8)
+        return;
+    for (i = 0; i < 4; i++, r = miniexp_cdr(r)) {
+        if (!miniexp_numberp(miniexp_car(r)))
+            return;
+        box[i] = miniexp_to_int(miniexp_car(r));
+    }
+    if (miniexp_stringp(miniexp_car(r))) {
+        fn(miniexp_to_str(miniexp_car(r)), box, arg);
+        return;
+    }
+    for (; miniexp_consp(r); r = miniexp_cdr(r))
+        walk(miniexp_car(r), fn, arg, depth + 1);
+}
+
+struct index_page {
+    int page, ok;
+};
+
+static void index_word(const char *s, const int *box, void *arg)
+{
+    struct index_page *ip = arg;
+    char w[SEARCH_MAX_WORD];
+
+    if (ip->ok && search_normalize(s, w))
+        ip->ok = add_word(w, ip->page);
+}
+
+static int cmp_terms(const void *a, const void *b)
+{
+    return strcmp(search.btext + search.bterms[*(const unsigned int *)a].text,
+                  search.btext + search.bterms[*(const unsigned int *)b].text);
+}
+
+// write the index which has been built to the sidecar, returns 0 on failure
+static int write_index(void)
+{
+    char tmpname[520];
+    struct search_header hdr = search.want;
+    struct search_term term;
+    unsigned int *order, i;
+    FILE *fp;
+    int ok;
+
+    if (!(order = malloc(search.nbterms*sizeof(*order))))
+        return 0;
+    for (i = 0; i < search.nbterms; i++)
+        order[i] = i;
+    qsort(order, search.nbterms, sizeof(*order), cmp_terms);
+    hdr.nterms = search.nbterms;
+    hdr.npostings = 0;
+    for (i = 0; i < search.nbterms; i++)
+        hdr.npostings += search.bterms[i].count;
+    hdr.textsize = search.btext_len;
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", search.name);
+    if (!(fp = fopen(tmpname, "w"))) {
+        free(order);
+        return 0;
+    }
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (i = 0, term.first = 0; ok && i < search.nbterms; i++) {
+        term.text = search.bterms[order[i]].text;
+        term.count = search.bterms[order[i]].count;
+        ok = fwrite(&term, sizeof(term), 1, fp) == 1;
+        term.first += term.count;
+    }
+    for (i = 0; ok && i < search.nbterms; i++)
+        ok = fwrite(search.bterms[order[i]].pages, sizeof(unsigned short), search.bterms[order[i]].count, fp) == search.bterms[order[i]].count;
+    ok = ok && fwrite(search.btext, 1, search.btext_len, fp) == search.btext_len;
+    ok = !fclose(fp) && ok && !rename(tmpname, search.name);
+    if (!ok)
+        (void)unlink(tmpname);
+    free(order);
+    return ok;
+}
+
+// map the sidecar if it is the index of this version of the document, returns 1 if it is
+static int map_index(void)
+{
+    const struct search_header *hdr;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if ((fd = open(search.name, O_RDONLY)) == -1)
+        return 0;
+    if (fstat(fd, &st) || st.st_size < sizeof(*hdr) ||
+        (search.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        search.map = NULL;
+        (void)close(fd);
+        return 0;
+    }
+    (void)close(fd);
+    search.mapsize = st.st_size;
+    hdr = search.map;
+    size = sizeof(*hdr) + (size_t)hdr->nterms*sizeof(struct search_term) + (size_t)hdr->npostings*sizeof(unsigned short) + hdr->textsize;
+    if (memcmp(hdr, &search.want, offsetof(struct search_header, nterms)) || size != search.mapsize) {
+        (void)munmap(search.map, search.mapsize);
+        search.map = NULL;
+        return 0;
+    }
+    search.terms = (const struct search_term *)(hdr + 1);
+    search.postings = (const unsigned short *)(search.terms + hdr->nterms);
+    search.text = (const char *)(search.postings + hdr->npostings);
+    return 1;
+}
+
+static void *search_thread(void *arg)
+{
+    struct index_page ip = {0, 1};
+    miniexp_t text;
+
+    pthread_mutex_lock(&search.lock);
+    while (!search.quit && search.done < search.npages) {
+        // the document may still be decoding if it was opened on a snapshot
+        while (!ddjvu_document_decoding_done(djvu_document) ||
+               (text = ddjvu_document_get_pagetext(djvu_document, search.done, "word")) == miniexp_dummy) {
+            if (search.quit)
+                goto out;
+            nap(SEARCH_POLL_MS);
+        }
+        ip.page = search.done;
+        if (text != miniexp_nil) {
+            walk(text, index_word, &ip, 0);
+            ddjvu_miniexp_release(djvu_document, text);
+        }
+        if (!ip.ok) {
+            DPRINTF("%s: out of memory on page %d\n", __FUNCTION__, search.done);
+            goto out;
+        }
+        search.done++;
+        if (!search.hurry)
+            nap(SEARCH_IDLE_MS);
+    }
+    if (search.quit)
+        goto out;
+    // nothing changes the index being built any more, lookups can go on while it is written
+    pthread_mutex_unlock(&search.lock);
+    if (!write_index())
+        DPRINTF("%s: can't write %s\n", __FUNCTION__, search.name);
+    pthread_mutex_lock(&search.lock);
+    if (map_index()) {
+        DPRINTF("%s: %u words of %d pages in %s\n", __FUNCTION__, search.nbterms, search.npages, search.name);
+        free_build();
+    }
+out:
+    pthread_mutex_unlock(&search.lock);
+    return NULL;
+}
+
+/*
+   Open the index of the document "filename", or start making it if it
+   isn't there yet. Returns 1 on success.
+ */
+int search_open(const char *filename, const struct stat *st, int npages)
+{
+    search_close();
+    snprintf(search.name, sizeof(search.name), "%s.idx", filename);
+    memset(&search.want, 0, sizeof(search.want));
+    memcpy(search.want.magic, SEARCH_MAGIC, sizeof(search.want.magic));
+    search.want.size = st->st_size;
+    search.want.mtime = st->st_mtime;
+    search.want.npages = search.npages = min(npages, SEARCH_MAX_PAGES);
+    if (map_index()) {
+        search.done = search.npages;
+        DPRINTF("%s: %u words in %s\n", __FUNCTION__, ((const struct search_header *)search.map)->nterms, search.name);
+        return 1;
+    }
+    if (!init_build())
+        return 0;
+    search.done = 0;
+    search.quit = 0;
+    if (pthread_create(&search.thread, NULL, search_thread, NULL)) {
+        DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+        free_build();
+        return 0;
+    }
+    search.running = 1;
+    return 1;
+}
+
+void search_close(void)
+{
+    if (search.running) {
+        pthread_mutex_lock(&search.lock);
+        search.quit = 1;
+        pthread_cond_broadcast(&search.cond);
+        pthread_mutex_unlock(&search.lock);
+        pthread_join(search.thread, NULL);
+        search.running = 0;
+    }
+    if (search.map) {
+        (void)munmap(search.map, search.mapsize);
+        search.map = NULL;
+    }
+    free_build();
+    search.npages = search.done = search.hurry = 0;
+}
+
+// somebody is waiting for the index, don't pause between pages
+void search_hurry(int hurry)
+{
+    pthread_mutex_lock(&search.lock);
+    search.hurry = hurry;
+    pthread_cond_broadcast(&search.cond);
+    pthread_mutex_unlock(&search.lock);
+}
+
+// the number of pages which can be searched
+int search_count(void)
+{
+    return search.done;
+}
+
+/*
+   Up to max words of the document whose keys start with code (digits
+   '1' to '9'), into words[]. Words typed in full go first, then those
+   which go on, the ones on more pages first in both. Returns how many.
+ */
+int search_complete(const char *code, char (*words)[SEARCH_MAX_WORD], int max)
+{
+    static unsigned int rank[64];
+    const char *w;
+    unsigned int i, n, r, nterms;
+    int j, k, found = 0;
+
+    if (max > sizeof(rank)/sizeof(rank[0]))
+        max = sizeof(rank)/sizeof(rank[0]);
+    pthread_mutex_lock(&search.lock);
+    nterms = search.map ? ((const struct search_header *)search.map)->nterms : search.nbterms;
+    for (i = 0; i < nterms; i++) {
+        if (search.map) {
+            w = search.text + search.terms[i].text;
+            n = search.terms[i].count;
+        } else {
+            w = search.btext + search.bterms[i].text;
+            n = search.bterms[i].count;
+        }
+        if ((j = code_match(w, code)) < 0)
+            continue;
+        r = (j == (int)strlen(code) ? 1u << 31 : 0) | min(n, 0x7fffffff);
+        // keep the best max of them, best first
+        if (found == max && rank[max - 1] >= r)
+            continue;
+        for (k = min(found, max - 1); k > 0 && rank[k - 1] < r; k--) {
+            rank[k] = rank[k - 1];
+            strcpy(words[k], words[k - 1]);
+        }
+        rank[k] = r;
+        strcpy(words[k], w);
+        if (found < max)
+            found++;
+    }
+    pthread_mutex_unlock(&search.lock);
+    return found;
+}
+
+/*
+   The pages the word w (as given by search_normalize()) is on, up to max
+   of them into pages[], in order. Returns how many there are.
+ */
+int search_find(const char *w, unsigned short *pages, int max)
+{
+    const struct search_header *hdr;
+    const unsigned short *p = NULL;
+    struct build_term *t;
+    int lo, hi, mid, c, n = 0;
+
+    pthread_mutex_lock(&search.lock);
+    if (search.map) {
+        hdr = search.map;
+        for (lo = 0, hi = hdr->nterms - 1; lo <= hi; ) {
+            mid = (lo + hi)/2;
+            if (!(c = strcmp(search.text + search.terms[mid].text, w))) {
+                p = search.postings + search.terms[mid].first;
+                n = search.terms[mid].count;
+                break;
+            }
+            if (c < 0)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
+        }
+    } else if ((t = build_lookup(w))) {
+        p = t->pages;
+        n = t->count;
+    }
+    if (p)
+        memcpy(pages, p, min(n, max)*sizeof(*pages));
+    pthread_mutex_unlock(&search.lock);
+    return n;
+}
+
+struct word_boxes {
+    const char *w;
+    int (*boxes)[4];
+    int max, n;
+};
+
+static void match_word(const char *s, const int *box, void *arg)
+{
+    struct word_boxes *wb = arg;
+    char w[SEARCH_MAX_WORD];
+
+    if (wb->n < wb->max && search_normalize(s, w) && !strcmp(w, wb->w))
+        memcpy(wb->boxes[wb->n++], box, sizeof(wb->boxes[0]));
+}
+
+/*
+   The boxes of the word w on page p, up to max of them, as xmin, ymin,
+   xmax, ymax in page pixels from the bottom left like the text layer has
+   them. Returns how many, -1 if the text of the page isn't there yet.
+ */
+int search_boxes(int p, const char *w, int (*boxes)[4], int max)
+{
+    struct word_boxes wb = {w, boxes, max, 0};
+    miniexp_t text = ddjvu_document_get_pagetext(djvu_document, p, "word");
+
+    if (text == miniexp_dummy)
+        return -1;
+    if (text != miniexp_nil) {
+        walk(text, match_word, &wb, 0);
+        ddjvu_miniexp_release(djvu_document, text);
+    }
+    return wb.n;
+}
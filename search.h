@@ -0,0 +1,21 @@
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#define SEARCH_MAX_WORD  32     // bytes of a word (UTF-8, with the NUL) kept in the index
+#define SEARCH_MAX_PAGES 65535  // pages after this many aren't indexed
+#define SEARCH_IDLE_MS   10     // pause between pages while nobody is searching
+#define SEARCH_POLL_MS   20
+
+extern int search_open(const char *, const struct stat *, int);
+extern void search_close(void);
+extern void search_hurry(int);
+extern int search_count(void);
+extern int search_normalize(const char *, char *);
+extern int search_complete(const char *, char (*)[SEARCH_MAX_WORD], int);
+extern int search_find(const char *, unsigned short *, int);
+extern int search_boxes(int, const char *, int (*)[4], int);
+
+// in libdjvu.c
+extern ddjvu_document_t *djvu_document;
+
+#endif
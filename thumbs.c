@@ -0,0 +1,285 @@
+/*
+ * thumbs.c Page thumbnails for the page navigator of libdjvu
+ *
+ * A background thread makes a thumbnail of every page with
+ * ddjvu_thumbnail_render() and stores it in a sidecar file next to the
+ * document ("<document>.thm"), so that they are all there at once the
+ * next time the document is opened. The file starts with a header tying
+ * it to the size and mtime of the document, followed by a fixed size
+ * record for each page. Pages the navigator is showing are done first,
+ * then the rest outwards from there.
+ *
+ * Thumbnails are kept at 2 bits per pixel on both models, which is what
+ * the V3 shows anyway and takes about 5KB a page.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "thumbs.h"
+#include "debug.h"
+
+#define THUMBS_MAGIC   "DJVUTHM1"
+#define THUMBS_POLL_MS 50
+
+struct thumbs_header {
+    char magic[8];
+    unsigned int size, mtime;
+    unsigned int npages, width, height;
+};
+
+struct thumb_record {
+    unsigned short w, h; // 0x0 if not made yet
+    unsigned char pixels[THUMB_STRIDE*THUMB_HEIGHT];
+};
+
+#define RECORD_OFFSET(n) (sizeof(struct thumbs_header) + (off_t)(n)*sizeof(struct thumb_record))
+
+enum { THUMB_MISSING, THUMB_DONE, THUMB_FAILED };
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running, quit, fd, npages, ndone;
+    int want_first, want_count;
+    unsigned char *state; // THUMB_* for each page
+} thumbs = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .fd = -1 };
+
+// the page to make next, -1 if there is none
+static int next_page(void)
+{
+    int i, p;
+
+    for (i = 0; i < thumbs.want_count; i++) {
+        p = thumbs.want_first + i;
+        if (p < thumbs.npages && thumbs.state[p] == THUMB_MISSING)
+            return p;
+    }
+    for (i = 0; i < thumbs.npages; i++) {
+        p = thumbs.want_first + i;
+        if (p < thumbs.npages && thumbs.state[p] == THUMB_MISSING)
+            return p;
+        p = thumbs.want_first - i - 1;
+        if (p >= 0 && thumbs.state[p] == THUMB_MISSING)
+            return p;
+    }
+    return -1;
+}
+
+// true if there is something on the navigator's screen still to make
+static inline int wanted(void)
+{
+    int i;
+    for (i = 0; i < thumbs.want_count && thumbs.want_first + i < thumbs.npages; i++)
+        if (thumbs.state[thumbs.want_first + i] == THUMB_MISSING)
+            return 1;
+    return 0;
+}
+
+// sleep for ms milliseconds or until woken up, called with the lock held
+static inline void nap(int ms)
+{
+    struct timeval now;
+    struct timespec ts;
+
+    gettimeofday(&now, NULL);
+    ts.tv_sec = now.tv_sec + ms/1000;
+    ts.tv_nsec = now.tv_usec*1000 + (ms%1000)*1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&thumbs.cond, &thumbs.lock, &ts);
+}
+
+// make the thumbnail of page p and write it to the sidecar, called with the lock held
+static int make_thumb(int p)
+{
+    static unsigned char grey[THUMB_WIDTH*THUMB_HEIGHT];
+    static struct thumb_record rec;
+    unsigned char *s, *d;
+    int w = THUMB_WIDTH, h = THUMB_HEIGHT, x, y;
+
+    // the document may still be decoding if it was opened on a snapshot
+    while (!ddjvu_document_decoding_done(djvu_document) ||
+           ddjvu_thumbnail_status(djvu_document, p, 1) < DDJVU_JOB_OK) {
+        if (thumbs.quit)
+            return 0;
+        nap(THUMBS_POLL_MS);
+    }
+    pthread_mutex_unlock(&thumbs.lock);
+    if (!ddjvu_thumbnail_render(djvu_document, p, &w, &h, djvu_format, THUMB_WIDTH, (char *)grey) ||
+        w <= 0 || h <= 0 || w > THUMB_WIDTH || h > THUMB_HEIGHT) {
+        pthread_mutex_lock(&thumbs.lock);
+        return 0;
+    }
+    memset(&rec, 0, sizeof(rec));
+    rec.w = w;
+    rec.h = h;
+    for (y = 0; y < h; y++) {
+        s = grey + y*THUMB_WIDTH;
+        d = rec.pixels + y*THUMB_STRIDE;
+        for (x = 0; x < w; x++)
+            d[x>>2] |= (s[x] >> 6) << ((3 - (x&3))<<1);
+    }
+    pthread_mutex_lock(&thumbs.lock);
+    if (pwrite(thumbs.fd, &rec, sizeof(rec), RECORD_OFFSET(p)) != sizeof(rec)) {
+        DPRINTF("%s: can't write the thumbnail of page %d\n", __FUNCTION__, p);
+        return 0;
+    }
+    return 1;
+}
+
+static void *thumbs_thread(void *arg)
+{
+    int p, ok;
+
+    pthread_mutex_lock(&thumbs.lock);
+    while (!thumbs.quit) {
+        if ((p = next_page()) < 0) {
+            pthread_cond_wait(&thumbs.cond, &thumbs.lock);
+            continue;
+        }
+        ok = make_thumb(p);
+        if (thumbs.quit)
+            break;
+        thumbs.state[p] = ok ? THUMB_DONE : THUMB_FAILED;
+        thumbs.ndone += ok;
+        DPRINTF("%s: page %d -> %d\n", __FUNCTION__, p, ok);
+        if (ok) {
+            pthread_mutex_unlock(&thumbs.lock);
+            thumbs_ready(p);
+            pthread_mutex_lock(&thumbs.lock);
+        }
+        // don't take the CPU from the reader unless the navigator is waiting
+        if (!wanted())
+            nap(THUMBS_IDLE_MS);
+    }
+    pthread_mutex_unlock(&thumbs.lock);
+    return NULL;
+}
+
+/*
+   Open (or create) the sidecar of the document "filename" and start
+   making the thumbnails it doesn't have yet. Returns 1 on success.
+ */
+int thumbs_open(const char *filename, const struct stat *st, int npages)
+{
+    char name[512];
+    struct thumbs_header hdr, want;
+    unsigned short wh[2];
+    int p;
+
+    thumbs_close();
+    snprintf(name, sizeof(name), "%s.thm", filename);
+    if ((thumbs.fd = open(name, O_RDWR | O_CREAT, 0644)) == -1) {
+        DPRINTF("%s: can't open %s\n", __FUNCTION__, name);
+        return 0;
+    }
+    memset(&want, 0, sizeof(want));
+    memcpy(want.magic, THUMBS_MAGIC, sizeof(want.magic));
+    want.size = st->st_size;
+    want.mtime = st->st_mtime;
+    want.npages = npages;
+    want.width = THUMB_WIDTH;
+    want.height = THUMB_HEIGHT;
+    if (pread(thumbs.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(&hdr, &want, sizeof(hdr))) {
+        // not ours or made for another version of the document, start afresh
+        DPRINTF("%s: new sidecar %s\n", __FUNCTION__, name);
+        if (ftruncate(thumbs.fd, 0) == -1 ||
+            pwrite(thumbs.fd, &want, sizeof(want), 0) != sizeof(want) ||
+            ftruncate(thumbs.fd, RECORD_OFFSET(npages)) == -1) {
+            (void)close(thumbs.fd);
+            thumbs.fd = -1;
+            return 0;
+        }
+    }
+    thumbs.state = calloc(npages, 1);
+    if (!thumbs.state) {
+        (void)close(thumbs.fd);
+        thumbs.fd = -1;
+        return 0;
+    }
+    thumbs.npages = npages;
+    thumbs.ndone = 0;
+    for (p = 0; p < npages; p++)
+        if (pread(thumbs.fd, wh, sizeof(wh), RECORD_OFFSET(p)) == sizeof(wh) && wh[0] && wh[1]) {
+            thumbs.state[p] = THUMB_DONE;
+            thumbs.ndone++;
+        }
+    DPRINTF("%s: %d of %d thumbnails in %s\n", __FUNCTION__, thumbs.ndone, npages, name);
+    thumbs.want_first = thumbs.want_count = 0;
+    thumbs.quit = 0;
+    if (pthread_create(&thumbs.thread, NULL, thumbs_thread, NULL)) {
+        DPRINTF("%s: pthread_create() failed\n", __FUNCTION__);
+        return 1; // still good for what we have
+    }
+    thumbs.running = 1;
+    return 1;
+}
+
+void thumbs_close(void)
+{
+    if (thumbs.running) {
+        pthread_mutex_lock(&thumbs.lock);
+        thumbs.quit = 1;
+        pthread_cond_broadcast(&thumbs.cond);
+        pthread_mutex_unlock(&thumbs.lock);
+        pthread_join(thumbs.thread, NULL);
+        thumbs.running = 0;
+    }
+    if (thumbs.fd != -1) {
+        (void)close(thumbs.fd);
+        thumbs.fd = -1;
+    }
+    free(thumbs.state);
+    thumbs.state = NULL;
+    thumbs.npages = thumbs.ndone = 0;
+}
+
+/*
+   Copy the thumbnail of page p to buf (THUMB_STRIDE bytes per row) and
+   its size to *w, *h. Returns 0 if we don't have it (yet).
+ */
+int thumbs_get(int p, int *w, int *h, unsigned char *buf)
+{
+    static struct thumb_record rec;
+    int y, ok = 0;
+
+    pthread_mutex_lock(&thumbs.lock);
+    if (p >= 0 && p < thumbs.npages && thumbs.state[p] == THUMB_DONE &&
+        pread(thumbs.fd, &rec, sizeof(rec), RECORD_OFFSET(p)) == sizeof(rec)) {
+        *w = rec.w;
+        *h = rec.h;
+        for (y = 0; y < rec.h; y++)
+            memcpy(buf + y*THUMB_STRIDE, rec.pixels + y*THUMB_STRIDE, THUMB_STRIDE);
+        ok = 1;
+    }
+    pthread_mutex_unlock(&thumbs.lock);
+    return ok;
+}
+
+// make the thumbnails of pages first ... first+count-1 before any other
+void thumbs_want(int first, int count)
+{
+    pthread_mutex_lock(&thumbs.lock);
+    thumbs.want_first = first;
+    thumbs.want_count = count;
+    pthread_cond_broadcast(&thumbs.cond);
+    pthread_mutex_unlock(&thumbs.lock);
+}
+
+int thumbs_count(void)
+{
+    return thumbs.ndone;
+}
@@ -0,0 +1,20 @@
+#ifndef _THUMBS_H
+#define _THUMBS_H
+
+#define THUMB_WIDTH   136  // thumbnails fit in THUMB_WIDTH x THUMB_HEIGHT
+#define THUMB_HEIGHT  160
+#define THUMB_STRIDE  (THUMB_WIDTH/4)  // 2-bit pixels, 4 per byte, first one in the top bits
+#define THUMBS_IDLE_MS 200  // pause between thumbnails while nobody is waiting for them
+
+extern int thumbs_open(const char *, const struct stat *, int);
+extern void thumbs_close(void);
+extern int thumbs_get(int, int *, int *, unsigned char *);
+extern void thumbs_want(int, int);
+extern int thumbs_count(void);
+
+// in libdjvu.c
+extern ddjvu_document_t *djvu_document;
+extern ddjvu_format_t *djvu_format;
+extern void thumbs_ready(int);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * tilecache.c Cache of rendered page tiles for libdjvu
+ *
+ * The page, as laid out by prect, is cut into a grid of TILE_SIZE square
+ * tiles. Any rectangle is rendered by copying the tiles it overlaps and
+ * rendering only those we don't have yet. Tiles are only reusable for the
+ * same page, prect, rotation and rendering mode, so these make the key.
+ * When the cache grows beyond tilecache_size_kb, or the share of the
+ * memory budget given to it in tilecache_budget_kb, the least recently
+ * used tiles are freed.
+ *
+ * Both the viewer's thread and the pre-render thread render through here,
+ * so the cache is protected by a mutex. It is not held while rendering.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <libdjvu/ddjvuapi.h>
+
+#include "tilecache.h"
+#include "debug.h"
+
+int tilecache_size_kb = 2048;
+int tilecache_budget_kb = 2048;
+unsigned int tilecache_hits, tilecache_misses;
+
+struct tile {
+    int pageno, rotation, tx, ty;
+    ddjvu_render_mode_t mode;
+    ddjvu_rect_t prect;
+    unsigned int stamp;
+    unsigned char *pixels; // TILE_SIZE bytes per row, clipped to the page
+};
+
+static struct tile tiles[TILECACHE_MAX_TILES];
+static int ntiles;
+static unsigned long nbytes;
+static unsigned int lru_clock;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define TILE_BYTES (TILE_SIZE*TILE_SIZE)
+
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) (((a)>(b))?(a):(b))
+#endif
+
+static inline int same_rect(const ddjvu_rect_t *a, const ddjvu_rect_t *b)
+{
+    return a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h;
+}
+
+static inline struct tile *lookup(int pageno, ddjvu_render_mode_t mode, int rotation,
+                                  const ddjvu_rect_t *prect, int tx, int ty)
+{
+    int i;
+    for (i = 0; i < ntiles; i++) {
+        struct tile *t = &tiles[i];
+        if (t->tx == tx && t->ty == ty && t->pageno == pageno && t->mode == mode &&
+            t->rotation == rotation && same_rect(&t->prect, prect))
+            return t;
+    }
+    return NULL;
+}
+
+static inline unsigned long limit(void)
+{
+    return (unsigned long)min(tilecache_size_kb, tilecache_budget_kb)*1024;
+}
+
+// free the least recently used tile
+static inline void evict(void)
+{
+    int i, victim = 0;
+
+    for (i = 1; i < ntiles; i++)
+        if (tiles[i].stamp < tiles[victim].stamp)
+            victim = i;
+    free(tiles[victim].pixels);
+    nbytes -= TILE_BYTES;
+    tiles[victim] = tiles[--ntiles];
+}
+
+// add a freshly rendered tile, unless another thread got there first
+static inline struct tile *insert(int pageno, ddjvu_render_mode_t mode, int rotation,
+                                  const ddjvu_rect_t *prect, int tx, int ty, unsigned char *pixels)
+{
+    struct tile *t = lookup(pageno, mode, rotation, prect, tx, ty);
+
+    if (t) {
+        free(pixels);
+        return t;
+    }
+    while (ntiles > 0 && (ntiles == TILECACHE_MAX_TILES || nbytes + TILE_BYTES > limit()))
+        evict();
+    t = &tiles[ntiles++];
+    t->pageno = pageno;
+    t->mode = mode;
+    t->rotation = rotation;
+    t->prect = *prect;
+    t->tx = tx;
+    t->ty = ty;
+    t->pixels = pixels;
+    nbytes += TILE_BYTES;
+    return t;
+}
+
+// render tile (tx,ty), returns NULL on failure
+static inline unsigned char *render_tile(ddjvu_page_t *page, ddjvu_render_mode_t mode,
+                                         const ddjvu_rect_t *prect, int tx, int ty)
+{
+    ddjvu_rect_t r;
+    unsigned char *pixels;
+    int x2 = min(tx*TILE_SIZE + TILE_SIZE, prect->x + (int)prect->w);
+    int y2 = min(ty*TILE_SIZE + TILE_SIZE, prect->y + (int)prect->h);
+
+    r.x = max(tx*TILE_SIZE, prect->x);
+    r.y = max(ty*TILE_SIZE, prect->y);
+    if (x2 <= r.x || y2 <= r.y)
+        return NULL;
+    r.w = x2 - r.x;
+    r.h = y2 - r.y;
+    if (!(pixels = malloc(TILE_BYTES)))
+        return NULL;
+    if (!ddjvu_page_render(page, mode, prect, &r, djvu_format, TILE_SIZE,
+                           (char *)pixels + (r.y - ty*TILE_SIZE)*TILE_SIZE + (r.x - tx*TILE_SIZE))) {
+        free(pixels);
+        return NULL;
+    }
+    return pixels;
+}
+
+/*
+   Render "rect" of page "pageno" laid out as "prect" into buf (rowsize
+   bytes per row). The rotation must already be set on the page.
+   Returns 1 on success, 0 on error, like ddjvu_page_render().
+ */
+int tilecache_render(ddjvu_page_t *page, int pageno, ddjvu_render_mode_t mode, int rotation,
+                     const ddjvu_rect_t *prect, const ddjvu_rect_t *rect, unsigned char *buf, int rowsize)
+{
+    int tx, ty, x1, y1, x2, y2, y;
+    struct tile *t;
+    unsigned char *pixels;
+
+    for (ty = rect->y/TILE_SIZE; ty*TILE_SIZE < rect->y + (int)rect->h; ty++) {
+        for (tx = rect->x/TILE_SIZE; tx*TILE_SIZE < rect->x + (int)rect->w; tx++) {
+            pthread_mutex_lock(&lock);
+            if ((t = lookup(pageno, mode, rotation, prect, tx, ty))) {
+                tilecache_hits++;
+            } else {
+                tilecache_misses++;
+                pthread_mutex_unlock(&lock);
+                if (!(pixels = render_tile(page, mode, prect, tx, ty))) {
+                    DPRINTF("%s: failed to render tile %d,%d of page %d\n", __FUNCTION__, tx, ty, pageno);
+                    return 0;
+                }
+                pthread_mutex_lock(&lock);
+                t = insert(pageno, mode, rotation, prect, tx, ty, pixels);
+            }
+            t->stamp = ++lru_clock;
+            // copy the part of the tile which falls into rect
+            x1 = max(tx*TILE_SIZE, rect->x);
+            y1 = max(ty*TILE_SIZE, rect->y);
+            x2 = min(tx*TILE_SIZE + TILE_SIZE, rect->x + (int)rect->w);
+            y2 = min(ty*TILE_SIZE + TILE_SIZE, rect->y + (int)rect->h);
+            for (y = y1; y < y2; y++)
+                memcpy(buf + (y - rect->y)*rowsize + (x1 - rect->x),
+                       t->pixels + (y - ty*TILE_SIZE)*TILE_SIZE + (x1 - tx*TILE_SIZE), x2 - x1);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+    return 1;
+}
+
+unsigned long tilecache_bytes(void)
+{
+    return nbytes;
+}
+
+// free tiles until the cache is within its limits again
+void tilecache_shrink(void)
+{
+    pthread_mutex_lock(&lock);
+    while (ntiles > 0 && nbytes > limit())
+        evict();
+    pthread_mutex_unlock(&lock);
+}
+
+void tilecache_clear(void)
+{
+    pthread_mutex_lock(&lock);
+    while (ntiles > 0)
+        free(tiles[--ntiles].pixels);
+    nbytes = 0;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,19 @@
+#ifndef _TILECACHE_H
+#define _TILECACHE_H
+
+#define TILE_SIZE            128  // tiles are TILE_SIZE x TILE_SIZE 8-bit pixels
+#define TILECACHE_MAX_TILES 1024  // hard limit on the number of tiles kept
+
+extern int tilecache_size_kb, tilecache_budget_kb;
+extern unsigned int tilecache_hits, tilecache_misses;
+
+extern int tilecache_render(ddjvu_page_t *, int, ddjvu_render_mode_t, int,
+                            const ddjvu_rect_t *, const ddjvu_rect_t *, unsigned char *, int);
+extern unsigned long tilecache_bytes(void);
+extern void tilecache_shrink(void);
+extern void tilecache_clear(void);
+
+// in libdjvu.c
+extern ddjvu_format_t *djvu_format;
+
+#endif
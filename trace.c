@@ -0,0 +1,201 @@
+/*
+ * trace.c Timing of the stages a frame goes through, for libdjvu
+ *
+ * Each stage that is timed ends up as an event in a ring of the last
+ * TRACE_EVENTS ones: recording is a clock read and a few stores under a
+ * mutex, nothing is allocated or written out. trace_dump() saves the
+ * ring as a Chrome trace (chrome://tracing, Perfetto) when the document
+ * is closed, and the last TRACE_WINDOW durations of each stage give the
+ * p50/p95 shown in About.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "trace.h"
+#include "debug.h"
+
+#ifndef min
+#define min(a,b) (((a)<(b))?(a):(b))
+#endif
+
+struct trace_event {
+    unsigned long long ts;  // microseconds on the monotonic clock
+    unsigned int dur;       // 0 for a key
+    unsigned char stage, tid;
+    int arg;                // page number or key
+};
+
+static const char *stage_names[TRACE_STAGES] = {
+    "key", "decode", "render", "pack", "window mark", "frame", "turn"
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct trace_event events[TRACE_EVENTS];
+    unsigned int next; // events[next % TRACE_EVENTS] is the next one to go
+    unsigned int window[TRACE_STAGES][TRACE_WINDOW], nwindow[TRACE_STAGES];
+    pthread_t threads[TRACE_THREADS];
+    int nthreads;
+    unsigned long long key; // when the frame the viewer waits for was asked for, 0 if it isn't waiting
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+unsigned long long trace_now(void)
+{
+    struct timespec ts;
+    struct timeval tv;
+
+    // 2.4 kernels may not have it
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec*1000000ULL + tv.tv_usec;
+}
+
+// a small number for the calling thread, called with the lock held
+static inline int thread_id(void)
+{
+    pthread_t self = pthread_self();
+    int i;
+
+    for (i = 0; i < trace.nthreads; i++)
+        if (pthread_equal(trace.threads[i], self))
+            return i;
+    if (trace.nthreads == TRACE_THREADS)
+        return TRACE_THREADS;
+    trace.threads[trace.nthreads] = self;
+    return trace.nthreads++;
+}
+
+// called with the lock held
+static inline void add_event(int stage, unsigned long long ts, unsigned int dur, int arg)
+{
+    struct trace_event *e = &trace.events[trace.next++ % TRACE_EVENTS];
+
+    e->ts = ts;
+    e->dur = dur;
+    e->stage = stage;
+    e->tid = thread_id();
+    e->arg = arg;
+    if (stage != TRACE_KEY)
+        trace.window[stage][trace.nwindow[stage]++ % TRACE_WINDOW] = dur;
+}
+
+// stage took dur microseconds from start (trace_now())
+void trace_add(int stage, unsigned long long start, unsigned long long dur, int arg)
+{
+    pthread_mutex_lock(&trace.lock);
+    add_event(stage, start, dur, arg);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+// stage took from start until now
+void trace_span(int stage, unsigned long long start, int arg)
+{
+    trace_add(stage, start, trace_now() - start, arg);
+}
+
+/*
+   The viewer asked for another frame at when (trace_now()), the page
+   turn lasts until trace_handoff(). Of the calls it took, Next() inside
+   OnKeyPressed() for example, the first one counts.
+ */
+void trace_key(int key, unsigned long long when)
+{
+    pthread_mutex_lock(&trace.lock);
+    if (!trace.key || when < trace.key) {
+        add_event(TRACE_KEY, when, 0, key);
+        trace.key = when;
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+// the frame of page is with the viewer
+void trace_handoff(int page)
+{
+    unsigned long long now = trace_now();
+
+    pthread_mutex_lock(&trace.lock);
+    if (trace.key) {
+        add_event(TRACE_TURN, trace.key, now - trace.key, page);
+        trace.key = 0;
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+// how long stage took the last time, in milliseconds
+unsigned int trace_last_ms(int stage)
+{
+    unsigned int n = trace.nwindow[stage];
+
+    return n ? trace.window[stage][(n - 1) % TRACE_WINDOW]/1000 : 0;
+}
+
+static int compare_uint(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// the median and 95th percentile of the last durations of stage in ms, 0 if there are none
+int trace_percentiles(int stage, unsigned int *p50, unsigned int *p95)
+{
+    unsigned int v[TRACE_WINDOW];
+    int n;
+
+    pthread_mutex_lock(&trace.lock);
+    n = min(trace.nwindow[stage], TRACE_WINDOW);
+    memcpy(v, trace.window[stage], n*sizeof(*v));
+    pthread_mutex_unlock(&trace.lock);
+    if (!n)
+        return 0;
+    qsort(v, n, sizeof(*v), compare_uint);
+    *p50 = v[(50*n + 99)/100 - 1]/1000;
+    *p95 = v[(95*n + 99)/100 - 1]/1000;
+    return 1;
+}
+
+// write the events as Chrome trace event JSON to path, 0 on error
+int trace_dump(const char *path)
+{
+    const struct trace_event *e;
+    unsigned int i, first;
+    FILE *fp;
+
+    if (!(fp = fopen(path, "w"))) {
+        DPRINTF("%s: can't open %s\n", __FUNCTION__, path);
+        return 0;
+    }
+    pthread_mutex_lock(&trace.lock);
+    first = trace.next > TRACE_EVENTS ? trace.next - TRACE_EVENTS : 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = first; i != trace.next; i++) {
+        e = &trace.events[i % TRACE_EVENTS];
+        if (e->stage == TRACE_KEY)
+            fprintf(fp, "{\"name\":\"key\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":1,\"tid\":%d,\"args\":{\"key\":%d}}",
+                    e->ts, e->tid, e->arg);
+        else
+            fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":1,\"tid\":%d,\"args\":{\"page\":%d}}",
+                    stage_names[e->stage], e->ts, e->dur, e->tid, e->arg);
+        fprintf(fp, "%s\n", i + 1 != trace.next ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    pthread_mutex_unlock(&trace.lock);
+    return !fclose(fp);
+}
+
+// forget everything, for the next document
+void trace_reset(void)
+{
+    pthread_mutex_lock(&trace.lock);
+    trace.next = 0;
+    memset(trace.nwindow, 0, sizeof(trace.nwindow));
+    trace.nthreads = 0;
+    trace.key = 0;
+    pthread_mutex_unlock(&trace.lock);
+}
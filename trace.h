@@ -0,0 +1,32 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#define TRACE_EVENTS 2048  // the last this many events are kept, a power of 2
+#define TRACE_WINDOW 64    // durations of each stage the percentiles are taken over
+#define TRACE_THREADS 16
+
+enum {
+    TRACE_KEY,     // a key or a call from the viewer asking for another frame
+    TRACE_DECODE,
+    TRACE_RENDER,  // a part of a frame from djvulibre or the tile cache
+    TRACE_PACK,    // 8-bit pixels to the screen format (V3)
+    TRACE_WMARK,
+    TRACE_FRAME,   // the whole of GetPageData()
+    TRACE_TURN,    // from TRACE_KEY to the frame handed to the viewer
+    TRACE_STAGES
+};
+
+extern unsigned long long trace_now(void);
+extern void trace_add(int, unsigned long long, unsigned long long, int);
+extern void trace_span(int, unsigned long long, int);
+extern void trace_key(int, unsigned long long);
+extern void trace_handoff(int);
+extern unsigned int trace_last_ms(int);
+extern int trace_percentiles(int, unsigned int *, unsigned int *);
+extern int trace_dump(const char *);
+extern void trace_reset(void);
+
+#define TRACE_BEGIN(t)            unsigned long long t = trace_now()
+#define TRACE_END(t, stage, arg)  trace_span(stage, t, arg)
+
+#endif